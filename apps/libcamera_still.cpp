@@ -175,8 +175,12 @@ static void event_loop(LibcameraStillApp &app)
 	app.OpenCamera();
 
 	// Monitoring for keypresses and signals.
-	signal(SIGUSR1, default_signal_handler);
-	signal(SIGUSR2, default_signal_handler);
+	// With --latency-trace, SIGUSR1 is what asks for a report, and with a --timeline, SIGUSR2
+	// is what starts it recording.
+	if (!options->latency_trace)
+		signal(SIGUSR1, default_signal_handler);
+	if (options->timeline.empty())
+		signal(SIGUSR2, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
 
 	if (options->immediate)
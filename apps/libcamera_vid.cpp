@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 
 #include "core/libcamera_encoder.hpp"
+#include "core/timeline.hpp"
 #include "output/output.hpp"
 
 #include <math.h>
@@ -115,24 +116,24 @@ static int get_colourspace_flags(std::string const &codec)
 
 
 void freezeGraph(){
-	std::cout<< "freezeGraph()\n";
+	LOG(1, "freezeGraph()");
 	doShadow=true;
 	shadowTime = std::chrono::system_clock::now();
 }
 
 void calibrateMercury(){
-	std::cout<< "calibrateMercury()\n";
+	LOG(1, "calibrateMercury()");
 	doMercury=true;
 	doSlope=true;
 }
 
 void calibrateIncandescent(){
-	std::cout<< "calibrateIncandescent()\n";
+	LOG(1, "calibrateIncandescent()");
 	doIncandescent=true;
 }
 
 void calibrateDark(){
-	std::cout<< "calibrateDark()\n";
+	LOG(1, "calibrateDark()");
 	doDark=true;
 }
 
@@ -152,14 +153,22 @@ static void event_loop(LibcameraEncoder &app)
 	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
 
 	app.OpenCamera();
-	app.ConfigureVideo(get_colourspace_flags(options->codec));
+	unsigned int flags = get_colourspace_flags(options->codec);
+	// The spectrum can be read from the sensor's own data.
+	if (options->spectrum_stream == "raw")
+		flags |= LibcameraEncoder::FLAG_VIDEO_RAW;
+	app.ConfigureVideo(flags);
 	app.StartEncoder();
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
 
 	// Monitoring for keypresses and signals.
-	signal(SIGUSR1, default_signal_handler);
-	signal(SIGUSR2, default_signal_handler);
+	// With --latency-trace, SIGUSR1 is what asks for a report, and with a --timeline, SIGUSR2
+	// is what starts it recording.
+	if (!options->latency_trace)
+		signal(SIGUSR1, default_signal_handler);
+	if (options->timeline.empty())
+		signal(SIGUSR2, default_signal_handler);
 	signal(SIGINT, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
 
@@ -238,26 +247,24 @@ static void event_loop(LibcameraEncoder &app)
 		auto timeNow = std::chrono::system_clock::now();//duration_cast < milliseconds> ( chrono.system_clock::now().time_since_epoch() );
 		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(timeNow-lastSwitchTime);
 		if(switchState != lastSwitchState && switchState==0){
-			std::cout << "S";
-	                std::cout << switchState <<"_";
-			std::cout << duration.count() << " " << BETWEEN_PRESSES<< " \n";
+			LOG(2, "S" << switchState << "_" << duration.count() << " " << BETWEEN_PRESSES);
 			if(duration < std::chrono::milliseconds(DEBOUNCE)){
-				std::cout << "DEBOUNCE";
+				LOG(2, "DEBOUNCE");
 			}else if(switchState ==0 && numPresses==0){
 				numPresses++;
-				std::cout << "press_"<< numPresses<< " ";
+				LOG(2, "press_" << numPresses);
 				freezeGraph();
 				lastSwitchTime = timeNow;
 			}else if(switchState ==0 && duration < std::chrono::milliseconds(BETWEEN_PRESSES)){
 				numPresses++;
-				std::cout << "press_"<< numPresses<< " ";
+				LOG(2, "press_" << numPresses);
 				lastSwitchTime = timeNow;
 			}else{
 				lastSwitchTime = timeNow;
-				std::cout<< "Else";
+				LOG(2, "Else");
 			}
 		}else if(switchState==1 && (duration > std::chrono::milliseconds(BETWEEN_PRESSES) && numPresses>0)){
-			std::cout << "Finish Pressed_"<< numPresses;
+			LOG(1, "Finish Pressed_" << numPresses);
 			//libcamera::ControlList newControls;
 			//const libcamera::CameraControlValidator * validator = app.validator();
 			
@@ -277,6 +284,18 @@ static void event_loop(LibcameraEncoder &app)
 				case 7:
 					doSave=true;
 					break;
+				case 8: // Average frames for a master dark, with the light off
+					doDarkFrames=true;
+					break;
+				case 9: // The same for a master flat, of a continuum lamp
+					doFlatFrames=true;
+					break;
+				case 10: // Average the blank as the reference for transmittance and absorbance
+					doReference=true;
+					break;
+				case 11: // Record a window of --timeline
+					Timeline::Get().Start();
+					break;
 			}
 			numPresses =0;
 			lastSwitchTime = timeNow;
@@ -390,7 +409,7 @@ int main(int argc, char *argv[])
 {
 
 	if(gpioInitialise()<0){
-		std::cout<< "gpioInitialise() failure ";
+		LOG_ERROR("gpioInitialise() failure");
 		exit(0);
 	}
 	gpioSetMode(PIN_SWITCH, PI_INPUT);
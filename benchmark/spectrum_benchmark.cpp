@@ -0,0 +1,387 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spectrum_benchmark.cpp - time the spectrum engine's kernels on synthetic frames.
+ */
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <libcamera/formats.h>
+
+#include "core/libcamera_app.hpp"
+#include "core/spectrum_generator.hpp"
+#include "spectrum/baseline.hpp"
+#include "spectrum/colorimeter.hpp"
+#include "spectrum/spectrum_engine.hpp"
+#include "spectrum/spectrum_filter.hpp"
+#include "spectrum/spike_filter.hpp"
+
+// Each measurement is the median of this many batches.
+#define BATCHES 5
+
+struct BenchmarkOptions
+{
+	bool quick = false;
+	std::string output; // empty for stdout
+	int cpu = 0; // where the main thread is pinned, -1 for nowhere
+	double min_time = 0.2; // seconds per measurement
+};
+
+struct Result
+{
+	std::string kernel;
+	std::string format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int bins; // length of the spectrum
+	unsigned int threads;
+	unsigned long iterations;
+	double ns; // per call
+};
+
+static BenchmarkOptions parse_args(int argc, char *argv[])
+{
+	BenchmarkOptions options;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--quick")
+			options.quick = true;
+		else if (arg == "--output" && i + 1 < argc)
+			options.output = argv[++i];
+		else if (arg == "--cpu" && i + 1 < argc)
+			options.cpu = std::stoi(argv[++i]);
+		else if (arg == "--min-time" && i + 1 < argc)
+			options.min_time = std::stod(argv[++i]);
+		else
+			throw std::runtime_error("usage: " + std::string(argv[0]) +
+									 " [--quick] [--output file] [--cpu n] [--min-time seconds]");
+	}
+	return options;
+}
+
+static void pin_thread(int cpu)
+{
+	if (cpu < 0)
+		return;
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+		std::cerr << "Couldn't pin to cpu " << cpu << std::endl;
+}
+
+// Run fn until the caches are warm, then time batches of calls long enough to be
+// measured, returning the median time per call.
+static double measure(std::function<void()> const &fn, double min_time, unsigned long &iterations)
+{
+	using clock = std::chrono::steady_clock;
+	auto seconds = [](clock::duration d) { return std::chrono::duration<double>(d).count(); };
+
+	auto start = clock::now();
+	iterations = 0;
+	do
+	{
+		fn();
+		iterations++;
+	} while (iterations < 3 || seconds(clock::now() - start) < min_time / 10);
+	double per_call = seconds(clock::now() - start) / iterations;
+	iterations = std::max(1.0, min_time / BATCHES / per_call);
+
+	std::vector<double> batches;
+	for (unsigned int b = 0; b < BATCHES; b++)
+	{
+		start = clock::now();
+		for (unsigned long i = 0; i < iterations; i++)
+			fn();
+		batches.push_back(seconds(clock::now() - start) * 1e9 / iterations);
+	}
+	std::sort(batches.begin(), batches.end());
+	return batches[BATCHES / 2];
+}
+
+static void write_result(std::ostream &out, Result const &r)
+{
+	// ns per output bin, and frame pixels per second where there is a frame.
+	double ns_per_bin = r.ns / r.bins;
+	double mpix_per_s = r.height ? r.width * r.height * 1e3 / r.ns : 0;
+	out << "{\"kernel\": \"" << r.kernel << "\", \"format\": \"" << r.format << "\", \"width\": " << r.width
+		<< ", \"height\": " << r.height << ", \"bins\": " << r.bins << ", \"threads\": " << r.threads << ", \"iterations\": " << r.iterations
+		<< ", \"ns_per_call\": " << r.ns << ", \"ns_per_bin\": " << ns_per_bin << ", \"mpix_per_s\": " << mpix_per_s
+		<< "}" << std::endl;
+	std::cerr << r.kernel << " " << r.format << " " << r.width << "x" << r.height << " threads " << r.threads << ": "
+			  << r.ns / 1e3 << " us, " << ns_per_bin << " ns/bin";
+	if (r.height)
+		std::cerr << ", " << mpix_per_s << " MPix/s";
+	std::cerr << std::endl;
+}
+
+// A frame as the camera would deliver it, with the spectrum band filling the middle.
+static std::vector<uint8_t> make_frame(StreamInfo &info, unsigned int width, unsigned int height,
+									   libcamera::PixelFormat const &format)
+{
+	info.width = width;
+	info.height = height;
+	unsigned int row_bytes = width;
+	if (format == libcamera::formats::YUYV)
+		row_bytes = width * 2;
+	else if (format == libcamera::formats::RGB888)
+		row_bytes = width * 3;
+	else if (format == libcamera::formats::SBGGR10_CSI2P)
+		row_bytes = width * 5 / 4;
+	else if (format == libcamera::formats::SBGGR12_CSI2P)
+		row_bytes = width * 3 / 2;
+	else if (format == libcamera::formats::SBGGR16)
+		row_bytes = width * 2;
+	info.stride = (row_bytes + 63) & ~63;
+	info.pixel_format = format;
+	std::vector<uint8_t> frame(info.stride * height * 3 / 2);
+	SpectrumGenerator::Config config;
+	config.band_width = 0.25;
+	config.threads = std::max(std::thread::hardware_concurrency(), 1u);
+	SpectrumGenerator generator(config);
+	generator.Read(frame.data(), info);
+	return frame;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		BenchmarkOptions options = parse_args(argc, argv);
+		LibcameraApp::verbosity = 0;
+		pin_thread(options.cpu);
+
+		std::ofstream file;
+		if (!options.output.empty())
+		{
+			file.open(options.output);
+			if (!file)
+				throw std::runtime_error("failed to open " + options.output);
+		}
+		std::ostream &out = options.output.empty() ? std::cout : file;
+
+		using namespace libcamera::formats;
+		std::vector<libcamera::PixelFormat> formats = { YUV420, YUYV, RGB888, SBGGR10_CSI2P, SBGGR12_CSI2P, SBGGR16 };
+		std::vector<unsigned int> widths = { 640, 1280, 1920 };
+		std::vector<unsigned int> heights = { 64, 256, 1080 };
+		std::vector<unsigned int> thread_counts = { 1, 2, 4 };
+		if (options.quick)
+		{
+			formats = { YUV420, SBGGR12_CSI2P };
+			widths = { 1280 };
+			heights = { 64, 1080 };
+			thread_counts = { 1, 4 };
+		}
+
+		for (auto const &format : formats)
+		{
+			for (unsigned int width : widths)
+			{
+				for (unsigned int height : heights)
+				{
+					StreamInfo info;
+					std::vector<uint8_t> frame = make_frame(info, width, height, format);
+					SpectrumEngine engine;
+					engine.Configure(info);
+					for (auto extraction : { SpectrumEngine::Extraction::Box, SpectrumEngine::Extraction::Optimal })
+					{
+						engine.SetExtraction(extraction);
+						const bool box = extraction == SpectrumEngine::Extraction::Box;
+						for (unsigned int threads : thread_counts)
+						{
+							engine.SetThreads(threads, true);
+							Result r = { box ? "extract" : "extract_optimal", format.toString(), width, height,
+										 engine.Width(), threads, 0, 0 };
+							r.ns = measure([&]() { engine.Extract(frame.data(), info); }, options.min_time,
+										   r.iterations);
+							write_result(out, r);
+						}
+					}
+
+					// The same frame as three tracks, which should cost little more than one.
+					SpectrumEngine tracks;
+					tracks.SetTracks({ { 0, height / 3 }, { height / 3, 2 * height / 3 }, { 2 * height / 3, height } });
+					tracks.Configure(info);
+					for (unsigned int threads : thread_counts)
+					{
+						tracks.SetThreads(threads, true);
+						Result r = { "extract_3_tracks", format.toString(), width, height, tracks.Width(), threads,
+									 0, 0 };
+						r.ns = measure([&]() { tracks.Extract(frame.data(), info); }, options.min_time, r.iterations);
+						write_result(out, r);
+					}
+
+					// With a master dark to subtract from every pixel as it's read.
+					SpectrumEngine corrected;
+					corrected.Configure(info);
+					corrected.CaptureDarkFrames(1);
+					corrected.Extract(frame.data(), info);
+					for (unsigned int threads : thread_counts)
+					{
+						corrected.SetThreads(threads, true);
+						Result r = { "extract_corrected", format.toString(), width, height, corrected.Width(), threads,
+									 0, 0 };
+						r.ns = measure([&]() { corrected.Extract(frame.data(), info); }, options.min_time,
+									   r.iterations);
+						write_result(out, r);
+					}
+				}
+			}
+		}
+
+		// The per-bin kernels run on one spectrum from the middle sized frame.
+		for (unsigned int width : widths)
+		{
+			StreamInfo info;
+			std::vector<uint8_t> frame = make_frame(info, width, 256, formats[0]);
+			SpectrumEngine engine;
+			engine.Configure(info);
+			engine.Extract(frame.data(), info);
+			std::vector<float> spectrum(engine.Spectrum(), engine.Spectrum() + width);
+			Result r = { "", formats[0].toString(), width, 0, width, 1, 0, 0 };
+
+			r.kernel = "differentiate";
+			r.ns = measure([&]() { engine.Differentiate(engine.Spectrum(), width); }, options.min_time,
+						   r.iterations);
+			write_result(out, r);
+
+			r.kernel = "parse_peaks";
+			r.ns = measure([&]() { engine.ParsePeaks(); }, options.min_time, r.iterations);
+			write_result(out, r);
+
+			// XYZ, chromaticity and CCT on the axis ParsePeaks fitted, without test colour samples.
+			Colorimeter colorimeter;
+			std::vector<float> colour_weights;
+			colorimeter.Weigh(engine.Column(1) - engine.Column(0), engine.Column(0), width, colour_weights);
+			LightColour colour;
+			r.kernel = "colorimetry";
+			r.ns = measure([&]() { colorimeter.Measure(spectrum.data(), width, colour_weights.data(), colour); },
+						   options.min_time, r.iterations);
+			write_result(out, r);
+
+			r.kernel = "incandescent_cal";
+			// A one frame lamp, taken by Calibrate; the response is worked out every time.
+			r.ns = measure(
+				[&]() {
+					std::copy(spectrum.begin(), spectrum.end(), engine.Spectrum());
+					engine.IncandescentCal();
+					engine.Calibrate();
+				},
+				options.min_time, r.iterations);
+			write_result(out, r);
+
+			// Calibrate works in place, so this includes putting the spectrum back each time.
+			r.kernel = "calibrate";
+			r.ns = measure(
+				[&]() {
+					std::copy(spectrum.begin(), spectrum.end(), engine.Spectrum());
+					engine.Calibrate();
+				},
+				options.min_time, r.iterations);
+			write_result(out, r);
+
+			// The same against a reference of the spectrum itself.
+			std::copy(spectrum.begin(), spectrum.end(), engine.Spectrum());
+			engine.ReferenceCal();
+			engine.Calibrate();
+			static const std::pair<char const *, SpectrumEngine::Measurement> measurements[] = {
+				{ "transmittance", SpectrumEngine::Measurement::Transmittance },
+				{ "absorbance", SpectrumEngine::Measurement::Absorbance },
+			};
+			for (auto const &[name, measurement] : measurements)
+			{
+				engine.SetMeasurement(measurement);
+				r.kernel = name;
+				r.ns = measure(
+					[&]() {
+						std::copy(spectrum.begin(), spectrum.end(), engine.Spectrum());
+						engine.Calibrate();
+					},
+					options.min_time, r.iterations);
+				write_result(out, r);
+			}
+			engine.SetMeasurement(SpectrumEngine::Measurement::Intensity);
+
+			// Calibrate again, finding every peak and looking each up in the line database.
+			engine.SetLineIdentification(true);
+			r.kernel = "line_identification";
+			r.ns = measure(
+				[&]() {
+					std::copy(spectrum.begin(), spectrum.end(), engine.Spectrum());
+					engine.Calibrate();
+				},
+				options.min_time, r.iterations);
+			write_result(out, r);
+			engine.SetLineIdentification(false);
+
+			// Each bin's median over a 15 frame window, fed the same spectrum with a little noise.
+			SpikeFilter filter;
+			filter.Reset(width, 15);
+			std::vector<float> noisy(width);
+			unsigned int n = 0;
+			r.kernel = "spike_filter";
+			r.ns = measure(
+				[&]() {
+					for (unsigned int i = 0; i < width; i++)
+						noisy[i] = spectrum[i] + ((i * 7 + n) % 13);
+					n++;
+					filter.Filter(noisy.data(), 5);
+				},
+				options.min_time, r.iterations);
+			write_result(out, r);
+
+			// The filters, as the display and the peak and slope searches use them.
+			std::vector<float> filtered(width);
+			const std::pair<char const *, SpectrumFilter> filters[] = {
+				{ "savitzky_golay_7", SpectrumFilter::SavitzkyGolay(7, 2) },
+				{ "savitzky_golay_derivative_5", SpectrumFilter::SavitzkyGolay(5, 2, 1) },
+				{ "boxcar_9", SpectrumFilter::Boxcar(9) },
+				{ "gaussian_5", SpectrumFilter::Gaussian(5) },
+			};
+			for (auto const &[name, filter] : filters)
+			{
+				r.kernel = name;
+				r.ns = measure([&]() { filter.Apply(spectrum.data(), filtered.data(), width); }, options.min_time,
+							   r.iterations);
+				write_result(out, r);
+			}
+
+			// Each baseline method, warm from the frame before as it is when running.
+			static const std::pair<char const *, BaselineEstimator::Method> methods[] = {
+				{ "baseline_rolling_ball", BaselineEstimator::Method::RollingBall },
+				{ "baseline_als", BaselineEstimator::Method::Als },
+				{ "baseline_polynomial", BaselineEstimator::Method::Polynomial },
+			};
+			for (auto const &[name, method] : methods)
+			{
+				BaselineEstimator::Config config;
+				config.method = method;
+				BaselineEstimator baseline;
+				baseline.Reset(width, config);
+				baseline.Update(spectrum.data());
+				r.kernel = name;
+				r.ns = measure([&]() { baseline.Update(spectrum.data()); }, options.min_time, r.iterations);
+				write_result(out, r);
+			}
+		}
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
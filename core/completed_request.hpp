@@ -25,6 +25,11 @@ struct CompletedRequest
 	{
 		r->reuse();
 	}
+	// Frames that didn't come from a camera have no Request behind them.
+	CompletedRequest(unsigned int seq, BufferMap const &b, ControlList const &m)
+		: sequence(seq), buffers(b), metadata(m), request(nullptr)
+	{
+	}
 	unsigned int sequence;
 	BufferMap buffers;
 	ControlList metadata;
@@ -0,0 +1,312 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * latency_trace.cpp - record where each frame's time goes between the sensor and the screen.
+ */
+
+#include <signal.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+
+#include "core/latency_trace.hpp"
+#include "core/logging.hpp"
+
+// Events each thread can have waiting for the collector. More than this and they are lost.
+#define RING_SIZE 1024
+// Frames this far behind the newest one to reach the screen never will.
+#define FRAME_HORIZON 64
+// How often the collector drains the rings.
+#define COLLECT_INTERVAL std::chrono::milliseconds(100)
+#define BUCKETS_PER_OCTAVE 8
+#define NUM_BUCKETS (BUCKETS_PER_OCTAVE * 40u)
+
+static char const *const stage_names[] = { "sensor",		 "request complete", "post-process start",
+										   "post-process end", "extract start",	"extract end",
+										   "render submit",	"swap" };
+
+static thread_local unsigned int current_frame;
+static std::atomic<bool> report_requested;
+
+static void report_signal_handler(int)
+{
+	report_requested.store(true, std::memory_order_relaxed);
+}
+
+LatencyHistogram::LatencyHistogram() : buckets_(NUM_BUCKETS, 0), count_(0), sum_(0), max_(0)
+{
+}
+
+void LatencyHistogram::Add(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned int index = us;
+	if (us >= BUCKETS_PER_OCTAVE)
+	{
+		// Bucket i of the octave [2^e, 2^(e+1)) starts at (8 + i) * 2^(e-3).
+		unsigned int e = 63 - __builtin_clzll(us);
+		index = BUCKETS_PER_OCTAVE * (e - 2) + ((us >> (e - 3)) & (BUCKETS_PER_OCTAVE - 1));
+	}
+	buckets_[std::min(index, NUM_BUCKETS - 1)]++;
+	count_++;
+	sum_ += ns;
+	max_ = std::max(max_, ns);
+}
+
+uint64_t LatencyHistogram::Percentile(double fraction) const
+{
+	uint64_t target = std::max<uint64_t>(1, std::ceil(fraction * count_));
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < NUM_BUCKETS; i++)
+	{
+		seen += buckets_[i];
+		if (seen >= target)
+		{
+			uint64_t upper_us = i + 1;
+			if (i >= BUCKETS_PER_OCTAVE)
+			{
+				unsigned int e = i / BUCKETS_PER_OCTAVE + 2;
+				upper_us = (uint64_t)(BUCKETS_PER_OCTAVE + i % BUCKETS_PER_OCTAVE + 1) << (e - 3);
+			}
+			return std::min(upper_us * 1000, max_);
+		}
+	}
+	return max_;
+}
+
+// Written only by its own thread and read only by the collector, so the head and tail
+// are all the synchronisation needed.
+struct LatencyTrace::Ring
+{
+	Event events[RING_SIZE];
+	std::atomic<uint64_t> head { 0 };
+	std::atomic<uint64_t> tail { 0 };
+	std::atomic<uint64_t> lost { 0 };
+	std::atomic<bool> closed { false }; // the thread has gone
+};
+
+LatencyTrace &LatencyTrace::Get()
+{
+	static LatencyTrace trace;
+	return trace;
+}
+
+LatencyTrace::LatencyTrace() : enabled_(false), incomplete_(0), lost_(0), abort_(false)
+{
+}
+
+LatencyTrace::~LatencyTrace()
+{
+	if (thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(thread_mutex_);
+			abort_ = true;
+		}
+		cond_.notify_one();
+		thread_.join();
+	}
+}
+
+void LatencyTrace::Enable()
+{
+	if (enabled_.exchange(true))
+		return;
+	thread_ = std::thread(&LatencyTrace::collectorThread, this);
+	signal(SIGUSR1, report_signal_handler);
+}
+
+uint64_t LatencyTrace::Now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void LatencyTrace::SetFrame(unsigned int sequence)
+{
+	current_frame = sequence;
+}
+
+void LatencyTrace::Mark(TraceStage stage)
+{
+	Record(current_frame, stage);
+}
+
+void LatencyTrace::push(unsigned int sequence, TraceStage stage, uint64_t time_ns)
+{
+	// Each thread's ring is made the first time it records anything, and given up when
+	// the thread exits. The collector frees it once it's empty.
+	struct Handle
+	{
+		std::shared_ptr<Ring> ring;
+		~Handle()
+		{
+			if (ring)
+				ring->closed.store(true, std::memory_order_release);
+		}
+	};
+	thread_local Handle handle;
+	if (!handle.ring)
+	{
+		handle.ring = std::make_shared<Ring>();
+		std::lock_guard<std::mutex> lock(rings_mutex_);
+		rings_.push_back(handle.ring);
+	}
+
+	Ring &ring = *handle.ring;
+	uint64_t head = ring.head.load(std::memory_order_relaxed);
+	if (head - ring.tail.load(std::memory_order_acquire) >= RING_SIZE)
+	{
+		ring.lost.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	ring.events[head % RING_SIZE] = { time_ns, sequence, stage };
+	ring.head.store(head + 1, std::memory_order_release);
+}
+
+void LatencyTrace::collect()
+{
+	std::vector<std::shared_ptr<Ring>> rings;
+	{
+		std::lock_guard<std::mutex> lock(rings_mutex_);
+		rings = rings_;
+	}
+
+	// A frame's earlier stages may sit in a ring drained before the one its swap came
+	// through, so only frames that had already swapped before this pass are finished.
+	std::vector<unsigned int> ready;
+	for (auto const &[sequence, frame] : frames_)
+	{
+		if (frame.time[(int)TraceStage::Swap])
+			ready.push_back(sequence);
+	}
+
+	for (auto const &ring : rings)
+	{
+		bool closed = ring->closed.load(std::memory_order_acquire);
+		uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		for (; tail != head; tail++)
+		{
+			Event const &event = ring->events[tail % RING_SIZE];
+			frames_[event.sequence].time[(int)event.stage] = event.time;
+		}
+		ring->tail.store(tail, std::memory_order_release);
+		lost_ += ring->lost.exchange(0, std::memory_order_relaxed);
+		if (closed && tail == ring->head.load(std::memory_order_acquire))
+		{
+			std::lock_guard<std::mutex> lock(rings_mutex_);
+			rings_.erase(std::remove(rings_.begin(), rings_.end(), ring), rings_.end());
+		}
+	}
+
+	for (unsigned int sequence : ready)
+	{
+		finish(frames_[sequence]);
+		frames_.erase(sequence);
+	}
+	if (!ready.empty())
+	{
+		unsigned int horizon = ready.back() > FRAME_HORIZON ? ready.back() - FRAME_HORIZON : 0;
+		for (auto it = frames_.begin(); it != frames_.end() && it->first < horizon;)
+		{
+			incomplete_++;
+			it = frames_.erase(it);
+		}
+	}
+}
+
+void LatencyTrace::finish(Frame const &frame)
+{
+	// Each stage is timed from the last stage before it that the frame went through.
+	uint64_t prev = frame.time[(int)TraceStage::Sensor];
+	for (int s = (int)TraceStage::Sensor + 1; s < (int)TraceStage::Count; s++)
+	{
+		uint64_t t = frame.time[s];
+		if (!t)
+			continue;
+		if (prev)
+			stages_[s].Add(t > prev ? t - prev : 0);
+		prev = t;
+	}
+	uint64_t sensor = frame.time[(int)TraceStage::Sensor];
+	uint64_t swap = frame.time[(int)TraceStage::Swap];
+	if (sensor)
+		total_.Add(swap > sensor ? swap - sensor : 0);
+}
+
+void LatencyTrace::Report(std::ostream &os)
+{
+	std::lock_guard<std::mutex> lock(collect_mutex_);
+	collect();
+
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	auto row = [&os](char const *name, LatencyHistogram const &h) {
+		os << std::left << std::setw(20) << name << std::right << std::setw(8) << h.Count() << std::fixed
+		   << std::setprecision(2) << std::setw(10) << h.Percentile(0.5) / 1e6 << std::setw(10)
+		   << h.Percentile(0.99) / 1e6 << std::setw(10) << h.Max() / 1e6 << std::endl;
+	};
+	os << "Latency (ms)           count       p50       p99       max" << std::endl;
+	for (int s = (int)TraceStage::Sensor + 1; s < (int)TraceStage::Count; s++)
+	{
+		if (stages_[s].Count())
+			row(stage_names[s], stages_[s]);
+	}
+	row("sensor to swap", total_);
+	os << "Frames that never reached the screen: " << incomplete_ << ", trace events lost: " << lost_
+	   << std::endl;
+	os.flags(flags);
+	os.precision(precision);
+}
+
+void LatencyTrace::WriteMetrics(std::ostream &os)
+{
+	std::lock_guard<std::mutex> lock(collect_mutex_);
+	collect();
+
+	auto summary = [&os](char const *stage, LatencyHistogram const &h) {
+		for (double q : { 0.5, 0.99 })
+			os << "spectroscope_stage_latency_seconds{stage=\"" << stage << "\",quantile=\"" << q << "\"} "
+			   << h.Percentile(q) / 1e9 << "\n";
+		os << "spectroscope_stage_latency_seconds_sum{stage=\"" << stage << "\"} " << h.Sum() / 1e9 << "\n";
+		os << "spectroscope_stage_latency_seconds_count{stage=\"" << stage << "\"} " << h.Count() << "\n";
+	};
+	os << "# HELP spectroscope_stage_latency_seconds Time each frame takes to reach a stage from the stage before.\n";
+	os << "# TYPE spectroscope_stage_latency_seconds summary\n";
+	for (int s = (int)TraceStage::Sensor + 1; s < (int)TraceStage::Count; s++)
+		summary(stage_names[s], stages_[s]);
+	summary("sensor to swap", total_);
+	os << "# HELP spectroscope_stage_latency_max_seconds Longest time each frame has taken to reach a stage.\n";
+	os << "# TYPE spectroscope_stage_latency_max_seconds gauge\n";
+	for (int s = (int)TraceStage::Sensor + 1; s < (int)TraceStage::Count; s++)
+		os << "spectroscope_stage_latency_max_seconds{stage=\"" << stage_names[s] << "\"} " << stages_[s].Max() / 1e9
+		   << "\n";
+	os << "spectroscope_stage_latency_max_seconds{stage=\"sensor to swap\"} " << total_.Max() / 1e9 << "\n";
+}
+
+void LatencyTrace::collectorThread()
+{
+	std::unique_lock<std::mutex> lock(thread_mutex_);
+	while (!abort_)
+	{
+		cond_.wait_for(lock, COLLECT_INTERVAL);
+		if (report_requested.exchange(false, std::memory_order_relaxed))
+		{
+			// Keep the report in one piece, rather than cut into by queued log messages.
+			Logger::Get().Flush();
+			Report(std::cerr);
+		}
+		else
+		{
+			std::lock_guard<std::mutex> collect_lock(collect_mutex_);
+			collect();
+		}
+	}
+}
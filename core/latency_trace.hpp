@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * latency_trace.hpp - record where each frame's time goes between the sensor and the screen.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+// The points a frame passes on its way to the screen, in order.
+enum class TraceStage
+{
+	Sensor, // the SensorTimestamp of the frame
+	RequestComplete,
+	PostProcessStart,
+	PostProcessEnd,
+	ExtractStart,
+	ExtractEnd,
+	RenderSubmit,
+	Swap, // eglSwapBuffers has returned
+	Count
+};
+
+// Latencies in a log-linear histogram: 8 buckets per power of two of microseconds, which
+// keeps percentiles within about 10% from 1us up to over an hour.
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+	void Add(uint64_t ns);
+	uint64_t Count() const { return count_; }
+	uint64_t Sum() const { return sum_; }
+	uint64_t Max() const { return max_; }
+	// Upper bound in ns of the bucket holding the given fraction of the samples.
+	uint64_t Percentile(double fraction) const;
+
+private:
+	std::vector<uint64_t> buckets_;
+	uint64_t count_;
+	uint64_t sum_;
+	uint64_t max_;
+};
+
+// Trace points are cheap enough to leave in: when tracing is off they return at once,
+// and when it's on each thread writes to its own lock-free ring. A collector thread
+// drains the rings, pairs the stages up by frame sequence number, and accumulates a
+// histogram for each stage of the time since the stage before it, plus sensor to swap.
+//
+// Times are CLOCK_MONOTONIC, the clock of libcamera's sensor timestamps.
+class LatencyTrace
+{
+public:
+	static LatencyTrace &Get();
+	~LatencyTrace();
+
+	// Tracing starts off. Once on, SIGUSR1 prints the report so far.
+	void Enable();
+	bool Enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+	static uint64_t Now();
+	void Record(unsigned int sequence, TraceStage stage, uint64_t time_ns)
+	{
+		if (Enabled())
+			push(sequence, stage, time_ns);
+	}
+	void Record(unsigned int sequence, TraceStage stage)
+	{
+		if (Enabled())
+			push(sequence, stage, Now());
+	}
+
+	// For code that doesn't know which frame it is working on, the frame is set once on
+	// the thread and the stages marked against it.
+	static void SetFrame(unsigned int sequence);
+	void Mark(TraceStage stage);
+
+	void Report(std::ostream &os);
+	// The same, as Prometheus summaries.
+	void WriteMetrics(std::ostream &os);
+
+private:
+	struct Event
+	{
+		uint64_t time;
+		uint32_t sequence;
+		TraceStage stage;
+	};
+	struct Ring;
+	struct Frame
+	{
+		uint64_t time[(int)TraceStage::Count] = {};
+	};
+
+	LatencyTrace();
+	void push(unsigned int sequence, TraceStage stage, uint64_t time_ns);
+	void collect();
+	void finish(Frame const &frame);
+	void collectorThread();
+
+	std::atomic<bool> enabled_;
+	std::mutex rings_mutex_;
+	std::vector<std::shared_ptr<Ring>> rings_;
+	// Everything below belongs to whoever holds collect_mutex_.
+	std::mutex collect_mutex_;
+	std::map<unsigned int, Frame> frames_;
+	LatencyHistogram stages_[(int)TraceStage::Count];
+	LatencyHistogram total_;
+	uint64_t incomplete_;
+	uint64_t lost_;
+	std::mutex thread_mutex_;
+	std::condition_variable cond_;
+	bool abort_;
+	std::thread thread_;
+};
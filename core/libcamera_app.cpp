@@ -8,8 +8,12 @@
 #include "preview/preview.hpp"
 
 #include "core/frame_info.hpp"
+#include "core/latency_trace.hpp"
 #include "core/libcamera_app.hpp"
+#include "core/metrics.hpp"
 #include "core/options.hpp"
+#include "core/timeline.hpp"
+#include "core/replay_source.hpp"
 
 #include <cmath>
 #include <fcntl.h>
@@ -110,48 +114,74 @@ LibcameraApp::~LibcameraApp()
 	StopCamera();
 	Teardown();
 	CloseCamera();
+
+	if (LatencyTrace::Get().Enabled())
+	{
+		// The report goes straight to stderr, so let the log writer finish first.
+		Logger::Get().Flush();
+		LatencyTrace::Get().Report(std::cerr);
+		std::cerr << "Preview frames displayed: " << preview_frames_displayed_
+				  << ", dropped: " << preview_frames_dropped_ << std::endl;
+	}
 }
 
 std::string const &LibcameraApp::CameraId() const
 {
-	return camera_->id();
+	return replay_ ? replay_->Id() : camera_->id();
 }
 
 std::string LibcameraApp::CameraModel() const
 {
+	if (replay_)
+		return replay_->Id();
 	auto model = camera_->properties().get(properties::Model);
 	return model ? *model : camera_->id();
 }
 
 void LibcameraApp::OpenCamera()
 {
+	if (options_->latency_trace)
+		LatencyTrace::Get().Enable();
+	if (!options_->timeline.empty())
+		Timeline::Get().Enable(options_->timeline, options_->timeline_seconds);
+	if (!options_->metrics.empty())
+		Metrics::Get().Serve(options_->metrics);
+
 	// Make a preview window.
 	preview_ = std::unique_ptr<Preview>(make_preview(options_.get()));
 	preview_->SetDoneCallback(std::bind(&LibcameraApp::previewDoneCallback, this, std::placeholders::_1));
 
-	LOG(2, "Opening camera...");
+	if (!options_->replay.empty())
+	{
+		LOG(2, "Opening replay source...");
+		replay_ = std::make_unique<ReplaySource>(options_.get());
+	}
+	else
+	{
+		LOG(2, "Opening camera...");
 
-	camera_manager_ = std::make_unique<CameraManager>();
-	int ret = camera_manager_->start();
-	if (ret)
-		throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+		camera_manager_ = std::make_unique<CameraManager>();
+		int ret = camera_manager_->start();
+		if (ret)
+			throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
 
-	std::vector<std::shared_ptr<libcamera::Camera>> cameras = LibcameraApp::GetCameras(camera_manager_);
-	if (cameras.size() == 0)
-		throw std::runtime_error("no cameras available");
-	if (options_->camera >= cameras.size())
-		throw std::runtime_error("selected camera is not available");
+		std::vector<std::shared_ptr<libcamera::Camera>> cameras = LibcameraApp::GetCameras(camera_manager_);
+		if (cameras.size() == 0)
+			throw std::runtime_error("no cameras available");
+		if (options_->camera >= cameras.size())
+			throw std::runtime_error("selected camera is not available");
 
-	std::string const &cam_id = cameras[options_->camera]->id();
-	camera_ = camera_manager_->get(cam_id);
-	if (!camera_)
-		throw std::runtime_error("failed to find camera " + cam_id);
+		std::string const &cam_id = cameras[options_->camera]->id();
+		camera_ = camera_manager_->get(cam_id);
+		if (!camera_)
+			throw std::runtime_error("failed to find camera " + cam_id);
 
-	if (camera_->acquire())
-		throw std::runtime_error("failed to acquire camera " + cam_id);
-	camera_acquired_ = true;
+		if (camera_->acquire())
+			throw std::runtime_error("failed to acquire camera " + cam_id);
+		camera_acquired_ = true;
 
-	LOG(2, "Acquired camera " << cam_id);
+		LOG(2, "Acquired camera " << cam_id);
+	}
 
 	if (!options_->post_process_file.empty())
 		post_processor_.Read(options_->post_process_file);
@@ -159,7 +189,7 @@ void LibcameraApp::OpenCamera()
 	post_processor_.SetCallback(
 		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
 
-	if (options_->framerate)
+	if (options_->framerate && camera_)
 	{
 		std::unique_ptr<CameraConfiguration> config = camera_->generateConfiguration({ libcamera::StreamRole::Raw });
 		const libcamera::StreamFormats &formats = config->at(0).formats();
@@ -198,6 +228,8 @@ void LibcameraApp::CloseCamera()
 
 	camera_manager_.reset();
 
+	replay_.reset();
+
 	if (!options_->help)
 		LOG(2, "Camera closed");
 }
@@ -254,6 +286,12 @@ void LibcameraApp::ConfigureViewfinder()
 {
 	LOG(2, "Configuring viewfinder...");
 
+	if (replay_)
+	{
+		setupReplay("viewfinder");
+		return;
+	}
+
 	bool select_mode = options_->framerate && options_->framerate.value() && options_->viewfinder_mode_string.empty();
 	int lores_stream_num = 0, raw_stream_num = 0;
 	bool have_lores_stream = options_->lores_width && options_->lores_height;
@@ -346,6 +384,12 @@ void LibcameraApp::ConfigureStill(unsigned int flags)
 {
 	LOG(2, "Configuring still capture...");
 
+	if (replay_)
+	{
+		setupReplay("still");
+		return;
+	}
+
 	// Always request a raw stream as this forces the full resolution capture mode.
 	// (options_->mode can override the choice of camera mode, however.)
 	StreamRoles stream_roles = { StreamRole::StillCapture, StreamRole::Raw };
@@ -397,6 +441,12 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 {
 	LOG(2, "Configuring video...");
 
+	if (replay_)
+	{
+		setupReplay("video");
+		return;
+	}
+
 	bool select_mode = options_->framerate && options_->framerate.value() && options_->mode_string.empty();
 	bool have_raw_stream = (flags & FLAG_VIDEO_RAW) || options_->mode.bit_depth || select_mode;
 	bool have_lores_stream = options_->lores_width && options_->lores_height;
@@ -492,6 +542,9 @@ void LibcameraApp::Teardown()
 	}
 	mapped_buffers_.clear();
 
+	if (replay_)
+		replay_->Teardown();
+
 	delete allocator_;
 	allocator_ = nullptr;
 
@@ -504,6 +557,20 @@ void LibcameraApp::Teardown()
 
 void LibcameraApp::StartCamera()
 {
+	if (replay_)
+	{
+		// None of the camera controls mean anything to replayed frames.
+		controls_.clear();
+		camera_started_ = true;
+		last_timestamp_ = 0;
+		post_processor_.Start();
+		replay_->Start([this](BufferMap const &buffers, ControlList const &metadata)
+					   { completeRequest(new CompletedRequest(sequence_++, buffers, metadata)); },
+					   [this]() { msg_queue_.Post(Msg(MsgType::Quit)); });
+		LOG(2, "Replay started!");
+		return;
+	}
+
 	// This makes all the Request objects that we shall need.
 	makeRequests();
 
@@ -641,12 +708,17 @@ void LibcameraApp::StartCamera()
 
 void LibcameraApp::StopCamera()
 {
+	// The replay thread can drop the last reference to a frame, which then takes
+	// camera_stop_mutex_ in queueRequest, so stop it before taking the lock.
+	if (replay_)
+		replay_->Stop();
+
 	{
 		// We don't want QueueRequest to run asynchronously while we stop the camera.
 		std::lock_guard<std::mutex> lock(camera_stop_mutex_);
 		if (camera_started_)
 		{
-			if (camera_->stop())
+			if (!replay_ && camera_->stop())
 				throw std::runtime_error("failed to stop camera");
 
 			post_processor_.Stop();
@@ -702,6 +774,13 @@ void LibcameraApp::queueRequest(CompletedRequest *completed_request)
 
 	Request *request = completed_request->request;
 	delete completed_request;
+
+	if (replay_)
+	{
+		if (camera_started_ && request_found)
+			replay_->Requeue(buffers);
+		return;
+	}
 	assert(request);
 
 	if (!camera_started_ || !request_found)
@@ -787,7 +866,10 @@ void LibcameraApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *s
 	if (!preview_item_.stream)
 		preview_item_ = PreviewItem(completed_request, stream); // copy the shared_ptr here
 	else
+	{
 		preview_frames_dropped_++;
+		Metrics::Get().Add(Metrics::Get().preview_frames_dropped);
+	}
 	preview_cond_var_.notify_one();
 }
 
@@ -838,27 +920,13 @@ void LibcameraApp::setupCapture()
 	for (StreamConfiguration &config : *configuration_)
 	{
 		Stream *stream = config.stream();
-		std::cout << "stream=" << stream;
+		LOG(2, "stream=" << stream);
 		if (allocator_->allocate(stream) < 0)
 			throw std::runtime_error("failed to allocate capture buffers");
 
 		for (const std::unique_ptr<FrameBuffer> &buffer : allocator_->buffers(stream))
 		{
-			// "Single plane" buffers appear as multi-plane here, but we can spot them because then
-			// planes all share the same fd. We accumulate them so as to mmap the buffer only once.
-			size_t buffer_size = 0;
-			for (unsigned i = 0; i < buffer->planes().size(); i++)
-			{
-				const FrameBuffer::Plane &plane = buffer->planes()[i];
-				buffer_size += plane.length;
-				if (i == buffer->planes().size() - 1 || plane.fd.get() != buffer->planes()[i + 1].fd.get())
-				{
-					void *memory = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
-					mapped_buffers_[buffer.get()].push_back(
-						libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), buffer_size));
-					buffer_size = 0;
-				}
-			}
+			mapBuffer(buffer.get());
 			frame_buffers_[stream].push(buffer.get());
 		}
 	}
@@ -869,6 +937,45 @@ void LibcameraApp::setupCapture()
 	// The requests will be made when StartCamera() is called.
 }
 
+void LibcameraApp::mapBuffer(FrameBuffer *buffer)
+{
+	// "Single plane" buffers appear as multi-plane here, but we can spot them because then
+	// planes all share the same fd. We accumulate them so as to mmap the buffer only once.
+	size_t buffer_size = 0;
+	for (unsigned i = 0; i < buffer->planes().size(); i++)
+	{
+		const FrameBuffer::Plane &plane = buffer->planes()[i];
+		buffer_size += plane.length;
+		if (i == buffer->planes().size() - 1 || plane.fd.get() != buffer->planes()[i + 1].fd.get())
+		{
+			void *memory = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
+			mapped_buffers_[buffer].push_back(libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), buffer_size));
+			buffer_size = 0;
+		}
+	}
+}
+
+void LibcameraApp::setupReplay(std::string const &name)
+{
+	replay_->Configure(options_->buffer_count ? options_->buffer_count : 6);
+
+	streams_[name] = replay_->MainStream();
+	if (replay_->RawStream())
+		streams_["raw"] = replay_->RawStream();
+	for (auto const &stream : streams_)
+	{
+		for (auto const &buffer : replay_->Buffers(stream.second))
+			mapBuffer(buffer.get());
+	}
+	LOG(2, "Replay buffers allocated and mapped");
+
+	startPreview();
+
+	post_processor_.Configure();
+
+	LOG(2, "Replay setup complete");
+}
+
 void LibcameraApp::makeRequests()
 {
 	auto free_buffers(frame_buffers_);
@@ -911,8 +1018,13 @@ void LibcameraApp::requestComplete(Request *request)
 
 		return;
 	}
-//	std::cout << "Request Complete\n";
-	CompletedRequest *r = new CompletedRequest(sequence_++, request);
+	Timeline::NameThread("libcamera");
+	completeRequest(new CompletedRequest(sequence_++, request));
+}
+
+void LibcameraApp::completeRequest(CompletedRequest *r)
+{
+	TimelineScope scope("request complete", r->sequence);
 	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
 	{
 		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
@@ -929,6 +1041,9 @@ void LibcameraApp::requestComplete(Request *request)
 	else
 		payload->framerate = 1e9 / (timestamp - last_timestamp_);
 	last_timestamp_ = timestamp;
+	LatencyTrace::Get().Record(payload->sequence, TraceStage::Sensor, timestamp);
+	LatencyTrace::Get().Record(payload->sequence, TraceStage::RequestComplete);
+	Metrics::Get().Add(Metrics::Get().frames_captured);
 
 	post_processor_.Process(payload); // post-processor can re-use our shared_ptr
 }
@@ -944,7 +1059,7 @@ void LibcameraApp::previewDoneCallback(int fd)
 
 void LibcameraApp::startPreview()
 {
-	std::cout<<"startPreview()\n";
+	LOG(2, "startPreview()");
 	preview_abort_ = false;
 	preview_thread_ = std::thread(&LibcameraApp::previewThread, this);
 }
@@ -966,6 +1081,7 @@ void LibcameraApp::stopPreview()
 
 void LibcameraApp::previewThread()
 {
+	Timeline::NameThread("preview");
 	while (true)
 	{
 		PreviewItem item;
@@ -990,6 +1106,16 @@ void LibcameraApp::previewThread()
 		FrameBuffer *buffer = item.completed_request->buffers[item.stream];
 		libcamera::Span span = Mmap(buffer)[0];
 
+		// The spectrum may come from the raw stream of the same request, which is held
+		// along with the displayed buffer.
+		StreamInfo analysis_info;
+		Stream *analysis = options_->spectrum_stream == "raw" ? RawStream(&analysis_info) : nullptr;
+		auto const &request_buffers = item.completed_request->buffers;
+		if (analysis && request_buffers.count(analysis))
+			preview_->SetAnalysisFrame(Mmap(request_buffers.at(analysis))[0], analysis_info);
+		else
+			preview_->SetAnalysisFrame({}, info);
+
 		// Fill the frame info with the ControlList items and ancillary bits.
 		FrameInfo frame_info(item.completed_request->metadata);
 		frame_info.fps = item.completed_request->framerate;
@@ -1007,7 +1133,18 @@ void LibcameraApp::previewThread()
 			msg_queue_.Post(Msg(MsgType::Quit));
 		}
 		preview_frames_displayed_++;
-		preview_->Show(fd, span, info);
+		Metrics &metrics = Metrics::Get();
+		metrics.Add(metrics.preview_frames_displayed);
+		metrics.Set(metrics.exposure_time, frame_info.exposure_time);
+		metrics.Set(metrics.analogue_gain, frame_info.analogue_gain);
+		metrics.Set(metrics.digital_gain, frame_info.digital_gain);
+		preview_->SetExposure(frame_info.exposure_time, frame_info.analogue_gain);
+		// The preview marks its own stages against this frame.
+		LatencyTrace::SetFrame(frame_info.sequence);
+		{
+			TimelineScope scope("show", frame_info.sequence);
+			preview_->Show(fd, span, info);
+		}
 		if (!options_->info_text.empty())
 		{
 			std::string s = frame_info.ToString(options_->info_text);
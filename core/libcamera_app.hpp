@@ -36,6 +36,7 @@
 
 struct Options;
 class Preview;
+class ReplaySource;
 struct Mode;
 
 namespace controls = libcamera::controls;
@@ -216,9 +217,12 @@ private:
 	};
 
 	void setupCapture();
+	void setupReplay(std::string const &name);
+	void mapBuffer(FrameBuffer *buffer);
 	void makeRequests();
 	void queueRequest(CompletedRequest *completed_request);
 	void requestComplete(Request *request);
+	void completeRequest(CompletedRequest *completed_request);
 	void previewDoneCallback(int fd);
 	void startPreview();
 	void stopPreview();
@@ -229,6 +233,7 @@ private:
 	std::unique_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
 	bool camera_acquired_ = false;
+	std::unique_ptr<ReplaySource> replay_; // stands in for camera_ when replaying frames
 	std::unique_ptr<CameraConfiguration> configuration_;
 	std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
 	std::map<std::string, Stream *> streams_;
@@ -8,6 +8,7 @@
 #pragma once
 
 #include "core/libcamera_app.hpp"
+#include "core/metrics.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
@@ -47,6 +48,7 @@ public:
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
 			encode_buffer_queue_.push(completed_request); // creates a new reference
+			Metrics::Get().encoder_queue.fetch_add(1, std::memory_order_relaxed);
 		}
 		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 	}
@@ -80,6 +82,7 @@ private:
 			if (metadata_ready_callback_ && !GetOptions()->metadata.empty())
 				metadata_ready_callback_(completed_request->metadata);
 			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			Metrics::Get().encoder_queue.fetch_sub(1, std::memory_order_relaxed);
 		}
 	}
 
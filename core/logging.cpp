@@ -0,0 +1,211 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * logging.cpp - levelled logging that stays off the threads doing the work.
+ */
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+#include "core/logging.hpp"
+
+// Both must be powers of two.
+#define RING_SLOTS 1024
+#define SLOT_SIZE 256
+// How long the writer sleeps when there is nothing to write.
+#define WRITER_IDLE_MS 5
+#define FLUSH_TIMEOUT_MS 1000
+
+struct Logger::Slot
+{
+	std::atomic<uint64_t> sequence;
+	uint32_t length;
+	char text[SLOT_SIZE];
+};
+
+// A bounded multi-producer queue after Dmitry Vyukov's: each slot's sequence number says
+// whether it is free for the producer at that position or full for the consumer.
+struct Logger::Ring
+{
+	Ring() : enqueue(0), dequeue(0)
+	{
+		for (uint64_t i = 0; i < RING_SLOTS; i++)
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	Slot slots[RING_SLOTS];
+	alignas(64) std::atomic<uint64_t> enqueue;
+	alignas(64) std::atomic<uint64_t> dequeue;
+};
+
+// A streambuf over a fixed array, leaving room for the newline. Anything past the end is
+// thrown away rather than growing the buffer.
+class LineBuf : public std::streambuf
+{
+public:
+	LineBuf() { Reset(); }
+	void Reset() { setp(buf_, buf_ + SLOT_SIZE - 1); }
+	char *Data() { return buf_; }
+	size_t Length() const { return pptr() - pbase(); }
+	bool Truncated() const { return truncated_; }
+	void Clear() { truncated_ = false; }
+
+protected:
+	int_type overflow(int_type c) override
+	{
+		truncated_ = true;
+		return traits_type::not_eof(c);
+	}
+
+private:
+	char buf_[SLOT_SIZE];
+	bool truncated_ = false;
+};
+
+struct LineStream
+{
+	LineStream() : os(&buf) {}
+	LineBuf buf;
+	std::ostream os;
+};
+
+static thread_local LineStream line;
+
+static void write_all(char const *data, size_t length)
+{
+	while (length)
+	{
+		ssize_t n = ::write(STDERR_FILENO, data, length);
+		if (n <= 0)
+			return;
+		data += n;
+		length -= n;
+	}
+}
+
+Logger &Logger::Get()
+{
+	// Never destroyed, so that static destructors can still log. Whatever is queued is
+	// written out at exit, after which messages are written straight away.
+	static Logger *logger = new Logger;
+	return *logger;
+}
+
+Logger::Logger() : ring_(new Ring), dropped_(0), synchronous_(false)
+{
+	std::thread(&Logger::writerThread, this).detach();
+	std::atexit([]() {
+		Logger::Get().Flush();
+		Logger::Get().synchronous_ = true;
+	});
+}
+
+std::ostream &Logger::Begin()
+{
+	line.buf.Reset();
+	line.buf.Clear();
+	line.os.clear();
+	return line.os;
+}
+
+void Logger::End()
+{
+	char *text = line.buf.Data();
+	size_t length = line.buf.Length();
+	if (line.buf.Truncated())
+		memcpy(text + length - 3, "...", 3);
+	text[length++] = '\n';
+
+	if (synchronous_.load(std::memory_order_relaxed))
+	{
+		write_all(text, length);
+		return;
+	}
+
+	Ring &ring = *ring_;
+	uint64_t pos = ring.enqueue.load(std::memory_order_relaxed);
+	Slot *slot;
+	while (true)
+	{
+		slot = &ring.slots[pos & (RING_SLOTS - 1)];
+		int64_t diff = (int64_t)slot->sequence.load(std::memory_order_acquire) - (int64_t)pos;
+		if (diff == 0)
+		{
+			if (ring.enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		else
+			pos = ring.enqueue.load(std::memory_order_relaxed);
+	}
+	memcpy(slot->text, text, length);
+	slot->length = length;
+	slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+void Logger::Flush()
+{
+	if (synchronous_)
+		return;
+	uint64_t target = ring_->enqueue.load(std::memory_order_acquire);
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(FLUSH_TIMEOUT_MS);
+	while (ring_->dequeue.load(std::memory_order_acquire) < target && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+// Write out everything that's ready in one go, returning whether there was anything.
+bool Logger::drain()
+{
+	static char out[RING_SLOTS * SLOT_SIZE / 4];
+	Ring &ring = *ring_;
+	uint64_t pos = ring.dequeue.load(std::memory_order_relaxed);
+	size_t length = 0;
+	bool any = false;
+
+	uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+	if (dropped)
+	{
+		std::string s = "[" + std::to_string(dropped) + " log messages dropped]\n";
+		write_all(s.data(), s.size());
+	}
+
+	while (true)
+	{
+		Slot &slot = ring.slots[pos & (RING_SLOTS - 1)];
+		if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+			break;
+		if (length + slot.length > sizeof(out))
+		{
+			write_all(out, length);
+			length = 0;
+		}
+		memcpy(out + length, slot.text, slot.length);
+		length += slot.length;
+		slot.sequence.store(pos + RING_SLOTS, std::memory_order_release);
+		pos++;
+		any = true;
+	}
+	write_all(out, length);
+	// Only once it's written does Flush count it as done.
+	ring.dequeue.store(pos, std::memory_order_release);
+	return any;
+}
+
+void Logger::writerThread()
+{
+	while (true)
+	{
+		if (!drain())
+			std::this_thread::sleep_for(std::chrono::milliseconds(WRITER_IDLE_MS));
+	}
+}
@@ -1,9 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * logging.hpp - levelled logging that stays off the threads doing the work.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+
 #include "core/libcamera_app.hpp"
 
+// Messages above this level are compiled out altogether.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 2
+#endif
+
+// A LOG is formatted into a fixed buffer belonging to the calling thread and copied into
+// a slot of a lock-free ring, and a writer thread puts it on stderr some milliseconds
+// later. Nothing is allocated and nothing blocks, so logging from the camera, preview or
+// encoder threads doesn't hold them up. Messages too long for a slot are truncated, and
+// messages that arrive when the ring is full are counted and dropped.
+class Logger
+{
+public:
+	static Logger &Get();
+
+	// The calling thread's stream, emptied and ready for the next message.
+	std::ostream &Begin();
+	// Queue whatever was written since Begin.
+	void End();
+	// Wait until everything queued so far has been written.
+	void Flush();
+
+private:
+	struct Slot;
+	struct Ring;
+
+	Logger();
+	void writerThread();
+	bool drain();
+
+	std::unique_ptr<Ring> ring_;
+	std::atomic<uint64_t> dropped_;
+	std::atomic<bool> synchronous_;
+};
+
 #define LOG(level, text)                                                                                               \
 	do                                                                                                                 \
 	{                                                                                                                  \
-		if (LibcameraApp::GetVerbosity() >= level)                                                                     \
-			std::cerr << text << std::endl;                                                                            \
+		if ((level) <= LOG_MAX_LEVEL && LibcameraApp::GetVerbosity() >= (level))                                       \
+		{                                                                                                              \
+			Logger::Get().Begin() << text;                                                                             \
+			Logger::Get().End();                                                                                       \
+		}                                                                                                              \
+	} while (0)
+// Errors are rare and often the last thing said before exiting, so they wait to be written.
+#define LOG_ERROR(text)                                                                                                \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		Logger::Get().Begin() << text;                                                                                 \
+		Logger::Get().End();                                                                                           \
+		Logger::Get().Flush();                                                                                         \
 	} while (0)
-#define LOG_ERROR(text) std::cerr << text << std::endl
@@ -0,0 +1,224 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * metrics.cpp - counters for unattended monitoring, served in Prometheus text format.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/latency_trace.hpp"
+#include "core/logging.hpp"
+#include "core/metrics.hpp"
+
+// How long the server waits for a request before giving up on a client.
+#define REQUEST_TIMEOUT_MS 1000
+
+template <typename T>
+static void write_metric(std::ostream &os, char const *name, char const *type, char const *help,
+						 std::atomic<T> const &value)
+{
+	os << "# HELP spectroscope_" << name << " " << help << "\n";
+	os << "# TYPE spectroscope_" << name << " " << type << "\n";
+	os << "spectroscope_" << name << " " << value.load(std::memory_order_relaxed) << "\n";
+}
+
+// Label values come from files the user loads, so backslashes, quotes and newlines in them
+// must be escaped to keep the exposition parseable.
+static std::string escape_label(std::string const &value)
+{
+	std::string escaped;
+	for (char c : value)
+	{
+		if (c == '\\' || c == '"')
+			escaped += '\\';
+		if (c == '\n')
+			escaped += "\\n";
+		else
+			escaped += c;
+	}
+	return escaped;
+}
+
+Metrics &Metrics::Get()
+{
+	static Metrics metrics;
+	return metrics;
+}
+
+Metrics::~Metrics()
+{
+	if (thread_.joinable())
+	{
+		abort_ = true;
+		thread_.join();
+	}
+	if (listen_fd_ >= 0)
+		close(listen_fd_);
+	if (address_.rfind("unix:", 0) == 0)
+		unlink(address_.c_str() + 5);
+}
+
+void Metrics::Serve(std::string const &address)
+{
+	if (thread_.joinable())
+		return;
+
+	if (address.rfind("unix:", 0) == 0)
+	{
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		std::string path = address.substr(5);
+		if (path.empty() || path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("bad metrics socket path " + path);
+		strcpy(addr.sun_path, path.c_str());
+		unlink(path.c_str());
+		listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+			throw std::runtime_error("failed to bind metrics socket " + path);
+	}
+	else
+	{
+		// Only ever on localhost; anything further afield can come through a proxy.
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(std::stoi(address));
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int one = 1;
+		if (listen_fd_ >= 0)
+			setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+			throw std::runtime_error("failed to bind metrics port " + address);
+	}
+	if (listen(listen_fd_, 4) < 0)
+		throw std::runtime_error("failed to listen for metrics on " + address);
+
+	address_ = address;
+	thread_ = std::thread(&Metrics::serverThread, this);
+	LOG(1, "Serving metrics on " << address);
+}
+
+std::string Metrics::Text() const
+{
+	std::ostringstream os;
+	write_metric(os, "frames_captured_total", "counter", "Frames delivered by the camera or replay source.",
+				 frames_captured);
+	write_metric(os, "preview_frames_displayed_total", "counter", "Frames shown in the preview window.",
+				 preview_frames_displayed);
+	write_metric(os, "preview_frames_dropped_total", "counter",
+				 "Frames not shown because the preview was still busy with an earlier one.", preview_frames_dropped);
+	write_metric(os, "post_process_queue_depth", "gauge", "Frames waiting for or in post-processing.",
+				 post_process_queue);
+	write_metric(os, "encoder_queue_depth", "gauge", "Frames handed to the encoder and not yet returned.",
+				 encoder_queue);
+	write_metric(os, "exposure_time_microseconds", "gauge", "Exposure time of the last frame shown.",
+				 exposure_time);
+	write_metric(os, "analogue_gain", "gauge", "Analogue gain of the last frame shown.", analogue_gain);
+	write_metric(os, "digital_gain", "gauge", "Digital gain of the last frame shown.", digital_gain);
+	write_metric(os, "peak_intensity", "gauge", "Largest value in the last calibrated spectrum.", peak_intensity);
+	write_metric(os, "peak_wavelength_nanometres", "gauge", "Wavelength of the largest value in the last spectrum.",
+				 peak_wavelength);
+	write_metric(os, "saturated_pixels", "gauge", "Pixels at full scale among those read for the last spectrum.",
+				 saturated_pixels);
+	write_metric(os, "spikes_rejected", "gauge", "Bins of the last spectra replaced by their recent median.",
+				 spikes_rejected);
+	write_metric(os, "colour_x", "gauge", "CIE 1931 x chromaticity of the last spectrum.", colour_x);
+	write_metric(os, "colour_y", "gauge", "CIE 1931 y chromaticity of the last spectrum.", colour_y);
+	write_metric(os, "colour_u_prime", "gauge", "CIE 1976 u' chromaticity of the last spectrum.", colour_u);
+	write_metric(os, "colour_v_prime", "gauge", "CIE 1976 v' chromaticity of the last spectrum.", colour_v);
+	write_metric(os, "colour_temperature_kelvin", "gauge", "Correlated colour temperature of the last spectrum.",
+				 colour_cct);
+	write_metric(os, "colour_duv", "gauge", "Distance of the last spectrum from the Planckian locus in CIE 1960 uv.",
+				 colour_duv);
+	write_metric(os, "colour_rendering_index", "gauge", "CIE 13.3 general colour rendering index of the last spectrum.",
+				 colour_ra);
+	write_metric(os, "lines_identified", "gauge", "Peaks of the last spectrum identified as emission lines.",
+				 lines_identified);
+	{
+		os << "# HELP spectroscope_stage_cpu_seconds_total CPU time spent in each stage of every frame.\n";
+		os << "# TYPE spectroscope_stage_cpu_seconds_total counter\n";
+		const std::streamsize precision = os.precision(12);
+		for (auto const &[stage, ns] : { std::make_pair("post-process", &post_process_cpu),
+										 std::make_pair("extract", &extract_cpu), std::make_pair("draw", &draw_cpu) })
+			os << "spectroscope_stage_cpu_seconds_total{stage=\"" << stage << "\"} "
+			   << ns->load(std::memory_order_relaxed) / 1e9 << "\n";
+		os.precision(precision);
+	}
+	const unsigned int lines = std::min<uint64_t>(lines_identified.load(std::memory_order_relaxed), MAX_LINES);
+	{
+		std::lock_guard<std::mutex> lock(database_mutex_);
+		if (lines && database_)
+		{
+			os << "# HELP spectroscope_line_height Height of each line identified in the last spectrum.\n";
+			os << "# TYPE spectroscope_line_height gauge\n";
+			for (unsigned int i = 0; i < lines; i++)
+			{
+				const int line = lines_[i].line.load(std::memory_order_relaxed);
+				if (line < 0 || line >= (int)database_->Size())
+					continue;
+				os << "spectroscope_line_height{species=\"" << escape_label(database_->Species(line))
+				   << "\",wavelength=\"" << database_->Wavelength(line) << "\"} "
+				   << lines_[i].height.load(std::memory_order_relaxed) << "\n";
+			}
+		}
+	}
+	if (LatencyTrace::Get().Enabled())
+		LatencyTrace::Get().WriteMetrics(os);
+	return os.str();
+}
+
+void Metrics::SetLineDatabase(LineDatabase const &database)
+{
+	std::lock_guard<std::mutex> lock(database_mutex_);
+	database_ = std::make_unique<LineDatabase>(database);
+}
+
+void Metrics::serverThread()
+{
+	while (!abort_)
+	{
+		pollfd p = { listen_fd_, POLLIN, 0 };
+		if (poll(&p, 1, 200) <= 0)
+			continue;
+		int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		// Whatever was asked for, the answer is the same. Wait for the end of the
+		// request headers so as not to close the connection under the client.
+		std::string request;
+		char buf[1024];
+		pollfd c = { fd, POLLIN, 0 };
+		while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192 &&
+			   poll(&c, 1, REQUEST_TIMEOUT_MS) > 0)
+		{
+			ssize_t n = read(fd, buf, sizeof(buf));
+			if (n <= 0)
+				break;
+			request.append(buf, n);
+		}
+
+		std::string body = Text();
+		std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+							   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+		for (size_t done = 0; done < response.size();)
+		{
+			ssize_t n = send(fd, response.data() + done, response.size() - done, MSG_NOSIGNAL);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		close(fd);
+	}
+}
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * metrics.hpp - counters for unattended monitoring, served in Prometheus text format.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "spectrum/line_database.hpp"
+
+// Whoever owns a number updates it here with a relaxed atomic store or increment and
+// carries on. Nothing is formatted until a scrape arrives on the server thread, so
+// keeping the counters costs nothing noticeable whether or not anyone is listening.
+class Metrics
+{
+public:
+	static Metrics &Get();
+	~Metrics();
+
+	// Serve the metrics to anyone who connects, at "unix:<path>" or on a port of localhost.
+	void Serve(std::string const &address);
+	std::string Text() const;
+
+	void Add(std::atomic<uint64_t> &counter, uint64_t n = 1) { counter.fetch_add(n, std::memory_order_relaxed); }
+	template <typename T>
+	void Set(std::atomic<T> &gauge, T value)
+	{
+		gauge.store(value, std::memory_order_relaxed);
+	}
+
+	// The CPU time the calling thread has used, to be added to a stage's counter below.
+	static uint64_t ThreadCpuTime()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	std::atomic<uint64_t> frames_captured { 0 };
+	std::atomic<uint64_t> preview_frames_displayed { 0 };
+	std::atomic<uint64_t> preview_frames_dropped { 0 };
+	std::atomic<int64_t> post_process_queue { 0 };
+	std::atomic<int64_t> encoder_queue { 0 };
+	std::atomic<float> exposure_time { 0 }; // us
+	std::atomic<float> analogue_gain { 0 };
+	std::atomic<float> digital_gain { 0 };
+	std::atomic<float> peak_intensity { 0 };
+	std::atomic<float> peak_wavelength { 0 }; // nm
+	std::atomic<uint64_t> saturated_pixels { 0 }; // in the last frame's spectrum band
+	std::atomic<uint64_t> spikes_rejected { 0 }; // in the last frame's spectra
+	// The colour of the light, NAN without colorimetry.
+	std::atomic<float> colour_x { NAN };
+	std::atomic<float> colour_y { NAN };
+	std::atomic<float> colour_u { NAN }; // u'
+	std::atomic<float> colour_v { NAN }; // v'
+	std::atomic<float> colour_cct { NAN }; // K
+	std::atomic<float> colour_duv { NAN };
+	std::atomic<float> colour_ra { NAN };
+	std::atomic<uint64_t> lines_identified { 0 }; // in the last spectrum
+	// CPU time spent in each stage, in ns.
+	std::atomic<uint64_t> post_process_cpu { 0 };
+	std::atomic<uint64_t> extract_cpu { 0 };
+	std::atomic<uint64_t> draw_cpu { 0 };
+
+	// The lines identified in the last spectrum: the first lines_identified of them, up to
+	// MAX_LINES, as their index in the line database and the height of the peak on each.
+	// A scrape can catch a mix of two frames' lines.
+	static constexpr unsigned int MAX_LINES = 32;
+	void SetLine(unsigned int index, int line, float height)
+	{
+		lines_[index].line.store(line, std::memory_order_relaxed);
+		lines_[index].height.store(height, std::memory_order_relaxed);
+	}
+	// The database the lines index, copied so that a scrape can name them. Only this and a
+	// scrape take the lock.
+	void SetLineDatabase(LineDatabase const &database);
+
+private:
+	Metrics() : listen_fd_(-1), abort_(false) {}
+	void serverThread();
+
+	std::string address_;
+	int listen_fd_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+	struct Line
+	{
+		std::atomic<int32_t> line { -1 };
+		std::atomic<float> height { 0 };
+	};
+	Line lines_[MAX_LINES];
+	mutable std::mutex database_mutex_;
+	std::unique_ptr<LineDatabase> database_;
+};
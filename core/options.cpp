@@ -337,6 +337,7 @@ bool Options::Parse(int argc, char *argv[])
 	contrast = std::clamp(contrast, 0.0f, 15.99f); // limits are arbitrary..
 	saturation = std::clamp(saturation, 0.0f, 15.99f); // limits are arbitrary..
 	sharpness = std::clamp(sharpness, 0.0f, 15.99f); // limits are arbitrary..
+	font_size = std::clamp(font_size, 6.0f, 48.0f); // the glyph atlas holds up to 48px
 
 	if (strcasecmp(metadata_format.c_str(), "json") == 0)
 		metadata_format = "json";
@@ -345,6 +346,66 @@ bool Options::Parse(int argc, char *argv[])
 	else
 		throw std::runtime_error("unrecognised metadata format " + metadata_format);
 
+	if (sscanf(synthetic_band.c_str(), "%f,%f", &synthetic_band_centre, &synthetic_band_width) != 2)
+		throw std::runtime_error("Invalid synthetic band");
+	if (sscanf(synthetic_noise.c_str(), "%f,%f", &synthetic_full_well, &synthetic_read_noise) != 2)
+		throw std::runtime_error("Invalid synthetic noise");
+
+	if (waterfall_colours != "grey" && waterfall_colours != "heat" && waterfall_colours != "jet")
+		throw std::runtime_error("unrecognised waterfall colour map " + waterfall_colours);
+	if (spectrum_stream != "main" && spectrum_stream != "raw")
+		throw std::runtime_error("unrecognised spectrum stream " + spectrum_stream);
+	if (spectrum_orientation != "horizontal" && spectrum_orientation != "vertical")
+		throw std::runtime_error("unrecognised spectrum orientation " + spectrum_orientation);
+	if (sscanf(channel_weights.c_str(), "%f,%f,%f", &channel_weight_r, &channel_weight_g, &channel_weight_b) != 3)
+		throw std::runtime_error("Invalid channel weights");
+	if (extraction != "box" && extraction != "optimal")
+		throw std::runtime_error("unrecognised extraction " + extraction);
+	if (!master_frames)
+		throw std::runtime_error("master-frames must be at least 1");
+	if (reject_window && reject_window < 3)
+		throw std::runtime_error("reject-window must be 0 or at least 3");
+	if (reject_sigma <= 0)
+		throw std::runtime_error("reject-sigma must be positive");
+	if (baseline != "none" && baseline != "rolling-ball" && baseline != "als" && baseline != "polynomial")
+		throw std::runtime_error("unrecognised baseline " + baseline);
+	if (!baseline_window)
+		throw std::runtime_error("baseline-window must be at least 1");
+	if (baseline_lambda <= 0)
+		throw std::runtime_error("baseline-lambda must be positive");
+	if (lamp_temperature <= 0)
+		throw std::runtime_error("lamp-temperature must be positive");
+	if (!lamp_frames)
+		throw std::runtime_error("lamp-frames must be at least 1");
+	if (measurement != "intensity" && measurement != "transmittance" && measurement != "absorbance")
+		throw std::runtime_error("unrecognised measurement " + measurement);
+	if (!reference_frames)
+		throw std::runtime_error("reference-frames must be at least 1");
+	if (line_tolerance <= 0)
+		throw std::runtime_error("line-tolerance must be positive");
+	calibration_species.clear();
+	for (size_t start = 0; start < calibration_lines.size();)
+	{
+		size_t end = std::min(calibration_lines.find(',', start), calibration_lines.size());
+		if (end > start)
+			calibration_species.push_back(calibration_lines.substr(start, end - start));
+		start = end + 1;
+	}
+	if (calibration_species.empty())
+		throw std::runtime_error("calibration-lines names no species");
+	if (smooth_filter != "savitzky-golay" && smooth_filter != "boxcar" && smooth_filter != "gaussian")
+		throw std::runtime_error("unrecognised smoothing filter " + smooth_filter);
+	track_bands.clear();
+	for (size_t start = 0; start < tracks.size();)
+	{
+		size_t end = std::min(tracks.find(',', start), tracks.size());
+		unsigned int first, last;
+		if (sscanf(tracks.substr(start, end - start).c_str(), "%u:%u", &first, &last) != 2 || first > last)
+			throw std::runtime_error("Invalid track " + tracks.substr(start, end - start));
+		track_bands.emplace_back(first, last + 1);
+		start = end + 1;
+	}
+
 	mode = Mode(mode_string);
 	viewfinder_mode = Mode(viewfinder_mode_string);
 
@@ -425,4 +486,53 @@ void Options::Print() const
 		std::cerr << "    viewfinder-buffer-count: " << viewfinder_buffer_count << std::endl;
 	std::cerr << "    metadata: " << metadata << std::endl;
 	std::cerr << "    metadata-format: " << metadata_format << std::endl;
+	std::cerr << "    font: " << font << " (" << font_size << "px)" << std::endl;
+	if (waterfall)
+		std::cerr << "    waterfall: " << waterfall << " rows, " << waterfall_colours << std::endl;
+	std::cerr << "    spectrum: " << spectrum_stream << " stream, " << spectrum_orientation << ", channel weights "
+			  << channel_weight_r << "," << channel_weight_g << "," << channel_weight_b << ", " << extraction
+			  << " extraction" << std::endl;
+	if (!tracks.empty())
+		std::cerr << "    tracks: " << tracks << std::endl;
+	std::cerr << "    master-frames: " << master_frames << std::endl;
+	if (reject_window)
+		std::cerr << "    reject spikes: " << reject_window << " frames, " << reject_sigma << " sigma" << std::endl;
+	if (baseline == "rolling-ball")
+		std::cerr << "    baseline: rolling-ball, window " << baseline_window << std::endl;
+	else if (baseline == "als")
+		std::cerr << "    baseline: als, lambda " << baseline_lambda << std::endl;
+	else if (baseline == "polynomial")
+		std::cerr << "    baseline: polynomial, order " << baseline_order << std::endl;
+	std::cerr << "    lamp: ";
+	if (lamp_spectrum.empty())
+		std::cerr << lamp_temperature << "K";
+	else
+		std::cerr << lamp_spectrum;
+	std::cerr << ", " << lamp_frames << " frames" << std::endl;
+	if (measurement != "intensity")
+		std::cerr << "    measurement: " << measurement << ", reference of " << reference_frames << " frames"
+				  << std::endl;
+	if (colorimetry)
+		std::cerr << "    colorimetry: observer " << (cie_observer.empty() ? "fit" : cie_observer) << ", samples "
+				  << (cri_samples.empty() ? "none" : cri_samples) << ", daylight "
+				  << (cie_daylight.empty() ? "none" : cie_daylight) << std::endl;
+	if (identify_lines)
+		std::cerr << "    line identification: " << (line_database.empty() ? "built-in" : line_database)
+				  << " lines, within " << line_tolerance << "nm" << std::endl;
+	std::cerr << "    calibration lines: " << calibration_lines << std::endl;
+	if (smooth > 1)
+		std::cerr << "    smooth: " << smooth_filter << " over " << smooth << " bins" << std::endl;
+	if (!replay.empty())
+		std::cerr << "    replay: " << replay << " (" << replay_format << " at "
+				  << (replay_fps > 0 ? std::to_string(replay_fps) + "fps" : "full speed") << ")" << std::endl;
+	if (replay == "synthetic")
+		std::cerr << "    synthetic: slope " << synthetic_slope << " smile " << synthetic_smile << " band "
+				  << synthetic_band_centre << "," << synthetic_band_width << " temperature " << synthetic_temperature
+				  << " noise " << synthetic_full_well << "," << synthetic_read_noise << " seed " << synthetic_seed
+				  << std::endl;
+	std::cerr << "    latency-trace: " << latency_trace << std::endl;
+	if (!timeline.empty())
+		std::cerr << "    timeline: " << timeline << " (" << timeline_seconds << "s)" << std::endl;
+	if (!metrics.empty())
+		std::cerr << "    metrics: " << metrics << std::endl;
 }
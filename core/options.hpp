@@ -10,6 +10,8 @@
 #include <fstream>
 #include <iostream>
 #include <optional>
+#include <utility>
+#include <vector>
 
 #include <boost/program_options.hpp>
 
@@ -152,6 +154,103 @@ struct Options
 			 "Save captured image metadata to a file or \"-\" for stdout")
 			("metadata-format", value<std::string>(&metadata_format)->default_value("json"),
 			 "Format to save the metadata in, either txt or json (requires --metadata)")
+			("font", value<std::string>(&font)->default_value("/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf"),
+			 "TrueType font for the labels and readouts drawn in the preview window")
+			("font-size", value<float>(&font_size)->default_value(16),
+			 "Height in pixels of the text drawn in the preview window")
+			("waterfall", value<unsigned int>(&waterfall)->default_value(0),
+			 "Show this many rows of spectrum history as a waterfall in place of the camera image (0 = off)")
+			("waterfall-colours", value<std::string>(&waterfall_colours)->default_value("heat"),
+			 "Colour map for the waterfall (grey, heat, jet)")
+			("spectrum-stream", value<std::string>(&spectrum_stream)->default_value("main"),
+			 "Stream the spectrum is read from: main (what the preview shows) or raw (the sensor's Bayer data, "
+			 "with its format chosen by --mode)")
+			("spectrum-orientation", value<std::string>(&spectrum_orientation)->default_value("horizontal"),
+			 "Which way the spectrum runs in the frame (horizontal, vertical)")
+			("channel-weights", value<std::string>(&channel_weights)->default_value("1,1,1"),
+			 "Proportions of red, green and blue that make up the spectrum, e.g. 1,1,1")
+			("extraction", value<std::string>(&extraction)->default_value("box"),
+			 "How the band is summed across: box (every row the same) or optimal (weighted by the band's profile)")
+			("master-frames", value<unsigned int>(&master_frames)->default_value(16),
+			 "Frames averaged into each master dark or flat")
+			("reject-window", value<unsigned int>(&reject_window)->default_value(0),
+			 "Frames of history each bin's spikes are judged against, or 0 to keep every value")
+			("reject-sigma", value<float>(&reject_sigma)->default_value(5),
+			 "How many standard deviations of a bin's noise from its median make a spike")
+			("baseline", value<std::string>(&baseline)->default_value("none"),
+			 "How to estimate the continuum under the spectrum, to draw it and the spectrum less it and to find peaks "
+			 "above it: none, rolling-ball, als or polynomial")
+			("baseline-window", value<unsigned int>(&baseline_window)->default_value(64),
+			 "Width in bins of the rolling ball, wider than any line")
+			("baseline-lambda", value<double>(&baseline_lambda)->default_value(1e5),
+			 "Smoothness of the asymmetric least squares baseline")
+			("baseline-order", value<unsigned int>(&baseline_order)->default_value(4),
+			 "Order of the polynomial baseline")
+			("lamp-temperature", value<double>(&lamp_temperature)->default_value(3000),
+			 "Colour temperature in K of the lamp the incandescent calibration is taken against")
+			("lamp-spectrum", value<std::string>(&lamp_spectrum),
+			 "File of the lamp's radiance, each line a wavelength in nm and a value, to use instead of a blackbody")
+			("lamp-frames", value<unsigned int>(&lamp_frames)->default_value(8),
+			 "Frames of the lamp averaged for the incandescent calibration")
+			("measurement", value<std::string>(&measurement)->default_value("intensity"),
+			 "What to show once there is a reference spectrum: intensity, transmittance or absorbance")
+			("reference-frames", value<unsigned int>(&reference_frames)->default_value(8),
+			 "Frames averaged into the reference spectrum for transmittance and absorbance")
+			("colorimetry", value<bool>(&colorimetry)->default_value(false)->implicit_value(true),
+			 "Work out the colour of the light every frame: CIE xy and u'v', CCT, and CRI with --cri-samples")
+			("cie-observer", value<std::string>(&cie_observer),
+			 "File of the CIE 1931 colour matching functions, each line a wavelength in nm and x, y and z, to use "
+			 "instead of the built-in fit")
+			("cri-samples", value<std::string>(&cri_samples),
+			 "File of the CIE 13.3 test colour samples, each line a wavelength in nm and each sample's reflectance")
+			("cie-daylight", value<std::string>(&cie_daylight),
+			 "File of the CIE daylight components, each line a wavelength in nm and S0, S1 and S2, for the CRI's "
+			 "reference above 5000K (default: a blackbody throughout)")
+			("identify-lines", value<bool>(&identify_lines)->default_value(false)->implicit_value(true),
+			 "Identify the emission lines of the spectrum's peaks every frame")
+			("line-tolerance", value<float>(&line_tolerance)->default_value(1.0),
+			 "How far in nm a peak may be from a line to be identified as it")
+			("line-database", value<std::string>(&line_database),
+			 "File of emission lines, each line a species and a wavelength in nm, to use instead of those built in")
+			("calibration-lines", value<std::string>(&calibration_lines)->default_value("Hg,Tb3+,Eu3+"),
+			 "Species, separated by commas, whose lines the wavelength calibration fits the peaks to")
+			("smooth", value<unsigned int>(&smooth)->default_value(0),
+			 "Smooth the spectrum shown over this many bins (the full width at half maximum of a gaussian)")
+			("smooth-filter", value<std::string>(&smooth_filter)->default_value("savitzky-golay"),
+			 "How to smooth the spectrum shown: savitzky-golay, boxcar or gaussian")
+			("tracks", value<std::string>(&tracks),
+			 "Bands of the frame to extract as separate spectra, each given by its first and last pixel across the "
+			 "frame, e.g. 100:139,160:199 (default: the whole frame is one band)")
+			("replay", value<std::string>(&replay),
+			 "Instead of using a camera, replay frames from this file (of back-to-back frames of --width by --height "
+			 "pixels) or from \"synthetic\" generated frames")
+			("replay-fps", value<float>(&replay_fps)->default_value(30),
+			 "Frame rate for --replay, where 0 replays frames as fast as they are consumed")
+			("replay-format", value<std::string>(&replay_format)->default_value("yuv420"),
+			 "Pixel format of the frames for --replay (yuv420, sbggr10p, sbggr12p, sbggr16)")
+			("synthetic-slope", value<float>(&synthetic_slope)->default_value(0),
+			 "Tilt of the band in --replay synthetic frames, in pixels per row")
+			("synthetic-smile", value<float>(&synthetic_smile)->default_value(0),
+			 "Curvature of the band in --replay synthetic frames, in pixels of shift one band width from its centre")
+			("synthetic-band", value<std::string>(&synthetic_band)->default_value("0.5,0.1"),
+			 "Centre and width of the band in --replay synthetic frames, as fractions of the frame height")
+			("synthetic-temperature", value<float>(&synthetic_temperature)->default_value(2800),
+			 "Temperature in K of the continuum in --replay synthetic frames (0 = emission lines only)")
+			("synthetic-noise", value<std::string>(&synthetic_noise)->default_value("0,0"),
+			 "Full well and read noise in electrons for --replay synthetic frames, e.g. 10000,5 (0,0 = no noise)")
+			("synthetic-seed", value<unsigned int>(&synthetic_seed)->default_value(1),
+			 "Seed for the noise in --replay synthetic frames")
+			("latency-trace", value<bool>(&latency_trace)->default_value(false)->implicit_value(true),
+			 "Time each frame's stages from sensor to screen, reporting on exit or when sent SIGUSR1 (which then "
+			 "no longer toggles --signal output)")
+			("timeline", value<std::string>(&timeline),
+			 "When sent SIGUSR2 (which then no longer stops --signal), record what every thread does to this file "
+			 "as a Chrome/Perfetto JSON trace")
+			("timeline-seconds", value<float>(&timeline_seconds)->default_value(5),
+			 "Length of each --timeline recording in seconds")
+			("metrics", value<std::string>(&metrics),
+			 "Serve Prometheus metrics on this port of localhost, or on a Unix socket given as unix:<path>, with the "
+			 "latency of each stage if there is a --latency-trace")
 			;
 		// clang-format on
 	}
@@ -224,6 +323,55 @@ struct Options
 	std::string metadata;
 	std::string metadata_format;
 	bool hdr;
+	std::string font;
+	float font_size;
+	unsigned int waterfall;
+	std::string waterfall_colours;
+	std::string spectrum_stream;
+	std::string spectrum_orientation;
+	std::string channel_weights;
+	float channel_weight_r, channel_weight_g, channel_weight_b;
+	std::string extraction;
+	unsigned int master_frames;
+	unsigned int reject_window;
+	float reject_sigma;
+	std::string baseline;
+	unsigned int baseline_window;
+	double baseline_lambda;
+	unsigned int baseline_order;
+	double lamp_temperature;
+	std::string lamp_spectrum;
+	unsigned int lamp_frames;
+	std::string measurement;
+	unsigned int reference_frames;
+	bool colorimetry;
+	std::string cie_observer;
+	std::string cri_samples;
+	std::string cie_daylight;
+	bool identify_lines;
+	float line_tolerance;
+	std::string line_database;
+	std::string calibration_lines;
+	std::vector<std::string> calibration_species;
+	unsigned int smooth;
+	std::string smooth_filter;
+	std::string tracks;
+	std::vector<std::pair<unsigned int, unsigned int>> track_bands; // [begin, end) across the frame
+	std::string replay;
+	float replay_fps;
+	std::string replay_format;
+	float synthetic_slope;
+	float synthetic_smile;
+	std::string synthetic_band;
+	float synthetic_band_centre, synthetic_band_width;
+	float synthetic_temperature;
+	std::string synthetic_noise;
+	float synthetic_full_well, synthetic_read_noise;
+	unsigned int synthetic_seed;
+	bool latency_trace;
+	std::string timeline;
+	float timeline_seconds;
+	std::string metrics;
 
 	virtual bool Parse(int argc, char *argv[]);
 	virtual void Print() const;
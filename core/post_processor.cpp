@@ -7,7 +7,10 @@
 
 #include <iostream>
 
+#include "core/latency_trace.hpp"
+#include "core/timeline.hpp"
 #include "core/libcamera_app.hpp"
+#include "core/metrics.hpp"
 #include "core/post_processor.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -89,10 +92,15 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 
 	std::unique_lock<std::mutex> l(mutex_);
 	requests_.push(std::move(request)); // caller has given us ownership of this reference
+	Metrics::Get().post_process_queue.fetch_add(1, std::memory_order_relaxed);
 
 	std::promise<bool> promise;
 	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
 		bool drop_request = false;
+		Timeline::NameThread("post-process");
+		Timeline::Get().Begin("post-process", request->sequence);
+		LatencyTrace::Get().Record(request->sequence, TraceStage::PostProcessStart);
+		const uint64_t cpu = Metrics::ThreadCpuTime();
 		for (auto &stage : stages_)
 		{
 			if (stage->Process(request))
@@ -101,6 +109,10 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 				break;
 			}
 		}
+		Metrics &metrics = Metrics::Get();
+		metrics.Add(metrics.post_process_cpu, Metrics::ThreadCpuTime() - cpu);
+		LatencyTrace::Get().Record(request->sequence, TraceStage::PostProcessEnd);
+		Timeline::Get().End("post-process");
 		promise.set_value(drop_request);
 		cv_.notify_one();
 	};
@@ -113,6 +125,7 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 
 void PostProcessor::outputThread()
 {
+	Timeline::NameThread("post-process output");
 	while (true)
 	{
 		CompletedRequestPtr request;
@@ -134,10 +147,14 @@ void PostProcessor::outputThread()
 			futures_.pop();
 			request = std::move(requests_.front()); // reuse as it's being dropped from the queue
 			requests_.pop();
+			Metrics::Get().post_process_queue.fetch_sub(1, std::memory_order_relaxed);
 		}
 
 		if (!drop_request)
+		{
+			TimelineScope scope("post-process output", request->sequence);
 			callback_(request); // callback can take over ownership from us
+		}
 	}
 }
 
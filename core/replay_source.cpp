@@ -0,0 +1,456 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * replay_source.cpp - feed recorded or generated frames through the app without a camera.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
+
+#include "core/logging.hpp"
+#include "core/options.hpp"
+#include "core/replay_source.hpp"
+#include "core/spectrum_generator.hpp"
+#include "core/timeline.hpp"
+
+using libcamera::FrameBuffer;
+using libcamera::PixelFormat;
+namespace formats = libcamera::formats;
+
+namespace
+{
+
+struct ReplayFormat
+{
+	char const *name;
+	PixelFormat format;
+	unsigned int bits;
+};
+
+const ReplayFormat replay_formats[] = {
+	{ "yuv420", formats::YUV420, 8 },
+	{ "sbggr10p", formats::SBGGR10_CSI2P, 10 },
+	{ "sbggr12p", formats::SBGGR12_CSI2P, 12 },
+	{ "sbggr16", formats::SBGGR16, 16 },
+};
+
+unsigned int format_bits(PixelFormat const &format)
+{
+	for (auto const &f : replay_formats)
+	{
+		if (f.format == format)
+			return f.bits;
+	}
+	return 8;
+}
+
+// Bytes in one row of packed pixels (the luma plane, for YUV420).
+unsigned int row_bytes(PixelFormat const &format, unsigned int width)
+{
+	if (format == formats::SBGGR10_CSI2P)
+		return width * 5 / 4;
+	else if (format == formats::SBGGR12_CSI2P)
+		return width * 3 / 2;
+	else if (format == formats::SBGGR16)
+		return width * 2;
+	return width;
+}
+
+// Bytes in one frame of a file, where nothing is padded.
+size_t frame_bytes(PixelFormat const &format, libcamera::Size const &size)
+{
+	if (format == formats::YUV420)
+		return size.width * size.height + 2 * (size.width / 2) * (size.height / 2);
+	return (size_t)row_bytes(format, size.width) * size.height;
+}
+
+void unpack_row(uint8_t const *in, uint16_t *out, unsigned int width, PixelFormat const &format)
+{
+	if (format == formats::SBGGR10_CSI2P)
+	{
+		for (unsigned int x = 0; x < width; x += 4, in += 5)
+		{
+			for (unsigned int i = 0; i < 4; i++)
+				out[x + i] = (in[i] << 2) | ((in[4] >> (2 * i)) & 3);
+		}
+	}
+	else if (format == formats::SBGGR12_CSI2P)
+	{
+		for (unsigned int x = 0; x < width; x += 2, in += 3)
+		{
+			out[x] = (in[0] << 4) | (in[2] & 0xf);
+			out[x + 1] = (in[1] << 4) | (in[2] >> 4);
+		}
+	}
+	else if (format == formats::SBGGR16)
+	{
+		for (unsigned int x = 0; x < width; x++, in += 2)
+			out[x] = in[0] | (in[1] << 8);
+	}
+	else
+	{
+		for (unsigned int x = 0; x < width; x++)
+			out[x] = in[x];
+	}
+}
+
+// Use a real dmabuf if we can, as the EGL preview imports buffers that way. Machines
+// without a dma heap get a memfd, which is fine for everything else.
+int allocate_buffer(size_t size, std::string const &name)
+{
+	static const char *heaps[] = { "/dev/dma_heap/linux,cma", "/dev/dma_heap/system" };
+	for (char const *heap : heaps)
+	{
+		int heap_fd = open(heap, O_RDWR | O_CLOEXEC);
+		if (heap_fd < 0)
+			continue;
+		dma_heap_allocation_data alloc = {};
+		alloc.len = size;
+		alloc.fd_flags = O_CLOEXEC | O_RDWR;
+		int ret = ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &alloc);
+		close(heap_fd);
+		if (ret == 0)
+		{
+			ioctl(alloc.fd, DMA_BUF_SET_NAME, name.c_str());
+			return alloc.fd;
+		}
+	}
+
+	int fd = memfd_create(name.c_str(), MFD_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("failed to allocate replay buffer");
+	if (ftruncate(fd, size) < 0)
+	{
+		close(fd);
+		throw std::runtime_error("failed to size replay buffer");
+	}
+	return fd;
+}
+
+// Frames from a file of back-to-back packed frames, starting again from the
+// beginning when we reach the end.
+class FileReader : public ReplayReader
+{
+public:
+	FileReader(std::string const &filename, PixelFormat const &format, libcamera::Size const &size)
+	{
+		fp_ = fopen(filename.c_str(), "rb");
+		if (!fp_)
+			throw std::runtime_error("failed to open replay file " + filename);
+		struct stat st;
+		size_t frame_size = frame_bytes(format, size);
+		if (fstat(fileno(fp_), &st) < 0 || st.st_size == 0 || st.st_size % frame_size)
+		{
+			fclose(fp_);
+			throw std::runtime_error("replay file " + filename + " is not a whole number of " + size.toString() +
+									 " frames");
+		}
+		LOG(2, "Replay file has " << st.st_size / frame_size << " frames");
+	}
+	~FileReader() { fclose(fp_); }
+	bool Read(uint8_t *mem, StreamInfo const &info) override
+	{
+		if (readFrame(mem, info))
+			return true;
+		rewind(fp_);
+		return readFrame(mem, info);
+	}
+
+private:
+	bool readRows(uint8_t *mem, unsigned int rows, unsigned int bytes, unsigned int stride)
+	{
+		for (unsigned int y = 0; y < rows; y++, mem += stride)
+		{
+			if (fread(mem, bytes, 1, fp_) != 1)
+				return false;
+		}
+		return true;
+	}
+	bool readFrame(uint8_t *mem, StreamInfo const &info)
+	{
+		if (info.pixel_format != formats::YUV420)
+			return readRows(mem, info.height, row_bytes(info.pixel_format, info.width), info.stride);
+		uint8_t *u = mem + info.stride * info.height;
+		uint8_t *v = u + (info.stride / 2) * (info.height / 2);
+		return readRows(mem, info.height, info.width, info.stride) &&
+			   readRows(u, info.height / 2, info.width / 2, info.stride / 2) &&
+			   readRows(v, info.height / 2, info.width / 2, info.stride / 2);
+	}
+
+	FILE *fp_;
+};
+
+} // namespace
+
+ReplaySource::ReplaySource(Options const *options) : raw_(false), abort_(false)
+{
+	auto format = std::find_if(std::begin(replay_formats), std::end(replay_formats),
+							   [options](auto const &f) { return options->replay_format == f.name; });
+	if (format == std::end(replay_formats))
+		throw std::runtime_error("unrecognised replay format " + options->replay_format);
+	format_ = format->format;
+	raw_ = format_ != formats::YUV420;
+
+	size_ = libcamera::Size(options->width ? options->width : 1920, options->height ? options->height : 1080);
+	// The binned main stream needs whole 2x2 blocks, the packed formats whole groups of 4 pixels.
+	size_.alignDownTo(raw_ ? 4 : 2, raw_ ? 4 : 2);
+
+	if (options->replay_fps > 0)
+		frame_period_ = std::chrono::nanoseconds((int64_t)(1e9 / options->replay_fps));
+	else
+		frame_period_ = std::chrono::nanoseconds(0);
+
+	id_ = "replay:" + options->replay;
+	if (options->replay == "synthetic")
+	{
+		SpectrumGenerator::Config config;
+		config.slope = options->synthetic_slope;
+		config.smile = options->synthetic_smile;
+		config.band_centre = options->synthetic_band_centre;
+		config.band_width = options->synthetic_band_width;
+		config.temperature = options->synthetic_temperature;
+		config.full_well = options->synthetic_full_well;
+		config.read_noise = options->synthetic_read_noise;
+		config.seed = options->synthetic_seed;
+		reader_ = std::make_unique<SpectrumGenerator>(config);
+	}
+	else
+		reader_ = std::make_unique<FileReader>(options->replay, format_, size_);
+	LOG(2, "Replaying " << size_.toString() << " " << options->replay_format << " frames from " << options->replay);
+}
+
+ReplaySource::~ReplaySource()
+{
+	Stop();
+	Teardown();
+}
+
+void ReplaySource::Configure(unsigned int buffer_count)
+{
+	libcamera::StreamConfiguration config;
+	config.pixelFormat = formats::YUV420;
+	config.size = raw_ ? libcamera::Size(size_.width / 2, size_.height / 2) : size_;
+	config.size.alignDownTo(2, 2);
+	// Strides are aligned like the Pi's ISP outputs.
+	config.stride = (config.size.width + 63) & ~63;
+	config.frameSize = config.stride * config.size.height + 2 * (config.stride / 2) * (config.size.height / 2);
+	config.bufferCount = buffer_count;
+	config.colorSpace = libcamera::ColorSpace::Sycc;
+	main_stream_.Configure(config);
+	allocate(&main_stream_, buffer_count);
+
+	if (raw_)
+	{
+		config.pixelFormat = format_;
+		config.size = size_;
+		config.stride = (row_bytes(format_, size_.width) + 63) & ~63;
+		config.frameSize = config.stride * config.size.height;
+		config.colorSpace = libcamera::ColorSpace::Raw;
+		raw_stream_.Configure(config);
+		allocate(&raw_stream_, buffer_count);
+		row_.resize(2 * size_.width);
+	}
+
+	for (unsigned int i = 0; i < buffer_count; i++)
+	{
+		BufferMap buffers;
+		buffers[&main_stream_] = buffers_[&main_stream_][i].get();
+		if (raw_)
+			buffers[&raw_stream_] = buffers_[&raw_stream_][i].get();
+		buffer_sets_.push_back(buffers);
+	}
+}
+
+void ReplaySource::allocate(ReplayStream *stream, unsigned int count)
+{
+	libcamera::StreamConfiguration const &config = stream->configuration();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		int fd = allocate_buffer(config.frameSize, "replay" + std::to_string(i));
+		void *memory = mmap(NULL, config.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (memory == MAP_FAILED)
+		{
+			close(fd);
+			throw std::runtime_error("failed to mmap replay buffer");
+		}
+
+		// Like the camera's, YUV420 buffers are one allocation with a plane after another.
+		libcamera::SharedFD shared_fd(std::move(fd));
+		std::vector<FrameBuffer::Plane> planes;
+		unsigned int offset = 0;
+		auto add_plane = [&](unsigned int length) {
+			FrameBuffer::Plane plane;
+			plane.fd = shared_fd;
+			plane.offset = offset;
+			plane.length = length;
+			planes.push_back(plane);
+			offset += length;
+		};
+		if (config.pixelFormat == formats::YUV420)
+		{
+			add_plane(config.stride * config.size.height);
+			add_plane((config.stride / 2) * (config.size.height / 2));
+			add_plane((config.stride / 2) * (config.size.height / 2));
+		}
+		else
+			add_plane(config.frameSize);
+
+		buffers_[stream].push_back(std::make_unique<FrameBuffer>(planes));
+		mapped_[buffers_[stream].back().get()] =
+			libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), config.frameSize);
+	}
+}
+
+std::vector<std::unique_ptr<FrameBuffer>> const &ReplaySource::Buffers(libcamera::Stream const *stream) const
+{
+	return buffers_.at(stream);
+}
+
+void ReplaySource::Start(FrameCallback callback, EndCallback end_callback)
+{
+	callback_ = callback;
+	end_callback_ = end_callback;
+	// Buffers the app still held when it stopped will never come back, so start again
+	// with all of them.
+	free_buffers_ = {};
+	for (auto const &buffers : buffer_sets_)
+		free_buffers_.push(buffers);
+	abort_ = false;
+	thread_ = std::thread(&ReplaySource::replayThread, this);
+}
+
+void ReplaySource::Stop()
+{
+	if (!thread_.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_.notify_one();
+	}
+	thread_.join();
+}
+
+void ReplaySource::Requeue(BufferMap const &buffers)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	free_buffers_.push(buffers);
+	cond_.notify_one();
+}
+
+void ReplaySource::Teardown()
+{
+	for (auto &it : mapped_)
+		munmap(it.second.data(), it.second.size());
+	mapped_.clear();
+	buffer_sets_.clear();
+	buffers_.clear();
+}
+
+bool ReplaySource::fill(BufferMap const &buffers)
+{
+	StreamInfo info;
+	ReplayStream *stream = raw_ ? &raw_stream_ : &main_stream_;
+	FrameBuffer *buffer = buffers.at(stream);
+	info.width = stream->configuration().size.width;
+	info.height = stream->configuration().size.height;
+	info.stride = stream->configuration().stride;
+	info.pixel_format = stream->configuration().pixelFormat;
+
+	// Let the kernel keep any caches right while we write the buffers.
+	dma_buf_sync sync = { DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE };
+	for (auto const &b : buffers)
+		ioctl(b.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &sync);
+
+	uint8_t *mem = mapped_[buffer].data();
+	const bool ok = reader_->Read(mem, info);
+
+	if (ok && raw_)
+	{
+		// Sum each 2x2 Bayer block into one luma pixel, with neutral chroma.
+		libcamera::StreamConfiguration const &main = main_stream_.configuration();
+		uint8_t *y_mem = mapped_[buffers.at(&main_stream_)].data();
+		unsigned int shift = format_bits(info.pixel_format) - 6;
+		for (unsigned int y = 0; y < main.size.height; y++)
+		{
+			unpack_row(mem + 2 * y * info.stride, row_.data(), info.width, info.pixel_format);
+			unpack_row(mem + (2 * y + 1) * info.stride, row_.data() + info.width, info.width, info.pixel_format);
+			uint8_t *out = y_mem + y * main.stride;
+			for (unsigned int x = 0; x < main.size.width; x++)
+			{
+				unsigned int sum = row_[2 * x] + row_[2 * x + 1] + row_[info.width + 2 * x] +
+								   row_[info.width + 2 * x + 1];
+				out[x] = std::min(sum >> shift, 255u);
+			}
+		}
+		memset(y_mem + main.stride * main.size.height, 128, (main.stride / 2) * (main.size.height / 2) * 2);
+	}
+
+	sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE;
+	for (auto const &b : buffers)
+		ioctl(b.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &sync);
+	return ok;
+}
+
+void ReplaySource::replayThread()
+{
+	Timeline::NameThread("replay");
+	auto next = std::chrono::steady_clock::now();
+	while (true)
+	{
+		BufferMap buffers;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_.wait(lock, [this] { return abort_ || !free_buffers_.empty(); });
+			if (abort_)
+				return;
+			buffers = std::move(free_buffers_.front());
+			free_buffers_.pop();
+		}
+
+		// An exception here would take the whole process down with it, so stop quietly and let
+		// the app know instead.
+		if (!fill(buffers))
+		{
+			LOG_ERROR("ERROR: replay source has no frames");
+			end_callback_();
+			return;
+		}
+
+		if (frame_period_.count())
+		{
+			// Don't try to catch up if we fell behind, just carry on at the right rate.
+			auto now = std::chrono::steady_clock::now();
+			if (next < now)
+				next = now;
+			std::this_thread::sleep_until(next);
+			next += frame_period_;
+		}
+
+		// Sensor timestamps are CLOCK_MONOTONIC, as they are from the camera.
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		libcamera::ControlList metadata(libcamera::controls::controls);
+		metadata.set(libcamera::controls::SensorTimestamp, (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+		if (frame_period_.count())
+			metadata.set(libcamera::controls::FrameDuration, (int64_t)(frame_period_.count() / 1000));
+
+		callback_(buffers, metadata);
+	}
+}
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * replay_source.hpp - feed recorded or generated frames through the app without a camera.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/controls.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/request.h>
+#include <libcamera/stream.h>
+
+#include "core/stream_info.hpp"
+
+struct Options;
+
+// Stands in for a libcamera Stream so that the rest of the app can read the
+// configuration of replayed frames in the usual way.
+class ReplayStream : public libcamera::Stream
+{
+public:
+	void Configure(libcamera::StreamConfiguration const &config)
+	{
+		configuration_ = config;
+		configuration_.setStream(this);
+	}
+};
+
+// Somewhere for replayed frames to come from. Read() fills the buffer described by
+// "info" (rows "stride" bytes apart) and returns false if there are no frames at all.
+class ReplayReader
+{
+public:
+	virtual ~ReplayReader() {}
+	virtual bool Read(uint8_t *mem, StreamInfo const &info) = 0;
+};
+
+// Produces frames in place of a camera. Frames come from a file of packed frames
+// (as written by image/yuv.cpp or a raw dump) or from a generator, in real dmabufs
+// where the kernel has a dma heap (memfds otherwise) so that they can be mmapped and
+// given to the preview like camera buffers.
+//
+// The main stream is always YUV420. When replaying raw frames they arrive on a second
+// "raw" stream and the main stream carries a half resolution monochrome image binned
+// from them.
+class ReplaySource
+{
+public:
+	using BufferMap = libcamera::Request::BufferMap;
+	using FrameCallback = std::function<void(BufferMap const &, libcamera::ControlList const &)>;
+	using EndCallback = std::function<void()>;
+
+	ReplaySource(Options const *options);
+	~ReplaySource();
+
+	std::string const &Id() const { return id_; }
+
+	void Configure(unsigned int buffer_count);
+	libcamera::Stream *MainStream() { return &main_stream_; }
+	libcamera::Stream *RawStream() { return raw_ ? &raw_stream_ : nullptr; }
+	std::vector<std::unique_ptr<libcamera::FrameBuffer>> const &Buffers(libcamera::Stream const *stream) const;
+
+	// The end callback is called from the replay thread if it runs out of frames, after which
+	// no more come.
+	void Start(FrameCallback callback, EndCallback end_callback);
+	void Stop();
+	// Hand back the buffers of a finished frame so that they can be filled again.
+	void Requeue(BufferMap const &buffers);
+	void Teardown();
+
+private:
+	void allocate(ReplayStream *stream, unsigned int count);
+	bool fill(BufferMap const &buffers);
+	void replayThread();
+
+	std::string id_;
+	std::unique_ptr<ReplayReader> reader_;
+	libcamera::PixelFormat format_;
+	libcamera::Size size_;
+	bool raw_;
+	std::chrono::nanoseconds frame_period_; // zero means as fast as possible
+	ReplayStream main_stream_;
+	ReplayStream raw_stream_;
+	std::map<libcamera::Stream const *, std::vector<std::unique_ptr<libcamera::FrameBuffer>>> buffers_;
+	std::map<libcamera::FrameBuffer const *, libcamera::Span<uint8_t>> mapped_;
+	std::vector<BufferMap> buffer_sets_;
+	std::queue<BufferMap> free_buffers_;
+	std::vector<uint16_t> row_;
+	FrameCallback callback_;
+	EndCallback end_callback_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool abort_;
+	std::thread thread_;
+};
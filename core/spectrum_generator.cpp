@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spectrum_generator.cpp - render synthetic spectroscope frames with known ground truth.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+#include <libcamera/formats.h>
+
+#include "core/spectrum_generator.hpp"
+
+namespace formats = libcamera::formats;
+
+// Sub-pixel steps at which the shifted spectrum is precomputed.
+#define OVERSAMPLE 16
+
+namespace
+{
+
+unsigned int format_bits(libcamera::PixelFormat const &format)
+{
+	if (format == formats::SBGGR10_CSI2P)
+		return 10;
+	else if (format == formats::SBGGR12_CSI2P)
+		return 12;
+	else if (format == formats::SBGGR16)
+		return 16;
+	return 8;
+}
+
+void pack_row(uint16_t const *in, uint8_t *out, unsigned int width, libcamera::PixelFormat const &format)
+{
+	if (format == formats::SBGGR10_CSI2P)
+	{
+		for (unsigned int x = 0; x < width; x += 4, out += 5)
+		{
+			out[4] = 0;
+			for (unsigned int i = 0; i < 4; i++)
+			{
+				out[i] = in[x + i] >> 2;
+				out[4] |= (in[x + i] & 3) << (2 * i);
+			}
+		}
+	}
+	else if (format == formats::SBGGR12_CSI2P)
+	{
+		for (unsigned int x = 0; x < width; x += 2, out += 3)
+		{
+			out[0] = in[x] >> 4;
+			out[1] = in[x + 1] >> 4;
+			out[2] = (in[x] & 0xf) | ((in[x + 1] & 0xf) << 4);
+		}
+	}
+	else if (format == formats::SBGGR16)
+	{
+		for (unsigned int x = 0; x < width; x++, out += 2)
+			out[0] = in[x] & 0xff, out[1] = in[x] >> 8;
+	}
+	else if (format == formats::YUYV)
+	{
+		for (unsigned int x = 0; x < width; x++, out += 2)
+			out[0] = in[x], out[1] = 128;
+	}
+	else if (format == formats::RGB888)
+	{
+		for (unsigned int x = 0; x < width; x++, out += 3)
+			out[0] = out[1] = out[2] = in[x];
+	}
+	else
+	{
+		for (unsigned int x = 0; x < width; x++)
+			out[x] = in[x];
+	}
+}
+
+// A good 32-bit integer hash, so that the noise for a pixel depends only on the seed,
+// frame and position. Being a pure function of x it also vectorises.
+inline uint32_t hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+double planck(double wavelength, double temperature)
+{
+	const double h = 6.626e-34;
+	const double c = 2.998e8;
+	const double k = 1.38066e-23;
+	double wl = wavelength * 1e-9;
+	return 2.0 * h * c * c / (pow(wl, 5) * (exp(h * c / (wl * k * temperature)) - 1.0));
+}
+
+} // namespace
+
+std::vector<SpectrumGenerator::Line> const &SpectrumGenerator::Lines()
+{
+	// A fluorescent lamp, whose lines ParsePeaks calibrates against, brightest first.
+	static const std::vector<Line> lines = {
+		{ 542.5, 1.0 }, { 610.4, 0.8 }, { 435.8, 0.6 }, { 486.7, 0.45 }, { 586.2, 0.3 },
+	};
+	return lines;
+}
+
+SpectrumGenerator::SpectrumGenerator(Config const &config)
+	: config_(config), frame_(0), width_(0), height_(0), pad_(0)
+{
+	config_.threads = std::clamp(config_.threads, 1u, 64u);
+}
+
+float SpectrumGenerator::Column(float wavelength) const
+{
+	return (wavelength - config_.wavelength_min) / (config_.wavelength_max - config_.wavelength_min) * width_;
+}
+
+float SpectrumGenerator::Wavelength(float column) const
+{
+	return config_.wavelength_min + column / width_ * (config_.wavelength_max - config_.wavelength_min);
+}
+
+void SpectrumGenerator::setup(StreamInfo const &info)
+{
+	width_ = info.width;
+	height_ = info.height;
+	format_ = info.pixel_format;
+
+	float centre = config_.band_centre * height_;
+	float sigma = std::max(config_.band_width * height_, 1.0f);
+	profile_.resize(height_);
+	shift_.resize(height_);
+	float max_shift = 0;
+	for (unsigned int y = 0; y < height_; y++)
+	{
+		float d = (y - centre) / sigma;
+		profile_[y] = expf(-0.5 * d * d);
+		shift_[y] = config_.slope * y + config_.smile * d * d;
+		// Rows well outside the band are black and their shift doesn't matter.
+		if (profile_[y] > 1e-4)
+			max_shift = std::max(max_shift, fabsf(shift_[y]));
+		else
+			shift_[y] = 0;
+	}
+
+	double planck_max = 0;
+	if (config_.temperature > 0)
+	{
+		for (unsigned int x = 0; x < width_; x++)
+			planck_max = std::max(planck_max, planck(Wavelength(x), config_.temperature));
+	}
+	auto spectrum = [this, planck_max](float x) {
+		float v = 0;
+		if (planck_max > 0)
+			v = config_.continuum * planck(Wavelength(x), config_.temperature) / planck_max;
+		for (auto const &line : Lines())
+		{
+			float d = (x - Column(line.wavelength)) / config_.line_width;
+			v += config_.lines * line.strength * expf(-0.5 * d * d);
+		}
+		return v;
+	};
+
+	truth_.resize(width_);
+	for (unsigned int x = 0; x < width_; x++)
+		truth_[x] = spectrum(x);
+
+	// Each phase p holds the spectrum offset by p / OVERSAMPLE of a pixel, so any row
+	// is a contiguous run out of one of them.
+	pad_ = ceilf(max_shift) + 2;
+	phases_.assign(OVERSAMPLE, std::vector<float>(width_ + 2 * pad_));
+	for (unsigned int p = 0; p < OVERSAMPLE; p++)
+	{
+		for (unsigned int j = 0; j < width_ + 2 * pad_; j++)
+		{
+			float x = (float)j - pad_ + (float)p / OVERSAMPLE;
+			phases_[p][j] = spectrum(std::clamp(x, 0.0f, (float)width_ - 1));
+		}
+	}
+}
+
+void SpectrumGenerator::renderRows(uint8_t *mem, StreamInfo const &info, unsigned int y0, unsigned int y1,
+								   uint32_t frame) const
+{
+	const float max_value = (1 << format_bits(info.pixel_format)) - 1;
+	const bool noise = config_.full_well > 0;
+	const float inv_full_well = noise ? 1.0 / config_.full_well : 0;
+	const float read_var = noise ? config_.read_noise * config_.read_noise * inv_full_well * inv_full_well : 0;
+	std::vector<float> signal(width_);
+	std::vector<uint16_t> values(width_);
+
+	for (unsigned int y = y0; y < y1; y++)
+	{
+		// Column x of this row shows the spectrum at x - shift.
+		int t = lroundf(-shift_[y] * OVERSAMPLE);
+		int k = t >= 0 ? t / OVERSAMPLE : -((-t + OVERSAMPLE - 1) / OVERSAMPLE);
+		float const *src = phases_[t - k * OVERSAMPLE].data() + pad_ + k;
+		const float band = profile_[y];
+		for (unsigned int x = 0; x < width_; x++)
+			signal[x] = config_.dark + band * src[x];
+
+		if (noise)
+		{
+			// Two uniforms from one hash sum to a unit variance triangular deviate, which
+			// is close enough to Gaussian for this.
+			const uint32_t row_seed = hash(config_.seed ^ hash(frame * height_ + y));
+			for (unsigned int x = 0; x < width_; x++)
+			{
+				uint32_t h = hash(row_seed + x);
+				float n = ((h & 0xffff) + (h >> 16)) * (1.0f / 65536) - 1.0f;
+				signal[x] += n * 2.449490f * sqrtf(std::max(signal[x], 0.0f) * inv_full_well + read_var);
+			}
+		}
+
+		for (unsigned int x = 0; x < width_; x++)
+			values[x] = std::clamp(signal[x] * max_value + 0.5f, 0.0f, max_value);
+		pack_row(values.data(), mem + y * info.stride, width_, info.pixel_format);
+	}
+}
+
+bool SpectrumGenerator::Read(uint8_t *mem, StreamInfo const &info)
+{
+	if (info.width != width_ || info.height != height_ || info.pixel_format != format_)
+		setup(info);
+
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < config_.threads; i++)
+		threads.emplace_back(&SpectrumGenerator::renderRows, this, mem, std::cref(info), i * height_ / config_.threads,
+							 (i + 1) * height_ / config_.threads, frame_);
+	for (auto &t : threads)
+		t.join();
+
+	if (info.pixel_format == formats::YUV420)
+		memset(mem + info.stride * info.height, 128, (info.stride / 2) * (info.height / 2) * 2);
+
+	frame_++;
+	return true;
+}
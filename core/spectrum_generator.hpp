@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spectrum_generator.hpp - render synthetic spectroscope frames with known ground truth.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <libcamera/pixel_format.h>
+
+#include "core/replay_source.hpp"
+#include "core/stream_info.hpp"
+
+// Draws what the camera would see through the spectroscope: a horizontal band whose
+// brightness along its length is the spectrum. The spectrum is a Planck continuum plus
+// the emission lines that SpectrumEngine::ParsePeaks calibrates against, with a linear
+// dispersion from wavelength_min at the left edge to wavelength_max at the right.
+//
+// The band can be tilted (slope, in the same sense as SpectrumEngine's slope, so that the
+// spectrum column x appears at x + slope * y) and curved (smile). Frames can carry shot
+// and read noise, drawn from a counter-based generator so that every frame is the same
+// for a given seed and frame number however many threads render it.
+//
+// YUV420 and YUYV frames have neutral chroma and RGB888 frames are grey; raw frames are
+// rendered as a monochrome sensor.
+class SpectrumGenerator : public ReplayReader
+{
+public:
+	struct Config
+	{
+		float wavelength_min = 380; // nm at the left edge
+		float wavelength_max = 780; // nm at the right edge
+		float temperature = 2800; // of the continuum in K (0 = no continuum)
+		float continuum = 0.3; // peak of the continuum, as a fraction of full scale
+		float lines = 0.8; // peak of the brightest emission line (0 = no lines)
+		float line_width = 1.5; // sigma of each line in pixels
+		float band_centre = 0.5; // as a fraction of the frame height
+		float band_width = 0.1; // sigma of the band, as a fraction of the frame height
+		float slope = 0; // horizontal shift in pixels per row
+		float smile = 0; // further shift in pixels one band sigma from the centre
+		float dark = 0.06; // black level as a fraction of full scale
+		float full_well = 0; // electrons at full scale, for shot noise (0 = no noise)
+		float read_noise = 0; // in electrons rms
+		uint32_t seed = 1;
+		unsigned int threads = 4;
+	};
+
+	struct Line
+	{
+		float wavelength; // nm
+		float strength; // relative to the brightest
+	};
+	static const std::vector<Line> &Lines();
+
+	SpectrumGenerator(Config const &config);
+
+	// Render the next frame. The frame number advances each time, and with it the noise.
+	bool Read(uint8_t *mem, StreamInfo const &info) override;
+
+	// Ground truth for the last frame rendered.
+	float Column(float wavelength) const; // where a wavelength falls, ignoring slope and smile
+	float Wavelength(float column) const;
+	std::vector<float> const &Spectrum() const { return truth_; } // noiseless, one value per column
+	unsigned int Frame() const { return frame_; }
+
+private:
+	void setup(StreamInfo const &info);
+	void renderRows(uint8_t *mem, StreamInfo const &info, unsigned int y0, unsigned int y1, uint32_t frame) const;
+
+	Config config_;
+	uint32_t frame_;
+	unsigned int width_;
+	unsigned int height_;
+	libcamera::PixelFormat format_;
+	unsigned int pad_; // columns of padding either side of each phase
+	std::vector<std::vector<float>> phases_; // the spectrum at each sub-pixel offset
+	std::vector<float> profile_; // band brightness for each row
+	std::vector<float> shift_; // horizontal shift for each row
+	std::vector<float> truth_;
+};
@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * timeline.cpp - record what each thread did, for viewing as a Chrome/Perfetto trace.
+ */
+
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+
+#include "core/logging.hpp"
+#include "core/timeline.hpp"
+
+// Events in one window. At 24 bytes each this is 6MB, allocated only if enabled.
+#define TIMELINE_CAPACITY (1 << 18)
+
+static std::atomic<bool> start_requested;
+static std::atomic<uint32_t> next_thread;
+static thread_local uint32_t thread_index = UINT32_MAX;
+static std::mutex names_mutex;
+static std::map<uint32_t, std::string> thread_names;
+
+static void start_signal_handler(int)
+{
+	start_requested.store(true, std::memory_order_relaxed);
+}
+
+static uint64_t now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t this_thread()
+{
+	if (thread_index == UINT32_MAX)
+		thread_index = next_thread.fetch_add(1, std::memory_order_relaxed);
+	return thread_index;
+}
+
+Timeline &Timeline::Get()
+{
+	static Timeline timeline;
+	return timeline;
+}
+
+Timeline::Timeline()
+	: capacity_(0), claimed_(0), committed_(0), recording_(false), deadline_(0), window_ns_(0), abort_(false)
+{
+}
+
+Timeline::~Timeline()
+{
+	if (thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		cond_.notify_one();
+		thread_.join();
+	}
+}
+
+void Timeline::Enable(std::string const &filename, float seconds)
+{
+	if (thread_.joinable())
+		return;
+	filename_ = filename;
+	window_ns_ = seconds * 1e9;
+	capacity_ = TIMELINE_CAPACITY;
+	events_ = std::make_unique<Event[]>(capacity_);
+	thread_ = std::thread(&Timeline::writerThread, this);
+	signal(SIGUSR2, start_signal_handler);
+	LOG(1, "Send SIGUSR2 to record " << seconds << "s of thread activity to " << filename);
+}
+
+void Timeline::Start()
+{
+	start_requested.store(true, std::memory_order_relaxed);
+	cond_.notify_one();
+}
+
+void Timeline::NameThread(char const *name)
+{
+	// Cheap enough to call from callbacks that run on someone else's thread.
+	static thread_local char const *current_name;
+	if (current_name == name)
+		return;
+	current_name = name;
+	std::lock_guard<std::mutex> lock(names_mutex);
+	thread_names[this_thread()] = name;
+}
+
+void Timeline::record(char const *name, char phase, int64_t arg)
+{
+	uint64_t time = now_ns();
+	if (time > deadline_.load(std::memory_order_relaxed))
+	{
+		recording_.store(false, std::memory_order_relaxed);
+		return;
+	}
+	uint32_t i = claimed_.fetch_add(1, std::memory_order_relaxed);
+	if (i >= capacity_)
+	{
+		recording_.store(false, std::memory_order_relaxed);
+		return;
+	}
+	events_[i] = { time, name, arg, this_thread(), phase };
+	committed_.fetch_add(1, std::memory_order_release);
+}
+
+void Timeline::write()
+{
+	uint32_t count = std::min(claimed_.load(std::memory_order_relaxed), capacity_);
+	// Anyone who claimed a slot before recording stopped gets a moment to fill it.
+	for (int i = 0; i < 100 && committed_.load(std::memory_order_acquire) < count; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	count = std::min(count, committed_.load(std::memory_order_acquire));
+
+	std::ofstream file(filename_);
+	if (!file)
+	{
+		LOG_ERROR("Failed to open " << filename_ << " for the timeline");
+		return;
+	}
+	// Events are claimed in order but filled in any order, so put them back in order.
+	std::sort(&events_[0], &events_[count], [](Event const &a, Event const &b) { return a.time < b.time; });
+	pid_t pid = getpid();
+	file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	{
+		std::lock_guard<std::mutex> lock(names_mutex);
+		for (auto const &[tid, name] : thread_names)
+			file << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"tid\": " << tid
+				 << ", \"args\": {\"name\": \"" << name << "\"}},\n";
+	}
+	file.setf(std::ios::fixed);
+	file.precision(3);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		Event const &e = events_[i];
+		file << "{\"name\": \"" << e.name << "\", \"ph\": \"" << e.phase << "\", \"ts\": " << e.time / 1e3
+			 << ", \"pid\": " << pid << ", \"tid\": " << e.thread;
+		if (e.arg >= 0)
+			file << ", \"args\": {\"frame\": " << e.arg << "}";
+		file << "}" << (i + 1 < count ? ",\n" : "\n");
+	}
+	file << "]}\n";
+	LOG(1, "Wrote " << count << " timeline events to " << filename_);
+}
+
+void Timeline::writerThread()
+{
+	NameThread("timeline writer");
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!abort_)
+	{
+		cond_.wait_for(lock, std::chrono::milliseconds(100));
+		if (!start_requested.exchange(false, std::memory_order_relaxed) || recording_)
+			continue;
+
+		claimed_ = 0;
+		committed_ = 0;
+		deadline_ = now_ns() + window_ns_;
+		recording_ = true;
+		LOG(1, "Recording timeline");
+		while (!abort_ && recording_ && now_ns() < deadline_)
+			cond_.wait_for(lock, std::chrono::milliseconds(100));
+		recording_ = false;
+		write();
+	}
+}
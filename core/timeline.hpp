@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * timeline.hpp - record what each thread did, for viewing as a Chrome/Perfetto trace.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A window of begin/end events from every thread, written out in Chrome's JSON trace
+// format (chrome://tracing, ui.perfetto.dev) once the window closes.
+//
+// Recording is off until Start() is called (eleven presses of libcamera-vid's button) or
+// the process gets SIGUSR2, which the apps then leave to the timeline, and then runs for a
+// fixed time or until the buffer is full. Events go into a buffer allocated by Enable(),
+// so recording one costs an atomic increment and a few stores: names must be string
+// literals, and nothing is formatted until the window has closed.
+class Timeline
+{
+public:
+	static Timeline &Get();
+	~Timeline();
+
+	// Get ready to record windows of the given length into the given file.
+	void Enable(std::string const &filename, float seconds);
+	void Start();
+	bool Recording() const { return recording_.load(std::memory_order_relaxed); }
+
+	// Call once at the top of a thread so that it has a name in the trace.
+	static void NameThread(char const *name);
+
+	void Begin(char const *name, int64_t arg = -1)
+	{
+		if (Recording())
+			record(name, 'B', arg);
+	}
+	void End(char const *name)
+	{
+		if (Recording())
+			record(name, 'E', -1);
+	}
+
+private:
+	struct Event
+	{
+		uint64_t time; // ns, CLOCK_MONOTONIC
+		char const *name;
+		int64_t arg; // usually a frame sequence number, -1 for none
+		uint32_t thread;
+		char phase;
+	};
+
+	Timeline();
+	void record(char const *name, char phase, int64_t arg);
+	void write();
+	void writerThread();
+
+	std::unique_ptr<Event[]> events_;
+	uint32_t capacity_;
+	std::atomic<uint32_t> claimed_;
+	std::atomic<uint32_t> committed_;
+	std::atomic<bool> recording_;
+	std::atomic<uint64_t> deadline_;
+	std::string filename_;
+	uint64_t window_ns_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool abort_;
+	std::thread thread_;
+};
+
+// Marks a span of time on the current thread's track.
+class TimelineScope
+{
+public:
+	TimelineScope(char const *name, int64_t arg = -1) : name_(name) { Timeline::Get().Begin(name, arg); }
+	~TimelineScope() { Timeline::Get().End(name_); }
+
+private:
+	char const *name_;
+};
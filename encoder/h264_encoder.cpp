@@ -15,6 +15,8 @@
 #include <chrono>
 #include <iostream>
 
+#include "core/timeline.hpp"
+
 #include "h264_encoder.hpp"
 
 static int xioctl(int fd, unsigned long ctl, void *arg)
@@ -245,6 +247,7 @@ H264Encoder::~H264Encoder()
 
 void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
+	TimelineScope scope("h264 queue");
 	int index;
 	{
 		// We need to find an available output buffer (input to the codec) to
@@ -274,6 +277,7 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 
 void H264Encoder::pollThread()
 {
+	Timeline::NameThread("h264 poll");
 	while (true)
 	{
 		pollfd p = { fd_, POLLIN, 0 };
@@ -291,6 +295,7 @@ void H264Encoder::pollThread()
 		}
 		if (p.revents & POLLIN)
 		{
+			TimelineScope scope("h264 dequeue");
 			v4l2_buffer buf = {};
 			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
 			buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
@@ -338,6 +343,7 @@ void H264Encoder::pollThread()
 
 void H264Encoder::outputThread()
 {
+	Timeline::NameThread("h264 output");
 	OutputItem item;
 	while (true)
 	{
@@ -362,6 +368,7 @@ void H264Encoder::outputThread()
 			}
 		}
 
+		TimelineScope scope("h264 output");
 		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe);
 		v4l2_buffer buf = {};
 		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
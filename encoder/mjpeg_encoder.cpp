@@ -10,6 +10,8 @@
 
 #include <jpeglib.h>
 
+#include "core/timeline.hpp"
+
 #include "mjpeg_encoder.hpp"
 
 #if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
@@ -93,6 +95,7 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 
 void MjpegEncoder::encodeThread(int num)
 {
+	Timeline::NameThread("mjpeg encode");
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 	cinfo.err = jpeg_std_error(&jerr);
@@ -131,7 +134,9 @@ void MjpegEncoder::encodeThread(int num)
 		uint8_t *encoded_buffer = nullptr;
 		size_t buffer_len = 0;
 		auto start_time = std::chrono::high_resolution_clock::now();
+		Timeline::Get().Begin("jpeg encode");
 		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
+		Timeline::Get().End("jpeg encode");
 		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
 		frames++;
 		// Don't return buffers until the output thread as that's where they're
@@ -149,6 +154,7 @@ void MjpegEncoder::encodeThread(int num)
 
 void MjpegEncoder::outputThread()
 {
+	Timeline::NameThread("mjpeg output");
 	OutputItem item;
 	uint64_t index = 0;
 	while (true)
@@ -184,6 +190,7 @@ void MjpegEncoder::outputThread()
 			}
 		}
 	got_item:
+		TimelineScope scope("mjpeg output");
 		input_done_callback_(nullptr);
 
 		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
@@ -5,13 +5,21 @@
  * egl_preview.cpp - X/EGL-based preview window.
  */
 
+#include <algorithm>
+#include <cstddef>
 #include <map>
 #include <string>
+#include <vector>
 
 // Include libcamera stuff before X11, as X11 #defines both Status and None
 // which upsets the libcamera headers.
 
+#include "core/latency_trace.hpp"
+#include "core/logging.hpp"
+#include "core/metrics.hpp"
 #include "core/options.hpp"
+#include "core/timeline.hpp"
+#include "spectrum/spectrum_engine.hpp"
 
 #include "preview.hpp"
 
@@ -23,52 +31,70 @@
 // We do use None, so if we had to #undefine it we could replace it by zero
 // in what follows below.
 #include <math.h>
-#include <gsl/gsl_fit.h>
 #include <epoxy/egl.h>
 #include <epoxy/gl.h>
 #include <iostream>
-#include <thread>
-#define STB_IMAGE_IMPLEMENTATION
+#define STB_TRUETYPE_IMPLEMENTATION
 #define MAX_PEAKS 20
-#include <stb/stb_image.h>
+#include <stb/stb_truetype.h>
 #include <../find-peaks/PeakFinder.h>
 
-#define R_PROP 1.0
-#define G_PROP 1.0
-#define B_PROP 1.0
-
-#define RY 1.0
-#define RU 0.0
-#define RV 1.4075
-
-#define GY 1.0
-#define GU -0.3455
-#define GV -0.7169
-
-#define BY 1.0
-#define BU 1.779
-#define BV 0.0
-
-
-#define Y_FAC (BY*B_PROP + RY*R_PROP + GY*G_PROP)
-#define U_FAC (BU*B_PROP + RU*R_PROP + GU*G_PROP) 
-#define V_FAC (BV*B_PROP + RV*R_PROP + GV*G_PROP)
-
-
 bool doMercury = false;
 bool doIncandescent = false;
 bool doDark = false;
 bool doShadow = true;
 bool doSlope = false;
 bool doSave = false;
-char slopeFileName[] = "calSlope.txt";
-char incandescentFileName[] = "calIncandescent.txt";
-char darkFileName[] = "calDark.txt";
-char wavelengthFileName[] = "calWavelength.txt";
+bool doDarkFrames = false;
+bool doFlatFrames = false;
+bool doReference = false;
+static std::string referenceFileName(char const *name)
+{
+	return std::string("calReference_") + name + ".txt";
+}
 std::chrono::time_point <std::chrono::system_clock>shadowTime;
-int labelPositions[]={ 100,250,400,550,700,850,1000,1150};
 float labelValues[]={ 300,400,500,600,700,800,900,1000};
 int numLabels = 8;
+
+// Printable ASCII is baked into a single alpha texture when the preview starts.
+#define FONT_ATLAS_SIZE 512
+#define FONT_FIRST_CHAR 32
+#define FONT_NUM_CHARS 95
+// Most peaks that get their wavelength written above them.
+#define MAX_PEAK_LABELS 5
+
+// Colours of the live traces, track by track, going round again if there are more tracks.
+static const float trackColours[][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0.3, 0.6, 1 }, { 1, 0, 1 } };
+#define NUM_TRACK_COLOURS (sizeof(trackColours) / sizeof(trackColours[0]))
+
+// Reference spectra drawn behind the live trace. Each has its own vertex buffer, which is
+// only written when the reference changes.
+struct Reference
+{
+	char const *name;
+	float r, g, b, opacity;
+	float fadeSeconds; // 0 = never fades
+	bool persist; // kept in the calibration store
+	GLuint buffer = 0;
+	std::vector<float> data = {}; // normalised to a peak of 1, empty if not set
+	std::chrono::time_point<std::chrono::system_clock> time = {};
+};
+enum
+{
+	REFERENCE_CAPTURE, // the frozen "shadow" trace
+	REFERENCE_LAMP, // calibrated lamp spectrum, captured with the incandescent calibration
+	REFERENCE_LIBRARY, // only ever loaded from its calibration file
+	NUM_REFERENCES
+};
+
+// All the text on screen is one array of these, drawn as triangles in a single call.
+struct TextVertex
+{
+	float x, y; // window pixels, origin top left
+	float s, t; // atlas coordinates
+	GLubyte colour[4];
+};
+
 class EglPreview : public Preview
 {
 public:
@@ -78,6 +104,8 @@ public:
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
+	virtual void SetAnalysisFrame(libcamera::Span<uint8_t> span, StreamInfo const &info) override;
+	virtual void SetExposure(float exposure, float gain) override { engine.SetExposure(exposure, gain); }
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() override;
@@ -101,11 +129,20 @@ private:
 	};
 	void makeWindow(char const *name);
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
-	uint32_t ShrinkData(GLubyte *pixels, StreamInfo const *info, uint32_t *shrunk,float *slope );
-      //  void findPeaks(uint16_t *data, uint16_t width, uint16_t *peaks);
-        void parsePeaks(uint32_t *data, uint16_t width);
-        void incandescentCal(uint32_t *shrunk, uint16_t width);
-        void darkCal(uint32_t *shrunk, uint16_t width);
+	void configure(StreamInfo const &info);
+	void configureSpectrum(StreamInfo const &info);
+	void setReference(unsigned int index, float const *data, float scale, unsigned int width);
+	void drawTrace(GLuint buffer, unsigned int width, float scale, float r, float g, float b, float a);
+	float textWidth(std::string const &text) const;
+	void addText(std::string const &text, float x, float y, GLubyte r, GLubyte g, GLubyte b);
+	void drawText();
+	void drawWaterfall(float scale, unsigned int width);
+	void smoothSpectra(unsigned int width);
+	// The spectrum of a track as it is shown, smoothed if asked.
+	float const *displayed(unsigned int track) const
+	{
+		return smoothing ? &smoothed[track * engine.Width()] : engine.Spectrum(track);
+	}
 	void readCal(unsigned int width);
 	void saveCal(unsigned int width);
 	::Display *display_;
@@ -116,6 +153,9 @@ private:
 	std::map<int, Buffer> buffers_; // map the DMABUF's fd to the Buffer
 	int last_fd_;
 	bool first_time_;
+	bool glReady; // the GL objects that outlive a Reset have been made
+	unsigned int videoWidth; // of the stream the video program was made for
+	unsigned int videoHeight;
 	Atom wm_delete_window_;
 	// size of preview window
 	int x_;
@@ -127,20 +167,31 @@ private:
 	GLint prog;
 	GLint progShrink;
 	GLint progGraph;
-	GLuint renderFramebufferName[1];
-	GLuint renderedTexture[3];
-	uint32_t *shrunk;
-	double *incandescentCalibration;
-	uint32_t *darkCalibration;
-	GLubyte *shadowData;
-	GLubyte * graphData;
-	GLubyte* pixels;
-	float slope;
+	std::vector<GLuint> graphBuffers;
+	Reference references[NUM_REFERENCES];
+	GLint graphScaleLoc;
+	GLint graphColourLoc;
+	SpectrumEngine engine;
+	bool smoothing;
+	bool lampPending; // the engine is averaging the lamp
+	SpectrumFilter displayFilter;
+	std::vector<float> smoothed; // every track's spectrum, one after another
+	std::vector<SpectrumEngine::Peak> labelledPeaks; // by height, for the labels
+	libcamera::Span<uint8_t> analysisSpan; // empty to analyse the displayed frame
+	StreamInfo analysisInfo;
 	GLint progText;
 	GLuint textTexture;
-//	float label_a;
-	double label_b;
-	double label_c;
+	GLuint textBuffer;
+	GLint textScreenLoc;
+	stbtt_bakedchar fontChars[FONT_NUM_CHARS];
+	std::vector<TextVertex> textVertices;
+	std::string infoText;
+	GLint progWaterfall;
+	GLuint waterfallTextures[2];
+	GLint waterfallHeadLoc;
+	unsigned int waterfallDepth;
+	unsigned int waterfallHead;
+	std::vector<GLubyte> waterfallRow;
 	Options const * theOptions;
 };
 
@@ -148,237 +199,43 @@ void EglPreview::readCal(unsigned int width){
 	std::string line;
 	unsigned int w;
 	std::ifstream calfile;
-	calfile.open(slopeFileName);
-	if(calfile){
-		std::getline(calfile, line);
-		slope = std::stod(line);
-		calfile.close();
-		std::cout << "Loaded Slope = " << slope << "\n";
-	}
-	
-	calfile.open(darkFileName);
-	if(calfile){
-		std::getline(calfile, line);
-		w=std::stoi(line);
-		for(unsigned int i=0;i<std::min(w,width); i++){
-			std::getline(calfile, line);
-			std::cout << i << " " << w << "-" << width  << "line=" << line <<"\n";
-			darkCalibration[i] = std::stod(line);
-		}
-		calfile.close();
-		std::cout << "Loaded Dark" << "\n";
-	}
+	engine.ReadCal();
 
-	calfile.open(incandescentFileName);
-	if(calfile){
-		std::getline(calfile, line);
-		w=std::stoi(line);
-		for(unsigned int i=0;i<std::min(w,width); i++){
+	for(unsigned int r=0; r<NUM_REFERENCES; r++){
+		if(!references[r].persist)
+			continue;
+		calfile.open(referenceFileName(references[r].name));
+		if(calfile){
 			std::getline(calfile, line);
-			incandescentCalibration[i] = std::stod(line);
+			w=std::stoi(line);
+			std::vector<float> data(width, 0.0f);
+			for(unsigned int i=0;i<std::min(w,width); i++){
+				std::getline(calfile, line);
+				data[i] = std::stod(line);
+			}
+			calfile.close();
+			setReference(r, data.data(), 1.0, width);
+			LOG(1, "Loaded Reference " << references[r].name);
 		}
-		calfile.close();
-		std::cout << "Loaded Incandescent" << "\n";
-	}
-
-	calfile.open(wavelengthFileName);
-	if(calfile){
-		std::getline(calfile, line);
-		label_b = std::stod(line);
-		std::getline(calfile, line);
-		label_c = std::stod(line);
-		calfile.close();
-		// put the labels in the right positions
-    		for(int i=0; i<numLabels; i++){
-			std::cout << "Label " << labelValues[i] << " " << ( label_c+label_b*labelValues[i] ) << "\n";
-			labelPositions[i]=label_c+label_b*labelValues[i];
-    		}
-		std::cout << "Loaded Dark" << "\n";
 	}
 }
 
 void EglPreview::saveCal(unsigned int width){
-	std::cout << "Save Calibration" << "\n";
+	LOG(1, "Save Calibration");
 	std::ofstream calfile;
-	calfile.open(slopeFileName);
-	calfile << slope << "\n";
-	calfile.close();
-// save dark cal
-	calfile.open(darkFileName);
-	calfile << width << "\n";
-	for(unsigned int i=0;i<width; i++){
-		calfile << darkCalibration[i] << "\n";
-	}
-	calfile.close();
-// save amplitude cal
-	calfile.open(incandescentFileName);
-	calfile << width << "\n";
-	for(unsigned int i=0;i<width; i++){
-		calfile << incandescentCalibration[i] << "\n";
-	}
-	calfile.close();
-// save coefficients for wavelength fit
-	calfile.open(wavelengthFileName);
-	calfile << label_b << "\n";
-	calfile << label_c << "\n";
-	calfile.close();
-}
-/*
-void EglPreview::findPeaks(uint16_t *data, uint16_t width, int *peaks, uint16_t maxPeaks){
-	float smooth[]={-1.0,-2.0, 2.0, 1.0};
-	int numPeaks =0;
-	float lastd = 0;
-	for(int x=0; x<width-7;x++){
-		float d=0;
-		for(int i=0;i<4;i++){
-			d+=smooth[i]*data[x+i];
-		}
-		if(x>0 && d*lastd<0 && numPeaks<MAX_PEAKS){
-			peaks[numPeaks]=x+2;
-			numPeaks++;
-		}
-		lastd=d;
-	}
-}
-*/
-void EglPreview::parsePeaks(uint32_t *data, uint16_t width){
-	std::vector<float> in(data, data + width);
-	std::vector<int> out;
-	std::cout << "parsePeaks"<<"\n";
-	PeakFinder::findPeaks(in, out, false,1);
-	std::cout << "doneFindPeaks"<<"\n";
-	std::vector<int> order;
-	double realPeaks[]={542.5, 610.4, 435.1, 486.7, 586.2};
-	unsigned int numPeaks=0;
-	std::cout << "out.size()"<< out.size()<<"\n";
-	if(out.size()<3){
-		return;
-	}
-	for(unsigned int i=0; i<out.size();i++){
-		std::cout << "i=" << i<<"\n";
-		std::cout << "out[i]"<< out[i]<<"\n";
-		std::cout << "out[i-1]"<< out[i-1]<<"\n";
-		if(i>0 && data[out[i]]!=data[out[i-1]]){
-			order.push_back(i);
-			std::cout << "Peak"<< out[i]<<","<< data[out[i]] <<"\n";
-			numPeaks++;
-		}
-	}
-
-	// sort the peaks
-	std::sort(order.begin(), order.end(), [&out,&data](int i1, int i2){ return data[out[i1]]> data[out[i2]];});
-	        // Try to swap any peaks obviously in the wrong order
-	for(unsigned int i=0; i<numPeaks;i++){
-		std::cout << "sorted Peak"<< out[order[i]]<<","<< data[out[order[i]]] <<" -> " << realPeaks[i] << "\n";
-	}
-        if(out.size()>1 && out[order[0]] > out[order[1]]){
-                int t = order[1];
-                order[1] = order[0];
-                order[0] = t;
-        }
-        if(out.size()>3 && out[order[0]] > out[order[4]]){
-                int t = order[3];
-                order[3] = order[4];
-                order[4] = t;
-        }
-
-	for(unsigned int i=0; i<numPeaks;i++){
-		std::cout << " i=" << i << "\n";
-		std::cout << "sorted Peak2 "<< out[order[i]]<<","<<" -> " << realPeaks[i] << "\n";
-		labelPositions[order[i]] = out[order[i]];
-	}
-	int i, n;
-	double screenx[5];
-//  	double xi, yi, ei, chisq;
-//  	gsl_matrix *X, *cov;
-//  	gsl_vector *y, *w, *c;
-	double cov00, cov01, cov11, sumsq;
-  	n = numPeaks>5? 5: numPeaks;
-	if( numPeaks < 3){
-		return;
-	}
-	std::cout << " Pre Loop"  << "\n";
-	for(i=0; i<n; i++){
-		screenx[i] = out[order[i]];
-	}
-	std::cout << " Pre fit"  << "\n";
-	gsl_fit_linear (realPeaks, 1, screenx, 1, n, &label_c, &label_b, &cov00, &cov01, &cov11, &sumsq);
-	std::cout << " Post fit"  << "\n";
-
-/*  	X = gsl_matrix_alloc (n, 3);
-  	y = gsl_vector_alloc (n);
-  	w = gsl_vector_alloc (n);
-
-  	c = gsl_vector_alloc (3);
-  	cov = gsl_matrix_alloc (3, 3);
-  	for(i=0; i<n;i++){
-		yi=out[order[i]];
-      		xi=realPeaks[i];
-		ei=1.0;
-		gsl_matrix_set (X, i, 0, 1.0);
-      		gsl_matrix_set (X, i, 1, xi);
-      		gsl_matrix_set (X, i, 2, xi*xi);
-
-      		gsl_vector_set (y, i, yi);
-      		gsl_vector_set (w, i, 1.0/(ei*ei));
-    	}
-	gsl_multifit_linear_workspace * work = gsl_multifit_linear_alloc (n, 3);
-    	gsl_multifit_wlinear (X, w, y, c, cov, &chisq, work);
-    	gsl_multifit_linear_free (work);
-
-#define C(i) (gsl_vector_get(c,(i)))
-    	label_c = C(0);
-    	label_b = C(1);
-    	label_a = C(2);*/
-    	for(i=0; i<numLabels; i++){
-		std::cout << "Label " << labelValues[i] << " " << ( label_c+label_b*labelValues[i] ) << "\n";
-		labelPositions[i]=label_c+label_b*labelValues[i];
-    	}
-    	std::cout << "Fit b=" << label_b << "x + c=" << label_c << "\n";
-}
-
-
-void EglPreview::incandescentCal(uint32_t *shrunk, uint16_t width){
-	const double h = 6.626e-34;
-	const double k = 1.38066e-23;
-	const double T = 3000;
-	const double c = 2.998e8;
-	const double kc = c*h / (k* T);
-	const double d = 2.0*h*c*c;
-	float max = -1;
-	const double minS = 200;
-	for(unsigned int x=0; x<width;x++){
-		double wl = (-label_c + x)/label_b*1e-9;
-		double s = double(shrunk[x]) - darkCalibration[x];
-		std::cout << wl << "_" << "_ ";
-		incandescentCalibration[x] = d*pow(wl,-5)/(exp(kc/wl)-1.0);
-		std::cout << incandescentCalibration[x] << "->" << s << "  ";
-		incandescentCalibration[x] /= s;
-		if(s < 3e-7 ){
-			incandescentCalibration[x]=0;
-		}
-		if(s < minS ){
-			incandescentCalibration[x]=0;
+	engine.SaveCal();
+// save references, already normalised
+	for(auto const &reference : references){
+		if(!reference.persist || reference.data.empty())
+			continue;
+		calfile.open(referenceFileName(reference.name));
+		calfile << reference.data.size() << "\n";
+		for(float v : reference.data){
+			calfile << v << "\n";
 		}
-		if(incandescentCalibration[x] > x){
-			max=incandescentCalibration[x];
-		}
-		std::cout << incandescentCalibration[x] << "\n";
-	}
-	for(unsigned int x=0; x<width;x++){
-		std::cout << "IncCal x="<< x << " -> " << incandescentCalibration[x] << "   ";
-		incandescentCalibration[x] *= 500.0/max;
-		std::cout << " -> " << incandescentCalibration[x] << "\n";
-	}
-
-}
-
-void EglPreview::darkCal(uint32_t *shrunk, uint16_t width){
-	for(unsigned int x=0; x<width;x++){
-		darkCalibration[x] = shrunk[x];
+		calfile.close();
 	}
 }
-
 static GLint compile_shader(GLenum target, const char *source)
 {
 	GLuint s = glCreateShader(target);
@@ -404,11 +261,14 @@ static GLint compile_shader(GLenum target, const char *source)
 	return s;
 }
 
-static GLint link_program(GLint vs, GLint fs)
+static GLint link_program(GLint vs, GLint fs,
+						  std::initializer_list<std::pair<GLuint, char const *>> attribs = {})
 {
 	GLint prog = glCreateProgram();
 	glAttachShader(prog, vs);
 	glAttachShader(prog, fs);
+	for (auto const &attrib : attribs)
+		glBindAttribLocation(prog, attrib.first, attrib.second);
 	glLinkProgram(prog);
 
 	GLint ok;
@@ -429,100 +289,67 @@ static GLint link_program(GLint vs, GLint fs)
 
 		throw std::runtime_error("failed to link: " + std::string(info ? info : "<empty log>"));
 	}
+	// They go when the program does.
+	glDeleteShader(vs);
+	glDeleteShader(fs);
 
 	return prog;
 }
-static GLint gl_setupGraph(int width, int height, int window_width, int window_height)
+// Vertex attribute slots for the graph. Slot 0 is left to the client-side quad
+// that the video and text programs draw from.
+#define GRAPH_X_ATTRIB 1
+#define GRAPH_VALUE_ATTRIB 2
+
+static GLint gl_setupGraph()
 {
-	float w_factor = width / (float)window_width;
-	float h_factor = height / (float)window_height;
-	float max_dimension = std::max(w_factor, h_factor);
-	w_factor /= max_dimension;
-	h_factor /= max_dimension;
-	char vs[256];
-	std::cout << "GL setup \n";
-	snprintf(vs, sizeof(vs),
-			 "attribute vec4 pos;\n"
-			 "varying vec2 texcoord;\n"
-			 "\n"
-			 "void main() {\n"
-			 "  gl_Position = pos;\n"
-			 "  texcoord.x = pos.x;\n"
-			 "  texcoord.y = pos.y;\n"
-			 "}\n"
-			 );
-	vs[sizeof(vs) - 1] = 0;
-       	//+ 0.00390625*p.y;\n"
-	//"float x=float(texcoord.x)*0.5*0.25 + 0.5*0.25;\n"
-	GLint vs_s = compile_shader(GL_VERTEX_SHADER, vs);
-	char fs[1024];
-
-	/*
-	 * x and y varying from 0 to 1 
-	 */
-	snprintf(fs, sizeof(fs),
-			 		 "precision mediump float;\n"
-					 "uniform sampler2D s;\n"
-					 "uniform sampler2D shadow;\n"
+	LOG(2, "GL setup");
+	// Each spectrum bin is one vertex of a line strip. The x positions live in a static
+	// buffer and only the values are streamed each frame; "scale" normalises them to the
+	// window so that no CPU pass is needed.
+	const char *vs = "attribute float x;\n"
+					 "attribute float value;\n"
 					 "uniform float scale;\n"
-					 "uniform float shadowOpacity;\n"
-					 "varying vec2 texcoord;\n"
+					 "\n"
 					 "void main() {\n"
-					 "	float x = float(texcoord.x)*0.5 + 0.5;\n"
-					 "	vec4 p = texture2D(s, vec2(x,0));\n"
-					 "	float v = p.x;\n"
-					 "//	vec4 pl = texture2D(s, vec2(x-%f,0));\n"
-					 "//	float vl = pl.x;\n"
-					 "//	vec4 pr = texture2D(s, vec2(x+%f,0));\n"
-					 "//	float vr = pr.x;\n"
-					 "	float y = texcoord.y * 0.5 + 0.5;\n"
-					 "	if(y<p.x){\n"
- 					 "//	if( y < v && y<vl && y<vr){\n"
-					 "	  	gl_FragColor = vec4(y/v,0,0.0,1);\n"
-					 "	}else{gl_FragColor = vec4(0.0,0.0,0.0,1.0);}\n"
-					 "//	else{\n"
-					 "//	 	if(y>v && y>vl && y>vr){\n"
-					 "//			gl_FragColor = vec4(0,0,0.0,1);\n"
-					 "//		}else if(y>vl && y>vr){\n"
-					 "//			gl_FragColor = vec4(0.5,0.0,0.0,1);\n"
-					 "//		}else {\n"
-					 "//			gl_FragColor = vec4(0.25,0.0,0.0,1);\n"
-					 "//		}\n"
-					 "//	}\n"
-					 "	if(texture2D(shadow,vec2(x,0)).x>y){\n"
-					 "		gl_FragColor += vec4(shadowOpacity,shadowOpacity,shadowOpacity,0);\n"
-					 "	}\n"
-					 "}\n",
-					 1.0/width,
-					 1.0/width
-		);
-	fs[sizeof(fs) - 1] = 0;
-	std::cout << "compile graph shader\n"; 
+					 "  gl_Position = vec4(x, value * scale * 2.0 - 1.0, 0.0, 1.0);\n"
+					 "}\n";
+	GLint vs_s = compile_shader(GL_VERTEX_SHADER, vs);
+	const char *fs = "precision mediump float;\n"
+					 "uniform vec4 colour;\n"
+					 "void main() {\n"
+					 "  gl_FragColor = colour;\n"
+					 "}\n";
+	LOG(2, "compile graph shader");
 	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs);
-	std::cout << "link graph shader\n"; 
-	GLint prog = link_program(vs_s, fs_s);
+	LOG(2, "link graph shader");
+	GLint prog = link_program(vs_s, fs_s, { { GRAPH_X_ATTRIB, "x" }, { GRAPH_VALUE_ATTRIB, "value" } });
 
 	glUseProgram(prog);
-
-	//static const float verts[] = { -w_factor, -h_factor, w_factor, -h_factor, w_factor, h_factor, -w_factor, h_factor };
 	return prog;
 }
 
-static void setupRenderFrameBuffer(GLint prog, int width, GLuint *renderFramebufferName, GLuint *renderedTexture){
-
-	glUseProgram(prog);
+// buffers[0] holds the x position of every bin and never changes, the rest are
+// streamed with the live spectrum of each track, then the baseline of each and then
+// each spectrum less its baseline.
+static void setupGraphBuffers(unsigned int width, unsigned int tracks, std::vector<GLuint> &buffers)
+{
+	std::vector<float> data(width);
+	buffers.resize(3 * tracks + 1);
+	glGenBuffers(buffers.size(), buffers.data());
 
-	// "Bind" the newly created texture : all future texture functions will modify this texture
-	glActiveTexture(GL_TEXTURE1);
-	// Give an empty image to OpenGL ( the last "0" )
-	glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB, width, 2, 1,GL_RGB, GL_UNSIGNED_BYTE, 0);
+	for (unsigned int i = 0; i < width; i++)
+		data[i] = -1.0 + (2.0 * i + 1.0) / width;
+	glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, width * sizeof(float), data.data(), GL_STATIC_DRAW);
 
-	// Poor filtering. Needed !
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	std::fill(data.begin(), data.end(), 0.0f);
+	for (unsigned int t = 1; t < buffers.size(); t++)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, buffers[t]);
+		glBufferData(GL_ARRAY_BUFFER, width * sizeof(float), data.data(), GL_STREAM_DRAW);
+	}
 
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 
@@ -534,7 +361,7 @@ static GLint gl_setup(int width, int height, int window_width, int window_height
 	w_factor /= max_dimension;
 	h_factor /= max_dimension;
 	char vs[256];
-	std::cout << "GL setup \n";
+	LOG(2, "GL setup");
 	snprintf(vs, sizeof(vs),
 			 "attribute vec4 pos;\n"
 			 "varying vec2 texcoord;\n"
@@ -568,88 +395,251 @@ static GLint gl_setup(int width, int height, int window_width, int window_height
 	return prog;
 }
 
-static GLint gl_text_setup(GLuint *texture){
-//      char vs[256];
-
-        const char *vs = "attribute vec4 pos;\n"
-                         "uniform float imageNo;\n"
-                         "uniform float scale;\n"
-                         "varying vec2 texcoord;\n"
-                         "\n"
-                         "void main() {\n"
-                         "  gl_Position = pos;\n"
-                         "  texcoord.x =pos.x*0.5;\n"
-                         "  texcoord.y =-(pos.y-0.75-imageNo)*0.0625;\n"
-                         "}\n";
-
-        GLint vs_s = compile_shader(GL_VERTEX_SHADER, vs);
-        const char *fs =                 "precision mediump float;\n"
-                                         "uniform sampler2D s;\n"
-                                         "varying vec2 texcoord;\n"
-                                         "void main() {\n"
-                                         "  vec2 tc = vec2(texcoord.x+0.5,texcoord.y);\n"
-                                         "  vec4 t = texture2D(s, tc);\n"
-                                         //"  gl_FragColor = vec4(t.x, t.y*t.w, t.z*t.w,1.0);\n"
-                                         "  gl_FragColor = vec4(t.x, t.y, t.z,1.0);\n"
-                                        // "  gl_FragColor = vec4(1.0,1.0,1.0,1.0);\n"
-                                         "}\n";
-        GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs);
-        GLint prog = link_program(vs_s, fs_s);
-        glUseProgram(prog);
-        glActiveTexture(GL_TEXTURE3);
-//        unsigned int texture;
-        glGenTextures(1, texture);
-        glBindTexture(GL_TEXTURE_2D, *texture); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);       // set texture wrapping to GL_REPEAT (default wrapping method)
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        static const float verts[] = { 
-                -1.0, -1.0,  1.0, -1.0,  1.0, 1.0,  -1, 1.0 };
-        int width,height,nrChannels;
-        unsigned char *data = stbi_load("wavelengths.png", &width, &height, &nrChannels, 0);
-        if (data){
-                if(nrChannels==4){
-                        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-                }else{
-                        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-                }
-                glGenerateMipmap(GL_TEXTURE_2D);
-        }
-        else
-        {
-                std::cout << "Failed to load texture" << std::endl;
-        }
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
-        stbi_image_free(data);
-        return prog;
+#define TEXT_POS_ATTRIB 3
+#define TEXT_COLOUR_ATTRIB 4
+
+// Bakes the font into an alpha-only glyph atlas in GL_TEXTURE3. Returns 0, leaving the
+// preview without text, if the font can't be used.
+static GLint gl_text_setup(std::string const &font_file, float font_size, GLuint *texture, stbtt_bakedchar *chars)
+{
+	std::ifstream file(font_file, std::ios::binary);
+	if (!file)
+	{
+		LOG_ERROR("EglPreview: failed to open font " << font_file << ", no text will be drawn");
+		return 0;
+	}
+	std::vector<unsigned char> ttf((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::vector<unsigned char> atlas(FONT_ATLAS_SIZE * FONT_ATLAS_SIZE);
+	if (stbtt_BakeFontBitmap(ttf.data(), 0, font_size, atlas.data(), FONT_ATLAS_SIZE, FONT_ATLAS_SIZE,
+							 FONT_FIRST_CHAR, FONT_NUM_CHARS, chars) <= 0)
+	{
+		LOG_ERROR("EglPreview: couldn't bake font " << font_file << ", no text will be drawn");
+		return 0;
+	}
+
+	// Positions arrive in window pixels and "screen" is 2 / window size.
+	const char *vs = "attribute vec4 pos;\n"
+					 "attribute vec4 colour;\n"
+					 "uniform vec2 screen;\n"
+					 "varying vec2 texcoord;\n"
+					 "varying vec4 tint;\n"
+					 "\n"
+					 "void main() {\n"
+					 "  gl_Position = vec4(pos.x * screen.x - 1.0, 1.0 - pos.y * screen.y, 0.0, 1.0);\n"
+					 "  texcoord = pos.zw;\n"
+					 "  tint = colour;\n"
+					 "}\n";
+	GLint vs_s = compile_shader(GL_VERTEX_SHADER, vs);
+	const char *fs = "precision mediump float;\n"
+					 "uniform sampler2D atlas;\n"
+					 "varying vec2 texcoord;\n"
+					 "varying vec4 tint;\n"
+					 "void main() {\n"
+					 "  gl_FragColor = vec4(tint.rgb, tint.a * texture2D(atlas, texcoord).a);\n"
+					 "}\n";
+	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs);
+	GLint prog = link_program(vs_s, fs_s, { { TEXT_POS_ATTRIB, "pos" }, { TEXT_COLOUR_ATTRIB, "colour" } });
+	glUseProgram(prog);
+	glUniform1i(glGetUniformLocation(prog, "atlas"), 3);
+
+	glActiveTexture(GL_TEXTURE3);
+	glGenTextures(1, texture);
+	glBindTexture(GL_TEXTURE_2D, *texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, FONT_ATLAS_SIZE, FONT_ATLAS_SIZE, 0, GL_ALPHA, GL_UNSIGNED_BYTE,
+				 atlas.data());
+	glActiveTexture(GL_TEXTURE0);
+	return prog;
 }
 
-static GLint draw_text(int imageNo,int x, int y, int width, int height, float scale, GLint prog, GLuint *texture){
-      glUseProgram(prog);
-//      static const float vertsText[] = { 0.0, 0,0{ x, y, x+width*scale, y, x+width*scale, y+height*scale, x, y+height*scale};
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D,*texture);
-        glUniform1f(glGetUniformLocation(prog,"imageNo"), (float)imageNo*2);
-        glUniform1f(glGetUniformLocation(prog,"scale"), scale);
-	// we have put this texture into GL_TEXTURE3
-        glUniform1i(glGetUniformLocation(prog,"s"), 3);
-        // Give an empty image to OpenGL ( the last "0" )
-        //glUniform1f( glGetUniformLocation(progGraph, "scale"), 1.0);
-        glViewport( x,y,width,height);
-        //glClear(GL_COLOR_BUFFER_BIT);
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-
-        return prog;
+float EglPreview::textWidth(std::string const &text) const
+{
+	float w = 0;
+	for (unsigned char c : text)
+	{
+		if (c >= FONT_FIRST_CHAR && c < FONT_FIRST_CHAR + FONT_NUM_CHARS)
+			w += fontChars[c - FONT_FIRST_CHAR].xadvance;
+	}
+	return w;
+}
+
+// Queue a string with its baseline starting at (x, y) in window pixels. Nothing is
+// drawn until drawText().
+void EglPreview::addText(std::string const &text, float x, float y, GLubyte r, GLubyte g, GLubyte b)
+{
+	if (!progText)
+		return;
+	for (unsigned char c : text)
+	{
+		if (c < FONT_FIRST_CHAR || c >= FONT_FIRST_CHAR + FONT_NUM_CHARS)
+			continue;
+		stbtt_aligned_quad q;
+		stbtt_GetBakedQuad(fontChars, FONT_ATLAS_SIZE, FONT_ATLAS_SIZE, c - FONT_FIRST_CHAR, &x, &y, &q, 1);
+		TextVertex corners[4] = { { q.x0, q.y0, q.s0, q.t0, { r, g, b, 255 } },
+								  { q.x1, q.y0, q.s1, q.t0, { r, g, b, 255 } },
+								  { q.x1, q.y1, q.s1, q.t1, { r, g, b, 255 } },
+								  { q.x0, q.y1, q.s0, q.t1, { r, g, b, 255 } } };
+		for (int i : { 0, 1, 2, 0, 2, 3 })
+			textVertices.push_back(corners[i]);
+	}
+}
+
+// Everything queued by addText() goes up in one buffer and is drawn with one call.
+void EglPreview::drawText()
+{
+	if (!progText || textVertices.empty())
+		return;
+	glUseProgram(progText);
+	glUniform2f(textScreenLoc, 2.0 / width_, 2.0 / height_);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, textTexture);
+	glBindBuffer(GL_ARRAY_BUFFER, textBuffer);
+	glBufferData(GL_ARRAY_BUFFER, textVertices.size() * sizeof(TextVertex), textVertices.data(), GL_STREAM_DRAW);
+	glVertexAttribPointer(TEXT_POS_ATTRIB, 4, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void *)offsetof(TextVertex, x));
+	glVertexAttribPointer(TEXT_COLOUR_ATTRIB, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(TextVertex),
+						  (void *)offsetof(TextVertex, colour));
+	glEnableVertexAttribArray(TEXT_POS_ATTRIB);
+	glEnableVertexAttribArray(TEXT_COLOUR_ATTRIB);
+	glViewport(0, 0, width_, height_);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDrawArrays(GL_TRIANGLES, 0, textVertices.size());
+	glDisable(GL_BLEND);
+	glDisableVertexAttribArray(TEXT_POS_ATTRIB);
+	glDisableVertexAttribArray(TEXT_COLOUR_ATTRIB);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glActiveTexture(GL_TEXTURE0);
+	textVertices.clear();
 }
 
 
-EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+// 256 entry RGB lookup from intensity to colour for the waterfall.
+static void make_colour_map(std::string const &name, GLubyte *lut)
+{
+	for (int i = 0; i < 256; i++)
+	{
+		float v = i / 255.0;
+		float r, g, b;
+		if (name == "heat")
+		{
+			// black, red, yellow, white
+			r = std::clamp(3.0f * v, 0.0f, 1.0f);
+			g = std::clamp(3.0f * v - 1.0f, 0.0f, 1.0f);
+			b = std::clamp(3.0f * v - 2.0f, 0.0f, 1.0f);
+		}
+		else if (name == "jet")
+		{
+			// blue, cyan, green, yellow, red
+			r = std::clamp(1.5f - fabsf(4.0f * v - 3.0f), 0.0f, 1.0f);
+			g = std::clamp(1.5f - fabsf(4.0f * v - 2.0f), 0.0f, 1.0f);
+			b = std::clamp(1.5f - fabsf(4.0f * v - 1.0f), 0.0f, 1.0f);
+		}
+		else
+			r = g = b = v;
+		lut[3 * i] = r * 255;
+		lut[3 * i + 1] = g * 255;
+		lut[3 * i + 2] = b * 255;
+	}
+}
+
+// The waterfall history is a ring of "depth" rows in textures[0] (GL_TEXTURE4) with the
+// colour map in textures[1] (GL_TEXTURE5). Each frame overwrites the oldest row and
+// moves "head" on, so the shader has to turn a screen row into a ring row; the newest
+// spectrum is drawn at the top.
+static GLint gl_waterfall_setup(unsigned int width, unsigned int depth, std::string const &colours, GLuint *textures)
+{
+	const char *vs = "attribute vec4 pos;\n"
+					 "varying vec2 texcoord;\n"
+					 "\n"
+					 "void main() {\n"
+					 "  gl_Position = pos;\n"
+					 "  texcoord = vec2(pos.x * 0.5 + 0.5, 0.5 - pos.y * 0.5);\n"
+					 "}\n";
+	GLint vs_s = compile_shader(GL_VERTEX_SHADER, vs);
+	// Non power of two textures can't use GL_REPEAT, so wrap the ring by hand.
+	const char *fs = "precision mediump float;\n"
+					 "uniform sampler2D rows;\n"
+					 "uniform sampler2D colours;\n"
+					 "uniform float head;\n"
+					 "varying vec2 texcoord;\n"
+					 "void main() {\n"
+					 "  float i = texture2D(rows, vec2(texcoord.x, fract(head - texcoord.y))).r;\n"
+					 "  gl_FragColor = texture2D(colours, vec2(i, 0.5));\n"
+					 "}\n";
+	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs);
+	GLint prog = link_program(vs_s, fs_s, { { 0, "pos" } });
+	glUseProgram(prog);
+	glUniform1i(glGetUniformLocation(prog, "rows"), 4);
+	glUniform1i(glGetUniformLocation(prog, "colours"), 5);
+
+	std::vector<GLubyte> data(width * depth, 0);
+	glGenTextures(2, textures);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, textures[0]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, depth, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, data.data());
+
+	GLubyte lut[256 * 3];
+	make_colour_map(colours, lut);
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_2D, textures[1]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 256, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, lut);
+	glActiveTexture(GL_TEXTURE0);
+	return prog;
+}
+
+void EglPreview::smoothSpectra(unsigned int width)
+{
+	if (!smoothing)
+		return;
+	smoothed.resize(engine.Tracks() * width);
+	for (unsigned int t = 0; t < engine.Tracks(); t++)
+		displayFilter.Apply(engine.Spectrum(t), &smoothed[t * width], width);
+}
+
+// Add the latest spectrum to the waterfall and draw it into the current viewport. Only
+// the one new row is uploaded, however deep the history. Rows are normalised by the
+// same scale as the live trace.
+void EglPreview::drawWaterfall(float scale, unsigned int width)
+{
+	for (unsigned int i = 0; i < width; i++)
+		waterfallRow[i] = std::clamp(displayed(0)[i] * scale * 255.0f, 0.0f, 255.0f);
+	waterfallHead = (waterfallHead + 1) % waterfallDepth;
+
+	glUseProgram(progWaterfall);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, waterfallTextures[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, waterfallHead, width, 1, GL_LUMINANCE, GL_UNSIGNED_BYTE,
+					waterfallRow.data());
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_2D, waterfallTextures[1]);
+	glUniform1f(waterfallHeadLoc, (waterfallHead + 0.5) / waterfallDepth);
+	// The second quad of the video program's vertices covers the whole viewport.
+	glDrawArrays(GL_TRIANGLE_FAN, 4, 4);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+
+EglPreview::EglPreview(Options const *options)
+	: Preview(options), last_fd_(-1), first_time_(true), glReady(false), videoWidth(0), videoHeight(0),
+	  references{ { "capture", 1.0, 1.0, 1.0, 0.5, 10, false },
+				  { "lamp", 1.0, 0.6, 0.0, 0.6, 0, true },
+				  { "library", 0.0, 1.0, 1.0, 0.6, 0, true } },
+	  waterfallDepth(0), waterfallHead(0)
 {
-	slope= 0;
 	display_ = XOpenDisplay(NULL);
 	if (!display_)
 		throw std::runtime_error("Couldn't open X display");
@@ -668,6 +658,56 @@ EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1),
 	width_ = options_->preview_width;
 	height_ = options_->preview_height;
 	theOptions = options;
+	if (options->spectrum_orientation == "vertical")
+		engine.SetOrientation(SpectrumEngine::Orientation::Vertical);
+	engine.SetChannelWeights(options->channel_weight_r, options->channel_weight_g, options->channel_weight_b);
+	if (options->extraction == "optimal")
+		engine.SetExtraction(SpectrumEngine::Extraction::Optimal);
+	std::vector<SpectrumEngine::Band> bands;
+	for (auto const &track : options->track_bands)
+		bands.push_back({ track.first, track.second });
+	engine.SetTracks(bands);
+	engine.SetSpikeRejection(options->reject_window, options->reject_sigma);
+	BaselineEstimator::Config baseline;
+	if (options->baseline == "rolling-ball")
+		baseline.method = BaselineEstimator::Method::RollingBall;
+	else if (options->baseline == "als")
+		baseline.method = BaselineEstimator::Method::Als;
+	else if (options->baseline == "polynomial")
+		baseline.method = BaselineEstimator::Method::Polynomial;
+	baseline.window = options->baseline_window;
+	baseline.lambda = options->baseline_lambda;
+	baseline.order = options->baseline_order;
+	engine.SetBaseline(baseline);
+	smoothing = options->smooth > 1;
+	lampPending = false;
+	if (options->measurement == "transmittance")
+		engine.SetMeasurement(SpectrumEngine::Measurement::Transmittance);
+	else if (options->measurement == "absorbance")
+		engine.SetMeasurement(SpectrumEngine::Measurement::Absorbance);
+	engine.SetColorimetry(options->colorimetry);
+	if (!options->cie_observer.empty())
+		engine.LoadObserver(options->cie_observer);
+	if (!options->cri_samples.empty())
+		engine.LoadColourSamples(options->cri_samples);
+	if (!options->cie_daylight.empty())
+		engine.LoadDaylight(options->cie_daylight);
+	if (!options->line_database.empty())
+		engine.LoadLines(options->line_database);
+	engine.SetCalibrationSpecies(options->calibration_species);
+	engine.SetLineIdentification(options->identify_lines, options->line_tolerance);
+	if (options->identify_lines)
+		Metrics::Get().SetLineDatabase(engine.Lines());
+	if (!options->lamp_spectrum.empty())
+		engine.LoadLampSpectrum(options->lamp_spectrum);
+	else
+		engine.SetLampTemperature(options->lamp_temperature);
+	if (options->smooth_filter == "boxcar")
+		displayFilter = SpectrumFilter::Boxcar(options->smooth);
+	else if (options->smooth_filter == "gaussian")
+		displayFilter = SpectrumFilter::Gaussian(options->smooth);
+	else
+		displayFilter = SpectrumFilter::SavitzkyGolay(options->smooth, 2);
 	makeWindow("libcamera-app");
 
 	// gl_setup() has to happen later, once we're sure we're in the display thread.
@@ -740,7 +780,7 @@ void EglPreview::makeWindow(char const *name)
 		width_ = DisplayWidth(display_, screen_num);
 		height_ = DisplayHeight(display_, screen_num);
 	}
-	std::cout <<"makeWindow width="<< width_ << " height=" << height_<<"\n";
+	LOG(2, "makeWindow width=" << width_ << " height=" << height_);
 
 	static const EGLint attribs[] =
 		{
@@ -860,23 +900,10 @@ void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 		if (!eglMakeCurrent(egl_display_, egl_surface_, egl_surface_, egl_context_))
 			throw std::runtime_error("eglMakeCurrent failed");
 //		progShrink=gl_setupShrinkData(info.width, info.height, width_, height_);
-		std::cout <<"makeBuffer\n";
-		progText = gl_text_setup(&textTexture);
-		progGraph=gl_setupGraph(info.width, info.height, width_, height_);
-		prog=gl_setup(info.width, info.height, width_, height_);
-		shrunk = new uint32_t[info.width+2];
-		incandescentCalibration = new double[info.width+2];
-		darkCalibration = new uint32_t[info.width+2];
-		for(unsigned int i=0; i<info.width;i++){
-			incandescentCalibration[i]=1.0;
-			darkCalibration[i]=0;
-		}
-		shadowData = new GLubyte[info.width*4*8+1];
-       		pixels = new GLubyte[info.width * info.height * 4+20];
-//	first_time_ = false;
+		LOG(2, "makeBuffer");
+		configure(info);
+		first_time_ = false;
 	}
-	label_b = 1;
-	label_c = 0;
 	buffer.fd = fd;
 	buffer.size = size;
 	buffer.info = info;
@@ -916,118 +943,104 @@ void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 	eglDestroyImageKHR(egl_display_, image);
 }
 
-void EglPreview::SetInfoText(const std::string &text)
+// Everything that depends on the size of the stream. A Reset keeps all of it, along with
+// the calibrations, and it's only rebuilt if the camera comes back with a different size,
+// so restarting the camera doesn't cost any memory.
+void EglPreview::configure(StreamInfo const &info)
 {
-	if (!text.empty())
-		XStoreName(display_, window_, text.c_str());
-}
+	if (!glReady)
+	{
+		// None of these depend on the stream.
+		progText = gl_text_setup(theOptions->font, theOptions->font_size, &textTexture, fontChars);
+		if (progText)
+		{
+			textScreenLoc = glGetUniformLocation(progText, "screen");
+			glGenBuffers(1, &textBuffer);
+		}
+		progGraph=gl_setupGraph();
+		graphScaleLoc = glGetUniformLocation(progGraph, "scale");
+		graphColourLoc = glGetUniformLocation(progGraph, "colour");
+		for (auto &reference : references)
+			glGenBuffers(1, &reference.buffer);
+	}
+	else if (info.width == videoWidth && info.height == videoHeight)
+		return;
+	else
+		glDeleteProgram(prog);
+	glReady = true;
 
-#define IMAGE_WIDTH 1920
+	prog=gl_setup(info.width, info.height, width_, height_);
+	videoWidth = info.width;
+	videoHeight = info.height;
+}
 
-		uint32_t differentiate(uint32_t* shrunk,int width){
-			uint32_t d = 0;
-			for(int x=0; x<width-1; x++){
-				if(shrunk[x]>shrunk[x+1]){
-					d+= shrunk[x]-shrunk[x+1];
-				}else{
-					d+= shrunk[x+1]-shrunk[x];
-				}
-			}
-			return d;
+// The same for the spectrum, which may come from a different stream. It's checked on
+// every frame, but only does anything when the spectrum changes size or format.
+void EglPreview::configureSpectrum(StreamInfo const &info)
+{
+	const bool existed = engine.Width() > 0;
+	if (!engine.Configure(info))
+		return;
+	const unsigned int bins = engine.Width();
+	if (existed)
+	{
+		glDeleteBuffers(graphBuffers.size(), graphBuffers.data());
+		if (waterfallDepth)
+		{
+			glDeleteProgram(progWaterfall);
+			glDeleteTextures(2, waterfallTextures);
 		}
+	}
 
-void Shrink(GLubyte * data, uint16_t x0, uint16_t x1, uint16_t width, uint16_t y0, uint16_t y1, uint16_t height, uint16_t stride, uint32_t * output, uint32_t * maxVal, float slope){
-	*maxVal = 0;
-	for(uint16_t x=x0; x<x1; x++){
-		for(uint16_t y=y0; y<y1; y+=4){
-			float x2f = slope * y + x;
-			int x2 = (int)x2f;
-			float rem = x2f-x2;
-			if (x2<0) x2=0;
-		/*	GLubyte vy = data[(y*stride+x2)];
-		        GLubyte vu = data[(int)((y/2+height)*stride+(x2)/2)]-128;
-			GLubyte vv = data[(int)((0.5+y/2+height)*stride+(x2)/2)]-128;
-
-			float r = RY*vy + RU * vu + RV * vv;
-			float g = GY*vy + GU * vu + GV * vv;
-			float b = BY*vy + BU * vu + BV * vv;
-			float val = std::max(std::max(r,g),b);*/
-			float val= (data[(y*stride+x2)])*Y_FAC//3.0
-				+ (data[(int)((y/2+height)*stride+(x2)/2)]-128)*U_FAC//0.781
-			       	+ (data[(int)((0.5+y/2+height)*stride+(x2)/2)]-128)*V_FAC;//1.63 ;
-			output[x] += (1.0-rem) * val;
-			if(x<width-2){
-				output[x+1] += rem*val;
-			}
-		}
+	waterfallDepth = std::min(theOptions->waterfall, max_image_height_);
+	if (waterfallDepth)
+	{
+		progWaterfall = gl_waterfall_setup(bins, waterfallDepth, theOptions->waterfall_colours, waterfallTextures);
+		waterfallHeadLoc = glGetUniformLocation(progWaterfall, "head");
+		waterfallRow.resize(bins);
+		waterfallHead = 0;
 	}
-	
+	setupGraphBuffers(bins, engine.Tracks(), graphBuffers);
+	for (auto &reference : references)
+		reference.data.clear();
+	readCal(bins);
 }
-/*
 
-// for SRGGB10
-void Shrink(GLubyte * data, uint16_t x0, uint16_t x1, uint16_t width, uint16_t y0, uint16_t y1, uint16_t height, uint16_t stride, uint32_t * output, uint32_t * maxVal, float slope){
-	*maxVal = 0;
-	int16_t  stride2 = stride;
-	uint16_t *iData = (uint16_t*) data;
-	for(uint16_t x=x0; x<x1; x++){
-		for(uint16_t y=y0; y<y1; y+=8){
-        		//std::cout << "x=" <<x << " y=" << y <<" height="<< height<<"\n";
-			float x2f = slope * y + x;
-			int x2 = (int)x2f;
-			float rem = x2f-x2;
-			if (x2<0) x2=0;
-			float val = 
-				// green
-			       	iData[ (y+x%2)*stride2 + x ] * G_PROP +// green
-			      	iData[ (y+x+1)*stride2 + x + !(x%2) ] * R_PROP + // red
-				iData[ (y+x) *stride2 + x - x%2 ] * B_PROP; // blue
-			output[x] += (1.0-rem) * val;
-			if(x<width-2){
-				output[x+1] += rem*val;
-			}
-		}
-	}
-	
+void EglPreview::SetAnalysisFrame(libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	analysisSpan = span;
+	analysisInfo = info;
 }
-*/
-uint32_t EglPreview::ShrinkData(GLubyte *pixels, StreamInfo const *info, uint32_t *shrunk, float *slope2       ){
-        uint32_t max1=0, max2=0, max3=0, max4=0;
-        //libcamera::Span<uint8_t> buffer = app.Mmap(buffers_[fd])[0];
-//      Reduce the data using 4threads to speed it up
-	//int16_t r_x = theOptions->roi_x*info->width;      
-	//int16_t r_y = theOptions->roi_y*info->height;
-	//int16_t r_width = theOptions->roi_width * info->width;
-	//int16_t r_height = theOptions->roi_height * info->height;
-	int16_t r_x = 0;//theOptions->roi_x*info->width;      
-	int16_t r_y = 0;//theOptions->roi_y*info->height;
-	int16_t r_width = info->width;//theOptions->roi_width * info->width;
-	int16_t r_height = info->height;//theOptions->roi_height * info->height;
-	if(r_width ==0 or r_height==0){
-		r_x=r_y=0;
-		r_width=info->width;
-		r_height=info->height;
-	}
-	for(uint16_t x=0; x<info->width;x++){
-		shrunk[x]=0;
-	}
-	//std::cout << "r_x=" << r_x << " r_y=" << r_y << " r_width=" << r_width << " r_height=" << r_height << "\n";
-        //std::thread t1(&Shrink, pixels, 20, 		   400,     r_width, 0, info->height, info->height, info->stride, shrunk, &max1, *slope2 );
-        std::thread t1(&Shrink, pixels, r_x, 		   r_x + r_width/4,     r_width, r_y, r_y+r_height, info->height, info->stride, shrunk, &max1, *slope2 );
-        std::thread t2(&Shrink, pixels, r_x + r_width/4,   r_x + r_width/2,     r_width, r_y, r_y+r_height, info->height, info->stride, shrunk, &max2, *slope2 );
-        std::thread t3(&Shrink, pixels, r_x + r_width/2,   r_x + (3*r_width)/4, r_width, r_y, r_y+r_height, info->height, info->stride, shrunk, &max3, *slope2 );
-        std::thread t4(&Shrink, pixels, r_x + (3*r_width)/4, r_x+r_width, 	r_width, r_y, r_y+r_height, info->height, info->stride, shrunk, &max4, *slope2 );
-        t1.join();
-        t2.join();
-        t3.join();
-        t4.join();
-        if(max2>max1) max1=max2;
-        if(max3>max1) max1=max3;
-        if(max4>max1) max1=max4;
-//        std::cout << "info.width=" << info->width << " info.height=" << info->height << " info.stride="<< info->stride << "shurnk[5]="<<shrunk[5]<<"\n";
-        return max1;
+
+void EglPreview::SetInfoText(const std::string &text)
+{
+	if (!text.empty())
+		XStoreName(display_, window_, text.c_str());
+	// Also drawn over the video on the next frame.
+	infoText = text;
+}
+
+// Store a reference normalised to a peak of 1 and give it to the GPU, once.
+void EglPreview::setReference(unsigned int index, float const *data, float scale, unsigned int width)
+{
+	Reference &reference = references[index];
+	reference.data.resize(width);
+	for (unsigned int i = 0; i < width; i++)
+		reference.data[i] = data[i] * scale;
+	reference.time = std::chrono::system_clock::now();
+	glBindBuffer(GL_ARRAY_BUFFER, reference.buffer);
+	glBufferData(GL_ARRAY_BUFFER, width * sizeof(float), reference.data.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
+void EglPreview::drawTrace(GLuint buffer, unsigned int width, float scale, float r, float g, float b, float a)
+{
+	glUniform1f(graphScaleLoc, scale);
+	glUniform4f(graphColourLoc, r, g, b, a);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glVertexAttribPointer(GRAPH_VALUE_ATTRIB, 1, GL_FLOAT, GL_FALSE, 0, 0);
+	glDrawArrays(GL_LINE_STRIP, 0, width);
+}
 
 void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
 {
@@ -1042,15 +1055,8 @@ void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 //	static const float vertsShrink[] = { -1.0, -1.0,  1.0, -1.0,  1.0, 1.0,  -1, 1.0 };
 //	static const float vertsGraph[] = { -1, -1, 1, -1, 1, 1, -1, 1 };
 	Buffer &buffer = buffers_[fd];
-	if (buffer.fd == -1){
+	if (buffer.fd == -1)
 		makeBuffer(fd, span.size(), info, buffer);
-		if(first_time_){
-		setupRenderFrameBuffer(progGraph, info.width, &renderFramebufferName[0], &renderedTexture[0]);
-		graphData = new GLubyte[info.width*4*8+1];
-		first_time_=false;
-		readCal(info.width);
-		}
-	}
 	glClearColor(0, 0, 0, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT);
 	// ***********************
@@ -1061,92 +1067,106 @@ void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	glClear(GL_COLOR_BUFFER_BIT);
-	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
-	glViewport(0,height_/2,width_,height_/2);
-	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-
-	//std::cout << "RenderFrameBufferName = " << renderFramebufferName << "\n";
-	uint32_t max1;//, max2, max3, max4;
-	//libcamera::Span<uint8_t> buffer = app.Mmap(buffers_[fd])[0];
-        pixels = (GLubyte *)span.data();
-
-//	glReadPixels(0, 0, info.width, info.height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-//	Shrink(pixels, 0, info.width/4, info.width, info.height, shrunk, &max1,0 );
+	// In waterfall mode the history takes the camera image's place, drawn below.
+	if (!waterfallDepth)
+	{
+		glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
+		glViewport(0,height_/2,width_,height_/2);
+		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	}
 
-//	Reduce the data using 4threads to speed it up
-	max1=ShrinkData(pixels, &info, shrunk, &slope );
+	// Reduce the band to one value per column, then calibrate it.
+	LatencyTrace &trace = LatencyTrace::Get();
+	Timeline &timeline = Timeline::Get();
+	trace.Mark(TraceStage::ExtractStart);
+	timeline.Begin("extract");
+	uint64_t cpu = Metrics::ThreadCpuTime();
+	// The spectrum comes from the displayed frame unless another has been given.
+	uint8_t const *pixels = analysisSpan.empty() ? span.data() : analysisSpan.data();
+	StreamInfo const &spectrumInfo = analysisSpan.empty() ? info : analysisInfo;
+	configureSpectrum(spectrumInfo);
+	const unsigned int bins = engine.Width();
+	if(doDarkFrames){
+		engine.CaptureDarkFrames(theOptions->master_frames);
+		doDarkFrames=false;
+	}else if(doFlatFrames){
+		engine.CaptureFlatFrames(theOptions->master_frames);
+		doFlatFrames=false;
+	}
+	engine.Extract(pixels, spectrumInfo);
 	// optimise slope by maximising spikyness
 	if(doSlope){
-		float oldslope = slope;
-		uint32_t lastd = differentiate(shrunk, info.width);
-		int direction = 1;
-		float step = 0.01;
-		int count=0;
-		while(count<20){
-			max1=ShrinkData(pixels, &info, shrunk, &slope );
-			uint32_t d = differentiate(shrunk,info.width);
-			if(d-lastd > 0){
-				direction = -direction;
-				step *=0.5;
-			}
-			if(step<0.0001){
-				break;
-			}
-			slope+=step*direction;
-			count++;
-		}
-		if(count>=20){
-			slope=oldslope;
-		}
+		engine.FindSlope(pixels, spectrumInfo);
 		doSlope=false;
-		std::cout << "slope=" << slope << "\n"; 
 	}
-//	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)(0));
 	if(doIncandescent){
-		incandescentCal(shrunk,info.width);
+		engine.IncandescentCal(theOptions->lamp_frames);
+		lampPending=true;
 		doIncandescent=false;
 	}else if(doDark){
-		darkCal(shrunk,info.width);
+		engine.DarkCal();
 		doDark=false;
 
+	}else if(doReference){
+		engine.ReferenceCal(theOptions->reference_frames);
+		doReference=false;
 	}
 	if(doMercury){
-		parsePeaks(shrunk, info.width);
+		engine.ParsePeaks();
 		doMercury=false;
 	}
-	max1 = 0;
-	for(unsigned int i=0; i<info.width;i++){
-		if(shrunk[i]>darkCalibration[i]){
-			shrunk[i] -= darkCalibration[i];
-		}else{
-			shrunk[i]=0;
-		}
-		shrunk[i] = (int32_t)(incandescentCalibration[i] * (float)shrunk[i]); 
-		if(shrunk[i]>max1){
-			max1=shrunk[i];
+	float max1 = engine.Calibrate();
+	// The lamp calibration takes effect once the last of its frames is in.
+	bool captureLamp = lampPending && !engine.LampFramesLeft();
+	if(captureLamp)
+		lampPending=false;
+	smoothSpectra(bins);
+	float const *shrunk = displayed(0);
+	Metrics &metrics = Metrics::Get();
+	metrics.Set(metrics.peak_intensity, max1);
+	metrics.Set<uint64_t>(metrics.saturated_pixels, engine.Saturated());
+	metrics.Set<uint64_t>(metrics.spikes_rejected, engine.Spikes());
+	LightColour const &colour = engine.Colour();
+	if (engine.GetColorimetry())
+	{
+		metrics.Set<float>(metrics.colour_x, colour.valid ? colour.x : NAN);
+		metrics.Set<float>(metrics.colour_y, colour.valid ? colour.y : NAN);
+		metrics.Set<float>(metrics.colour_u, colour.valid ? colour.u : NAN);
+		metrics.Set<float>(metrics.colour_v, colour.valid ? colour.v : NAN);
+		metrics.Set<float>(metrics.colour_cct, colour.valid ? colour.cct : NAN);
+		metrics.Set<float>(metrics.colour_duv, colour.valid ? colour.duv : NAN);
+		metrics.Set<float>(metrics.colour_ra, colour.valid ? colour.ra : NAN);
+	}
+	if (engine.GetLineIdentification())
+	{
+		unsigned int identified = 0;
+		for (SpectrumEngine::Peak const &peak : engine.Peaks())
+		{
+			if (peak.line >= 0 && identified < Metrics::MAX_LINES)
+				metrics.SetLine(identified, peak.line, peak.height);
+			identified += peak.line >= 0;
 		}
+		metrics.Set<uint64_t>(metrics.lines_identified, identified);
 	}
-	float scale=(256.0*256-1)/max1;
-	// map pixel buffer
-	//for(uint16_t i=0; i<info.width*4*4; i+=4){
-	for(uint16_t i=0; i<info.width*4; i+=4){
-		uint16_t value = scale * shrunk[i/4];
-		graphData[i] =   value / 256;
-		graphData[i+1] =  value % 256; 
-		graphData[i+2] =  0;//value/256;//value % 256; 
-		graphData[i+3] =  0;//value/256;//value % 256; 
-	}	
+	trace.Mark(TraceStage::ExtractEnd);
+	timeline.End("extract");
+	const uint64_t extracted = Metrics::ThreadCpuTime();
+	metrics.Add(metrics.extract_cpu, extracted - cpu);
+	cpu = extracted;
+	timeline.Begin("draw");
+	// The normalisation to the window is done on the GPU.
+	float scale = max1 > 0 ? 1.0/max1 : 0.0;
+	// The lamp reference is what the lamp looks like once its own calibration is applied.
+	if(captureLamp)
+		setReference(REFERENCE_LAMP, shrunk, scale, bins);
 	if(doShadow){
-		std::cout << "Do shadow\n"; 
-//std::memcpy(graphData, shadowData, info.width*4*8);
-		for(uint16_t i=0;i<(int)info.width*4;i++){
-			shadowData[i]=graphData[i];
-		}
-		std::cout << "\n";
+		LOG(1, "Do shadow");
+		setReference(REFERENCE_CAPTURE, shrunk, scale, bins);
+		references[REFERENCE_CAPTURE].time = shadowTime;
 		doShadow=false;
 	}
 	if(doSave){
-		saveCal(info.width);
+		saveCal(bins);
 		doSave=false;
 	}
 
@@ -1154,63 +1174,149 @@ void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	// Draw Graph
 	// ************************
 	//
-//	std::cout << "GraphData[5]="
-//		<< ","<< (int)graphData[0] 
-//		<< ","<< (int)graphData[1] 
-//		<< ","<< (int)graphData[2] 
-//		<< ","<< (int)graphData[3] 
-//		<< ","<< (int)graphData[4]; 
-//	std::cout << " Scale="<< scale <<"\n"; 
-	float shadowOpacity = 1.0-((float)(std::chrono::system_clock::now() - shadowTime).count()) / 10000000000;
-	if(shadowOpacity<0) shadowOpacity=0.0;
-	if(shadowOpacity>1.0) shadowOpacity=1.0;
-	shadowOpacity*=0.5;
+	if (waterfallDepth)
+	{
+		glViewport( (1.0-w_factor)/2*width_,height_/2,width_*w_factor,height_/2);
+		drawWaterfall(scale, bins);
+	}
 	glUseProgram(progGraph);
-//	glEnableVertexAttribArray(1);
-//	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, vertsGraph);
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-		std::cout << "FrameBuffer Graph issue\n";
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D,renderedTexture[1]);
-
-	glTexImage2D(GL_TEXTURE_2D, 0,GL_RGBA, info.width, 1, 0,GL_RGBA, GL_UNSIGNED_BYTE, graphData);
-	glUniform1i(glGetUniformLocation(progGraph,"s"), 1);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D,renderedTexture[2]);
-	glTexImage2D(GL_TEXTURE_2D, 0,GL_RGBA, info.width, 1, 0,GL_RGBA, GL_UNSIGNED_BYTE, shadowData);
-	glUniform1i(glGetUniformLocation(progGraph,"shadow"), 2);
-	glUniform1f(glGetUniformLocation(progGraph,"shadowOpacity"), shadowOpacity);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	// Give an empty image to OpenGL ( the last "0" )
-	//glUniform1f( glGetUniformLocation(progGraph, "scale"), 1.0);
-//	std::cout << "x0=" << (1.0-w_factor)/2*width_ << "y0=" << 0 << " width=" << (width_*w_factor) << "height" <<height_/2 << "\n";
+		LOG(1, "WARNING: FrameBuffer Graph issue");
+	// Orphan last frame's storage so that we never wait for the GPU to finish with it.
+	for (unsigned int t = 0; t < engine.Tracks(); t++)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, graphBuffers[t + 1]);
+		glBufferData(GL_ARRAY_BUFFER, bins * sizeof(float), NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, bins * sizeof(float), displayed(t));
+	}
+	const bool baselines = engine.BaselineMethod() != BaselineEstimator::Method::Off;
+	for (unsigned int t = 0; baselines && t < engine.Tracks(); t++)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, graphBuffers[engine.Tracks() + t + 1]);
+		glBufferData(GL_ARRAY_BUFFER, bins * sizeof(float), NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, bins * sizeof(float), engine.Baseline(t));
+		glBindBuffer(GL_ARRAY_BUFFER, graphBuffers[2 * engine.Tracks() + t + 1]);
+		glBufferData(GL_ARRAY_BUFFER, bins * sizeof(float), NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, bins * sizeof(float), engine.Subtracted(t));
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, graphBuffers[0]);
+	glVertexAttribPointer(GRAPH_X_ATTRIB, 1, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(GRAPH_X_ATTRIB);
+	glEnableVertexAttribArray(GRAPH_VALUE_ATTRIB);
 	glViewport( (1.0-w_factor)/2*width_,0,width_*w_factor,height_/2);
-	//glClear(GL_COLOR_BUFFER_BIT);
-	glDrawArrays(GL_TRIANGLE_FAN, 8, 4);
-//	GLuint vbo;
-//	glGenBuffers(1, &vbo);
-//	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-//	glBufferData(GL_ARRAY_BUFFER, sizeof(output[0])*info.width, output, GL_DYNAMIC_DRAW);
-//	glDrawElements(GL_LINE_LOOP, info.width*2+4, GL_UNSIGNED_BYTE, 0);
-//	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);       // Vertex attributes stay the same
-  //  	glEnableVertexAttribArray(0);
-  	for(int i=0; i<numLabels;i++){
-		if(labelPositions[i] >=0 && labelPositions[i]<(int)info.width){
-			//std::cout << "lp" << labelPositions[i];
-			draw_text(i, labelPositions[i], 20, 50, 20,2.0, progText, &textTexture);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	auto now = std::chrono::system_clock::now();
+	for (auto const &reference : references)
+	{
+		if (reference.data.empty())
+			continue;
+		float opacity = reference.opacity;
+		if (reference.fadeSeconds > 0)
+		{
+			std::chrono::duration<float> age = now - reference.time;
+			opacity *= std::clamp(1.0f - age.count() / reference.fadeSeconds, 0.0f, 1.0f);
+		}
+		if (opacity > 0)
+			drawTrace(reference.buffer, bins, 1.0, reference.r, reference.g, reference.b, opacity);
+	}
+	// Track 0 is drawn last, on top, with the baselines fainter underneath and the lines
+	// above them paler alongside.
+	for (unsigned int t = engine.Tracks(); t-- > 0;)
+	{
+		float const *colour = trackColours[t % NUM_TRACK_COLOURS];
+		if (baselines)
+		{
+			drawTrace(graphBuffers[engine.Tracks() + t + 1], bins, scale, colour[0], colour[1], colour[2], 0.5);
+			drawTrace(graphBuffers[2 * engine.Tracks() + t + 1], bins, scale, (colour[0] + 1) / 2,
+					  (colour[1] + 1) / 2, (colour[2] + 1) / 2, 0.8);
+		}
+		drawTrace(graphBuffers[t + 1], bins, scale, colour[0], colour[1], colour[2], 1.0);
+	}
+	glDisable(GL_BLEND);
+	glDisableVertexAttribArray(GRAPH_X_ATTRIB);
+	glDisableVertexAttribArray(GRAPH_VALUE_ATTRIB);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// ************************
+	// Labels and readouts
+	// ************************
+	// Text is positioned in window pixels from the top left. The graph fills the
+	// bottom half of the window, bin i being centred at graphX(i).
+	float graphLeft = (1.0-w_factor)/2*width_;
+	float graphWidth = width_*w_factor;
+	auto graphX = [&](float bin) { return graphLeft + (bin + 0.5) * graphWidth / bins; };
+	float lineHeight = theOptions->font_size + 4;
+	char label[64];
+	for(int i=0; i<numLabels;i++){
+		float position = engine.Column(labelValues[i]);
+		if(position >=0 && position<bins){
+			snprintf(label, sizeof(label), "%.0f", labelValues[i]);
+			addText(label, graphX(position) - textWidth(label)/2, height_ - 4, 255, 255, 255);
+		}
+	}
+	// Wavelengths of the strongest few peaks, written above them, with the species of those
+	// the engine has identified.
+	float peakWavelength = NAN;
+	if(engine.GetLineIdentification()){
+		LineDatabase const &lines = engine.Lines();
+		labelledPeaks = engine.Peaks();
+		std::sort(labelledPeaks.begin(), labelledPeaks.end(),
+				  [](SpectrumEngine::Peak const &a, SpectrumEngine::Peak const &b) { return a.height > b.height; });
+		for(unsigned int i=0; i<labelledPeaks.size() && i<MAX_PEAK_LABELS; i++){
+			SpectrumEngine::Peak const &peak = labelledPeaks[i];
+			if(peak.height < 0.1*max1)
+				break;
+			if(peak.line >= 0)
+				snprintf(label, sizeof(label), "%.1f %s", peak.wavelength, lines.Species(peak.line).c_str());
+			else
+				snprintf(label, sizeof(label), "%.1f", peak.wavelength);
+			float y = height_ - shrunk[(unsigned int)(peak.column + 0.5f)]*scale*height_/2 - 4;
+			addText(label, graphX(peak.column) - textWidth(label)/2, std::max(y, height_/2 + lineHeight), 255, 255, 0);
+		}
+		if(!labelledPeaks.empty())
+			peakWavelength = labelledPeaks[0].wavelength;
+	}
+	else{
+		std::vector<int> peaks;
+		PeakFinder::findPeaks(std::vector<float>(shrunk, shrunk + bins), peaks, false, 1);
+		std::sort(peaks.begin(), peaks.end(), [shrunk](int a, int b) { return shrunk[a] > shrunk[b]; });
+		for(unsigned int i=0; i<peaks.size() && i<MAX_PEAK_LABELS; i++){
+			if(shrunk[peaks[i]] < 0.1*max1)
+				break;
+			snprintf(label, sizeof(label), "%.1f", engine.Wavelength(peaks[i]));
+			float y = height_ - shrunk[peaks[i]]*scale*height_/2 - 4;
+			addText(label, graphX(peaks[i]) - textWidth(label)/2, std::max(y, height_/2 + lineHeight), 255, 255, 0);
+		}
+		if(!peaks.empty())
+			peakWavelength = engine.Wavelength(peaks[0]);
+	}
+	if(!std::isnan(peakWavelength))
+		metrics.Set(metrics.peak_wavelength, peakWavelength);
+	if(!std::isnan(peakWavelength) && max1 > 0){
+		snprintf(label, sizeof(label), "peak %.1f nm  intensity %.0f", peakWavelength, max1);
+		addText(label, graphLeft + 4, height_/2 + lineHeight, 255, 255, 0);
+	}
+	if(colour.valid){
+		snprintf(label, sizeof(label), "x %.4f y %.4f  u' %.4f v' %.4f", colour.x, colour.y, colour.u, colour.v);
+		addText(label, graphLeft + 4, height_/2 + 2*lineHeight, 0, 255, 255);
+		if(!std::isnan(colour.cct)){
+			int n = snprintf(label, sizeof(label), "CCT %.0f K  Duv %.4f", colour.cct, colour.duv);
+			if(!std::isnan(colour.ra))
+				snprintf(label + n, sizeof(label) - n, "  Ra %.1f", colour.ra);
+			addText(label, graphLeft + 4, height_/2 + 3*lineHeight, 0, 255, 255);
 		}
 	}
-	//std::cout << "\n";
+	addText(infoText, 4, lineHeight, 0, 255, 0);
+	drawText();
+	timeline.End("draw");
+	metrics.Add(metrics.draw_cpu, Metrics::ThreadCpuTime() - cpu);
+	trace.Mark(TraceStage::RenderSubmit);
+	timeline.Begin("swap");
 	EGLBoolean success [[maybe_unused]] = eglSwapBuffers(egl_display_, egl_surface_);
+	timeline.End("swap");
+	trace.Mark(TraceStage::Swap);
 	if (last_fd_ >= 0)
 		done_callback_(last_fd_);
 	last_fd_ = fd;
@@ -30,6 +30,12 @@ public:
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) = 0;
+	// Analyse this frame, from another stream of the same request, in place of the one
+	// the next Show displays. It stays valid until the displayed buffer is given back. An
+	// empty span means analysing what's displayed.
+	virtual void SetAnalysisFrame(libcamera::Span<uint8_t> span, StreamInfo const &info) {}
+	// The exposure time (in us) and analogue gain of the frame the next Show analyses.
+	virtual void SetExposure(float exposure, float gain) {}
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() = 0;
@@ -51,6 +57,9 @@ extern bool doDark;
 extern bool doMercury;
 extern bool doIncandescent;
 extern bool doSave;
+extern bool doDarkFrames;
+extern bool doFlatFrames;
+extern bool doReference;
 using namespace std::chrono;
 extern std::chrono::time_point <std::chrono::system_clock>shadowTime;
 
@@ -0,0 +1,294 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * baseline.cpp - estimate the continuum under a spectrum, frame by frame.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "spectrum/baseline.hpp"
+
+// Iterations for the first frame, with nothing to start from.
+#define COLD_ITERATIONS 30
+// A cold polynomial fit stops early once no point moves by more than this much of the
+// largest value.
+#define POLYNOMIAL_TOLERANCE 1e-4f
+// Once warm, the polynomial fit starts with the spectrum clipped this many times the noise
+// above the last baseline, so that the continuum can rise but the lines are already gone.
+#define POLYNOMIAL_HEADROOM 2.0f
+
+BaselineEstimator::BaselineEstimator() : bins_(0), warm_(false), noise_(0)
+{
+}
+
+void BaselineEstimator::Reset(unsigned int bins, Config const &config)
+{
+	config_ = config;
+	bins_ = bins;
+	warm_ = false;
+	noise_ = 0;
+	baseline_.assign(bins_, 0.0f);
+
+	if (config_.method == Method::RollingBall)
+	{
+		const unsigned int half = config_.window / 2, k = 2 * half + 1;
+		const size_t padded = (bins_ + 2 * half + k - 1) / k * k;
+		padded_.resize(padded);
+		forward_.resize(padded);
+		backward_.resize(padded);
+		opened_.resize(bins_);
+	}
+	else if (config_.method == Method::Als)
+	{
+		// Each second difference y[r] - 2 y[r + 1] + y[r + 2] adds its outer product to D'D.
+		static const double d[3] = { 1, -2, 1 };
+		for (auto &band : penalty_)
+			band.assign(bins_, 0.0);
+		for (unsigned int r = 0; r + 2 < bins_; r++)
+		{
+			for (unsigned int a = 0; a < 3; a++)
+			{
+				for (unsigned int b = a; b < 3; b++)
+					penalty_[b - a][r + a] += config_.lambda * d[a] * d[b];
+			}
+		}
+		weights_.resize(bins_);
+		diagonal_.resize(bins_);
+		lower_[0].resize(bins_);
+		lower_[1].resize(bins_);
+		solution_.resize(bins_);
+	}
+	else if (config_.method == Method::Polynomial)
+	{
+		config_.order = std::min(config_.order, bins_ ? bins_ - 1 : 0);
+		const unsigned int m = config_.order + 1;
+		// Legendre polynomials over [-1, 1] keep the Gram matrix well conditioned.
+		basis_.resize((size_t)m * bins_);
+		for (unsigned int i = 0; i < bins_; i++)
+		{
+			const double x = bins_ > 1 ? 2.0 * i / (bins_ - 1) - 1 : 0;
+			basis_[i] = 1;
+			if (m > 1)
+				basis_[bins_ + i] = x;
+			for (unsigned int k = 1; k + 1 < m; k++)
+				basis_[(k + 1) * bins_ + i] =
+					((2 * k + 1) * x * basis_[k * bins_ + i] - k * basis_[(k - 1) * bins_ + i]) / (k + 1);
+		}
+		// Cholesky factor, lower triangle, of the Gram matrix.
+		gram_.assign(m * m, 0.0);
+		for (unsigned int j = 0; j < m; j++)
+		{
+			for (unsigned int k = 0; k <= j; k++)
+			{
+				double sum = 0;
+				for (unsigned int i = 0; i < bins_; i++)
+					sum += basis_[j * bins_ + i] * basis_[k * bins_ + i];
+				for (unsigned int l = 0; l < k; l++)
+					sum -= gram_[j * m + l] * gram_[k * m + l];
+				gram_[j * m + k] = j == k ? sqrt(std::max(sum, 1e-30)) : sum / gram_[k * m + k];
+			}
+		}
+		coefficients_.resize(m);
+		clipped_.resize(bins_);
+	}
+}
+
+void BaselineEstimator::Update(float const *spectrum)
+{
+	if (!bins_)
+		return;
+	switch (config_.method)
+	{
+	case Method::Off:
+		return;
+	case Method::RollingBall:
+		rollingBall(spectrum);
+		break;
+	case Method::Als:
+		als(spectrum);
+		break;
+	case Method::Polynomial:
+		polynomial(spectrum);
+		break;
+	}
+	warm_ = true;
+}
+
+// out[i] is op over in[i - half] to in[i + half], or as much of that as there is, found
+// with the van Herk/Gil-Werman running extremes over blocks of the window's length.
+template <typename Op>
+void BaselineEstimator::sliding(float const *in, float *out, float pad, Op op)
+{
+	const unsigned int half = config_.window / 2, k = 2 * half + 1;
+	const size_t n = padded_.size();
+	std::fill(padded_.begin(), padded_.end(), pad);
+	std::copy(in, in + bins_, padded_.begin() + half);
+	for (size_t block = 0; block < n; block += k)
+	{
+		float const *p = &padded_[block];
+		float *f = &forward_[block], *b = &backward_[block];
+		f[0] = p[0];
+		for (unsigned int j = 1; j < k; j++)
+			f[j] = op(f[j - 1], p[j]);
+		b[k - 1] = p[k - 1];
+		for (unsigned int j = k - 1; j-- > 0;)
+			b[j] = op(b[j + 1], p[j]);
+	}
+	for (unsigned int i = 0; i < bins_; i++)
+		out[i] = op(backward_[i], forward_[i + 2 * half]);
+}
+
+void BaselineEstimator::rollingBall(float const *spectrum)
+{
+	const float inf = std::numeric_limits<float>::infinity();
+	auto min = [](float a, float b) { return std::min(a, b); };
+	auto max = [](float a, float b) { return std::max(a, b); };
+	sliding(spectrum, opened_.data(), inf, min);
+	sliding(opened_.data(), opened_.data(), -inf, max);
+
+	// The opening is all flat tops and steps, so smooth it with a running mean.
+	const int half = config_.window / 2, n = bins_;
+	double sum = 0;
+	for (int i = 0; i < std::min(half, n); i++)
+		sum += opened_[i];
+	for (int i = 0; i < n; i++)
+	{
+		if (i + half < n)
+			sum += opened_[i + half];
+		if (i - half - 1 >= 0)
+			sum -= opened_[i - half - 1];
+		baseline_[i] = sum / (std::min(i + half, n - 1) - std::max(i - half, 0) + 1);
+	}
+}
+
+void BaselineEstimator::als(float const *spectrum)
+{
+	const unsigned int n = bins_;
+	const double p = config_.asymmetry;
+	unsigned int iterations = config_.iterations;
+	if (warm_)
+	{
+		for (unsigned int i = 0; i < n; i++)
+			weights_[i] = spectrum[i] > baseline_[i] ? p : 1 - p;
+	}
+	else
+	{
+		std::fill(weights_.begin(), weights_.end(), 1.0);
+		iterations = COLD_ITERATIONS;
+	}
+
+	std::vector<double> &d = diagonal_, &l1 = lower_[0], &l2 = lower_[1], &x = solution_;
+	for (unsigned int it = 0; it < iterations; it++)
+	{
+		// Factor W + lambda D'D as L D L', with L unit lower triangular with two bands.
+		for (unsigned int i = 0; i < n; i++)
+		{
+			double di = weights_[i] + penalty_[0][i];
+			double e = i + 1 < n ? penalty_[1][i] : 0;
+			if (i >= 1)
+			{
+				di -= l1[i - 1] * l1[i - 1] * d[i - 1];
+				if (i >= 2)
+					di -= l2[i - 2] * l2[i - 2] * d[i - 2];
+				e -= l2[i - 1] * l1[i - 1] * d[i - 1];
+			}
+			d[i] = di;
+			l1[i] = e / di;
+			l2[i] = i + 2 < n ? penalty_[2][i] / di : 0;
+		}
+		// Solve L D L' z = W y.
+		for (unsigned int i = 0; i < n; i++)
+		{
+			double y = weights_[i] * spectrum[i];
+			if (i >= 1)
+				y -= l1[i - 1] * x[i - 1];
+			if (i >= 2)
+				y -= l2[i - 2] * x[i - 2];
+			x[i] = y;
+		}
+		for (unsigned int i = n; i-- > 0;)
+		{
+			x[i] /= d[i];
+			if (i + 1 < n)
+				x[i] -= l1[i] * x[i + 1];
+			if (i + 2 < n)
+				x[i] -= l2[i] * x[i + 2];
+		}
+		for (unsigned int i = 0; i < n; i++)
+			weights_[i] = spectrum[i] > x[i] ? p : 1 - p;
+	}
+	std::copy(x.begin(), x.end(), baseline_.begin());
+}
+
+void BaselineEstimator::polynomial(float const *spectrum)
+{
+	const unsigned int n = bins_, m = config_.order + 1;
+	unsigned int iterations = config_.iterations;
+	float tolerance = 0;
+	if (warm_)
+	{
+		for (unsigned int i = 0; i < n; i++)
+			clipped_[i] = std::min(spectrum[i], baseline_[i] + POLYNOMIAL_HEADROOM * noise_);
+	}
+	else
+	{
+		std::copy(spectrum, spectrum + n, clipped_.begin());
+		iterations = COLD_ITERATIONS;
+		tolerance = POLYNOMIAL_TOLERANCE * *std::max_element(spectrum, spectrum + n);
+	}
+
+	for (unsigned int it = 0; it < iterations; it++)
+	{
+		// Least squares against the basis, through the Cholesky factor of its Gram matrix.
+		double *c = coefficients_.data();
+		for (unsigned int k = 0; k < m; k++)
+		{
+			double sum = 0;
+			double const *b = &basis_[(size_t)k * n];
+			for (unsigned int i = 0; i < n; i++)
+				sum += b[i] * clipped_[i];
+			for (unsigned int l = 0; l < k; l++)
+				sum -= gram_[k * m + l] * c[l];
+			c[k] = sum / gram_[k * m + k];
+		}
+		for (unsigned int k = m; k-- > 0;)
+		{
+			for (unsigned int l = k + 1; l < m; l++)
+				c[k] -= gram_[l * m + k] * c[l];
+			c[k] /= gram_[k * m + k];
+		}
+		std::fill(baseline_.begin(), baseline_.end(), 0.0f);
+		for (unsigned int k = 0; k < m; k++)
+		{
+			double const *b = &basis_[(size_t)k * n];
+			for (unsigned int i = 0; i < n; i++)
+				baseline_[i] += c[k] * b[i];
+		}
+		float moved = 0;
+		for (unsigned int i = 0; i < n; i++)
+		{
+			if (clipped_[i] > baseline_[i])
+			{
+				moved = std::max(moved, clipped_[i] - baseline_[i]);
+				clipped_[i] = baseline_[i];
+			}
+		}
+		if (moved <= tolerance)
+			break;
+	}
+
+	double sum = 0;
+	unsigned int below = 0;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		if (spectrum[i] < baseline_[i])
+		{
+			sum += (spectrum[i] - baseline_[i]) * (spectrum[i] - baseline_[i]);
+			below++;
+		}
+	}
+	noise_ = below ? sqrt(sum / below) : 0;
+}
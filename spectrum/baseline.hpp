@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * baseline.hpp - estimate the continuum under a spectrum, frame by frame.
+ */
+
+#pragma once
+
+#include <vector>
+
+// The smooth continuum under the lines of a spectrum, so that it can be taken off before
+// looking for peaks. There are three ways of finding it:
+//
+// RollingBall: the opening (a running minimum and then a running maximum) over a window
+// wider than any line, smoothed by a running mean over the same window. It needs no
+// iterations, and costs O(bins) whatever the window.
+//
+// Als: asymmetric least squares (Eilers & Boelens 2005). The baseline is the smoothest
+// curve, by its second differences weighted by lambda, that fits the points below it with
+// weight 1 - asymmetry and those above it with weight asymmetry. Each iteration solves a
+// pentadiagonal system, in O(bins).
+//
+// Polynomial: the modified polynomial fit (Lieber & Mahadevan-Jansen 2003). A polynomial
+// is fitted and the spectrum clipped to it, over and over, until the lines are gone. The
+// fit is against a fixed basis, so each iteration costs O(bins * order).
+//
+// Both iterative methods start from the last frame's baseline once they have one, and
+// then run only a few iterations each frame. All the workspace is allocated by Reset.
+class BaselineEstimator
+{
+public:
+	enum class Method
+	{
+		Off, // the baseline is zero
+		RollingBall,
+		Als,
+		Polynomial
+	};
+
+	struct Config
+	{
+		Method method = Method::Off;
+		unsigned int window = 64; // RollingBall: bins, wider than any line
+		double lambda = 1e5; // Als: how smooth the baseline is
+		float asymmetry = 0.01; // Als: the weight of points above the baseline
+		unsigned int order = 4; // Polynomial
+		unsigned int iterations = 3; // each frame, once there is a baseline to start from
+	};
+
+	BaselineEstimator();
+	// Estimate baselines of this many bins, forgetting the last one.
+	void Reset(unsigned int bins, Config const &config);
+	Config const &GetConfig() const { return config_; }
+	// Estimate the baseline of a spectrum.
+	void Update(float const *spectrum);
+	// The last baseline, all zero until there is one.
+	float const *Get() const { return baseline_.data(); }
+
+private:
+	template <typename Op>
+	void sliding(float const *in, float *out, float pad, Op op);
+	void rollingBall(float const *spectrum);
+	void als(float const *spectrum);
+	void polynomial(float const *spectrum);
+
+	Config config_;
+	unsigned int bins_;
+	bool warm_; // baseline_ is from the last frame
+	std::vector<float> baseline_;
+	// RollingBall
+	std::vector<float> padded_;
+	std::vector<float> forward_;
+	std::vector<float> backward_;
+	std::vector<float> opened_;
+	// Als: the bands of lambda * D'D, the weights and the LDL' factors
+	std::vector<double> penalty_[3];
+	std::vector<double> weights_;
+	std::vector<double> diagonal_;
+	std::vector<double> lower_[2];
+	std::vector<double> solution_;
+	// Polynomial: the basis at every bin, the Cholesky factor of its Gram matrix, and the
+	// spectrum as clipped so far
+	std::vector<double> basis_;
+	std::vector<double> gram_;
+	std::vector<double> coefficients_;
+	std::vector<float> clipped_;
+	float noise_; // of the points below the last baseline
+};
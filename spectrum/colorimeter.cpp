@@ -0,0 +1,365 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * colorimeter.cpp - the colour of a light source from its spectrum.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "spectrum/colorimeter.hpp"
+
+// The grid the tables are held on, in nm, and the steps the reference illuminant is worked
+// out in.
+#define GRID_MIN 360
+#define GRID_MAX 830
+#define GRID_POINTS (GRID_MAX - GRID_MIN + 1)
+#define REFERENCE_STEP 5
+// CIE 13.3 allows up to 14 test colour samples, and some add a 15th.
+#define MAX_SAMPLES 15
+// The locus runs from 1000K to 25000K. Further from it than DUV_MAX there is no CCT.
+#define LOCUS_MIRED_MIN 40
+#define LOCUS_MIRED_MAX 1000
+#define DUV_MAX 0.05
+// The nearest point of the locus is looked for this many mireds apart first.
+#define LOCUS_STRIDE 16
+// Above this CCT the reference illuminant is daylight.
+#define DAYLIGHT_CCT 5000.0
+// hc/k, in nm K, for Planck's law.
+#define SECOND_RADIATION_CONSTANT 1.4387769e7
+
+// A gaussian with a different width either side of its peak, as the observer's fit has.
+static double lobe(double wavelength, double peak, double below, double above)
+{
+	const double t = (wavelength - peak) * (wavelength < peak ? below : above);
+	return exp(-0.5 * t * t);
+}
+
+static double planck(double wavelength, double kelvin)
+{
+	return 1e15 / (pow(wavelength, 5) * expm1(SECOND_RADIATION_CONSTANT / (wavelength * kelvin)));
+}
+
+// CIE 1960 uv.
+static void uv_of(double const *xyz, double &u, double &v)
+{
+	const double d = xyz[0] + 15 * xyz[1] + 3 * xyz[2];
+	u = 4 * xyz[0] / d;
+	v = 6 * xyz[1] / d;
+}
+
+// Eight partial sums, so that the compiler can vectorise without reordering a single sum.
+static float dot(float const *a, float const *b, unsigned int n)
+{
+	float partial[8] = {};
+	const unsigned int blocks = n / 8;
+	for (unsigned int k = 0; k < blocks; k++)
+	{
+		float const *x = a + 8 * k, *y = b + 8 * k;
+		for (unsigned int j = 0; j < 8; j++)
+			partial[j] += x[j] * y[j];
+	}
+	float sum = 0;
+	for (unsigned int i = blocks * 8; i < n; i++)
+		sum += a[i] * b[i];
+	for (float p : partial)
+		sum += p;
+	return sum;
+}
+
+// Lines of a wavelength in nm and then some values, in increasing wavelength, each column
+// interpolated onto the grid and 0 outside the table. Commas may separate the values, and
+// lines that don't start with a number, such as headings, are skipped.
+static std::vector<std::vector<double>> load_table(std::string const &filename, std::string const &what)
+{
+	std::ifstream file(filename);
+	if (!file)
+		throw std::runtime_error("failed to open " + what + " " + filename);
+	std::vector<double> wavelengths;
+	std::vector<std::vector<double>> columns;
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::replace(line.begin(), line.end(), ',', ' ');
+		std::istringstream fields(line);
+		double wavelength, value;
+		if (!(fields >> wavelength))
+			continue;
+		std::vector<double> values;
+		while (fields >> value)
+			values.push_back(value);
+		if (columns.empty())
+			columns.resize(values.size());
+		if (values.empty() || values.size() != columns.size())
+			throw std::runtime_error(what + " " + filename + " has lines of different lengths");
+		if (!wavelengths.empty() && wavelength <= wavelengths.back())
+			throw std::runtime_error(what + " " + filename + " isn't in increasing wavelength");
+		wavelengths.push_back(wavelength);
+		for (unsigned int j = 0; j < values.size(); j++)
+			columns[j].push_back(values[j]);
+	}
+	if (wavelengths.size() < 2)
+		throw std::runtime_error(what + " " + filename + " has too few points");
+
+	std::vector<std::vector<double>> grid(columns.size(), std::vector<double>(GRID_POINTS, 0.0));
+	size_t i = 0;
+	for (unsigned int g = 0; g < GRID_POINTS; g++)
+	{
+		const double wl = GRID_MIN + g;
+		if (wl < wavelengths.front() || wl > wavelengths.back())
+			continue;
+		while (i + 2 < wavelengths.size() && wavelengths[i + 1] < wl)
+			i++;
+		const double f = (wl - wavelengths[i]) / (wavelengths[i + 1] - wavelengths[i]);
+		for (unsigned int j = 0; j < columns.size(); j++)
+			grid[j][g] = columns[j][i] + f * (columns[j][i + 1] - columns[j][i]);
+	}
+	return grid;
+}
+
+Colorimeter::Colorimeter() : samples_(0)
+{
+	for (auto &column : observer_)
+		column.resize(GRID_POINTS);
+	for (unsigned int g = 0; g < GRID_POINTS; g++)
+	{
+		const double wl = GRID_MIN + g;
+		observer_[0][g] = 1.056 * lobe(wl, 599.8, 0.0264, 0.0323) + 0.362 * lobe(wl, 442.0, 0.0624, 0.0374) -
+						  0.065 * lobe(wl, 501.1, 0.0490, 0.0382);
+		observer_[1][g] = 0.821 * lobe(wl, 568.8, 0.0213, 0.0247) + 0.286 * lobe(wl, 530.9, 0.0613, 0.0322);
+		observer_[2][g] = 1.217 * lobe(wl, 437.0, 0.0845, 0.0278) + 0.681 * lobe(wl, 459.0, 0.0385, 0.0725);
+	}
+	makeLocus();
+}
+
+void Colorimeter::LoadObserver(std::string const &filename)
+{
+	std::vector<std::vector<double>> table = load_table(filename, "observer");
+	if (table.size() != 3)
+		throw std::runtime_error("observer " + filename + " should have x, y and z on each line");
+	for (unsigned int c = 0; c < 3; c++)
+		observer_[c] = std::move(table[c]);
+	makeLocus();
+	makeReferences();
+}
+
+void Colorimeter::LoadSamples(std::string const &filename)
+{
+	std::vector<std::vector<double>> table = load_table(filename, "test colour samples");
+	if (table.size() < 8 || table.size() > MAX_SAMPLES)
+		throw std::runtime_error("test colour samples " + filename + " should have between 8 and " +
+								 std::to_string(MAX_SAMPLES) + " samples");
+	samples_ = table.size();
+	reflectances_.clear();
+	for (auto const &column : table)
+		reflectances_.insert(reflectances_.end(), column.begin(), column.end());
+	makeReferences();
+}
+
+void Colorimeter::LoadDaylight(std::string const &filename)
+{
+	std::vector<std::vector<double>> table = load_table(filename, "daylight components");
+	if (table.size() != 3)
+		throw std::runtime_error("daylight components " + filename + " should have S0, S1 and S2 on each line");
+	for (unsigned int c = 0; c < 3; c++)
+		daylight_[c] = std::move(table[c]);
+	makeReferences();
+}
+
+void Colorimeter::makeLocus()
+{
+	locus_.clear();
+	for (unsigned int mired = LOCUS_MIRED_MIN; mired <= LOCUS_MIRED_MAX; mired++)
+	{
+		double xyz[3] = {};
+		for (unsigned int g = 0; g < GRID_POINTS; g += REFERENCE_STEP)
+		{
+			const double s = planck(GRID_MIN + g, 1e6 / mired);
+			for (unsigned int c = 0; c < 3; c++)
+				xyz[c] += s * observer_[c][g];
+		}
+		LocusPoint point;
+		point.mired = mired;
+		uv_of(xyz, point.u, point.v);
+		locus_.push_back(point);
+	}
+}
+
+void Colorimeter::Weigh(double b, double c, unsigned int width, std::vector<float> &weights) const
+{
+	weights.assign((size_t)Rows() * width, 0.0f);
+	const double step = 1 / fabs(b); // nm per bin
+	for (unsigned int x = 0; x < width; x++)
+	{
+		const double wl = (x - c) / b;
+		if (!(wl >= GRID_MIN && wl < GRID_MAX))
+			continue;
+		const unsigned int g = wl - GRID_MIN;
+		const double f = wl - GRID_MIN - g;
+		for (unsigned int ch = 0; ch < 3; ch++)
+		{
+			const double o = observer_[ch][g] + f * (observer_[ch][g + 1] - observer_[ch][g]);
+			weights[ch * width + x] = o * step;
+			for (unsigned int i = 0; i < samples_; i++)
+			{
+				double const *r = &reflectances_[i * GRID_POINTS + g];
+				weights[(3 + 3 * i + ch) * width + x] = o * (r[0] + f * (r[1] - r[0])) * step;
+			}
+		}
+	}
+}
+
+void Colorimeter::Measure(float const *spectrum, unsigned int width, float const *weights, LightColour &colour) const
+{
+	double sums[3 * (MAX_SAMPLES + 1)];
+	for (unsigned int r = 0; r < Rows(); r++)
+		sums[r] = dot(spectrum, weights + (size_t)r * width, width);
+	colour.X = sums[0];
+	colour.Y = sums[1];
+	colour.Z = sums[2];
+	colour.special.assign(samples_, NAN);
+	colour.ra = NAN;
+	const double total = colour.X + colour.Y + colour.Z;
+	colour.valid = colour.Y > 0 && total > 0;
+	if (!colour.valid)
+	{
+		colour.x = colour.y = colour.u = colour.v = colour.cct = colour.duv = NAN;
+		return;
+	}
+	colour.x = colour.X / total;
+	colour.y = colour.Y / total;
+	const double d = colour.X + 15 * colour.Y + 3 * colour.Z;
+	colour.u = 4 * colour.X / d;
+	colour.v = 9 * colour.Y / d;
+	cct(colour);
+	renderIndex(sums, colour);
+}
+
+// Ohno's triangular method (2014) on the nearest point of the locus and those either side.
+void Colorimeter::cct(LightColour &colour) const
+{
+	const double u = colour.u, v = colour.v * 2 / 3;
+	auto distance2 = [u, v](LocusPoint const &p) { return (p.u - u) * (p.u - u) + (p.v - v) * (p.v - v); };
+	// Every LOCUS_STRIDE-th point, and then those around the nearest of them.
+	auto nearest_of = [&](unsigned int begin, unsigned int end, unsigned int stride) {
+		unsigned int nearest = begin;
+		double best = distance2(locus_[begin]);
+		for (unsigned int i = begin + stride; i < end; i += stride)
+		{
+			const double d2 = distance2(locus_[i]);
+			if (d2 < best)
+			{
+				best = d2;
+				nearest = i;
+			}
+		}
+		return nearest;
+	};
+	const unsigned int coarse = nearest_of(0, locus_.size(), LOCUS_STRIDE);
+	const unsigned int nearest = nearest_of(coarse > LOCUS_STRIDE ? coarse - LOCUS_STRIDE : 0,
+											std::min<unsigned int>(coarse + LOCUS_STRIDE + 1, locus_.size()), 1);
+	colour.cct = NAN;
+	colour.duv = NAN;
+	if (nearest == 0 || nearest == locus_.size() - 1)
+		return;
+	LocusPoint const &p = locus_[nearest - 1], &n = locus_[nearest + 1];
+	const double dp2 = distance2(p), dn2 = distance2(n);
+	const double l = std::hypot(n.u - p.u, n.v - p.v);
+	const double t = (dp2 - dn2 + l * l) / (2 * l);
+	const double on_locus = p.v + (n.v - p.v) * t / l;
+	colour.duv = std::copysign(sqrt(std::max(dp2 - t * t, 0.0)), v - on_locus);
+	if (fabs(colour.duv) <= DUV_MAX)
+		colour.cct = 1e6 / (p.mired + (n.mired - p.mired) * t / l);
+}
+
+// The reference illuminant of a CCT through the observer and the samples, scaled to a Y
+// of 1.
+void Colorimeter::referenceSums(double cct, double *sums) const
+{
+	const bool daylight = !daylight_[0].empty() && cct >= DAYLIGHT_CCT;
+	double m1 = 0, m2 = 0;
+	if (daylight)
+	{
+		const double t = std::min(cct, 25000.0);
+		const double xd = t <= 7000 ? -4.6070e9 / (t * t * t) + 2.9678e6 / (t * t) + 0.09911e3 / t + 0.244063
+									: -2.0064e9 / (t * t * t) + 1.9018e6 / (t * t) + 0.24748e3 / t + 0.237040;
+		const double yd = -3.000 * xd * xd + 2.870 * xd - 0.275;
+		const double m = 0.0241 + 0.2562 * xd - 0.7341 * yd;
+		m1 = (-1.3515 - 1.7703 * xd + 5.9114 * yd) / m;
+		m2 = (0.0300 - 31.4424 * xd + 30.0717 * yd) / m;
+	}
+	std::fill(sums, sums + Rows(), 0.0);
+	for (unsigned int g = 0; g < GRID_POINTS; g += REFERENCE_STEP)
+	{
+		const double s = daylight ? daylight_[0][g] + m1 * daylight_[1][g] + m2 * daylight_[2][g]
+								  : planck(GRID_MIN + g, cct);
+		for (unsigned int ch = 0; ch < 3; ch++)
+		{
+			const double o = s * observer_[ch][g];
+			sums[ch] += o;
+			for (unsigned int i = 0; i < samples_; i++)
+				sums[3 + 3 * i + ch] += o * reflectances_[i * GRID_POINTS + g];
+		}
+	}
+	const double y = sums[1];
+	for (unsigned int r = 0; r < Rows(); r++)
+		sums[r] = y > 0 ? sums[r] / y : 0;
+}
+
+void Colorimeter::makeReferences()
+{
+	references_.resize(locus_.size() * Rows());
+	for (unsigned int i = 0; i < locus_.size() && samples_; i++)
+		referenceSums(1e6 / locus_[i].mired, &references_[i * Rows()]);
+}
+
+// CIE 13.3: the samples' colours under the light and under the reference, in CIE 1964
+// U*V*W*, after a von Kries adaptation of the light's white to the reference's. The
+// reference comes from those either side of its CCT on the locus.
+void Colorimeter::renderIndex(double const *sums, LightColour &colour) const
+{
+	if (!samples_ || std::isnan(colour.cct))
+		return;
+
+	// A CCT interpolated past either end of the locus takes the reference at that end.
+	const double position = std::clamp(1e6 / colour.cct - LOCUS_MIRED_MIN, 0.0, locus_.size() - 2.0);
+	const unsigned int i0 = std::min<unsigned int>(position, locus_.size() - 2);
+	const double f = position - i0;
+	double const *r0 = &references_[i0 * Rows()], *r1 = r0 + Rows();
+	double reference[3 * (MAX_SAMPLES + 1)];
+	for (unsigned int r = 0; r < Rows(); r++)
+		reference[r] = r0[r] + f * (r1[r] - r0[r]);
+	if (reference[1] <= 0)
+		return;
+
+	auto cd_of = [](double u, double v, double &c, double &d) {
+		c = (4 - u - 10 * v) / v;
+		d = (1.708 * v + 0.404 - 1.481 * u) / v;
+	};
+	double uk, vk, ur, vr, ck, dk, cr, dr;
+	uv_of(sums, uk, vk);
+	uv_of(reference, ur, vr);
+	cd_of(uk, vk, ck, dk);
+	cd_of(ur, vr, cr, dr);
+	const double kk = 100 / sums[1], kr = 100 / reference[1];
+	double total = 0;
+	for (unsigned int i = 0; i < samples_; i++)
+	{
+		double uki, vki, uri, vri, cki, dki;
+		uv_of(sums + 3 + 3 * i, uki, vki);
+		uv_of(reference + 3 + 3 * i, uri, vri);
+		cd_of(uki, vki, cki, dki);
+		const double den = 16.518 + 1.481 * cr / ck * cki - dr / dk * dki;
+		const double ua = (10.872 + 0.404 * cr / ck * cki - 4 * dr / dk * dki) / den, va = 5.520 / den;
+		const double wk = 25 * cbrt(kk * sums[3 + 3 * i + 1]) - 17, wr = 25 * cbrt(kr * reference[3 + 3 * i + 1]) - 17;
+		const double du = 13 * (wk * (ua - ur) - wr * (uri - ur)), dv = 13 * (wk * (va - vr) - wr * (vri - vr));
+		colour.special[i] = 100 - 4.6 * sqrt(du * du + dv * dv + (wk - wr) * (wk - wr));
+		if (i < 8)
+			total += colour.special[i];
+	}
+	colour.ra = total / 8;
+}
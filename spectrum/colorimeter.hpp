@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * colorimeter.hpp - the colour of a light source from its spectrum.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// What a light source looks like to the CIE 1931 standard observer, and how well it
+// renders colours. X, Y and Z are only relative, as the spectrum is.
+struct LightColour
+{
+	bool valid; // there was light in the visible
+	double X, Y, Z;
+	double x, y; // CIE 1931 chromaticity
+	double u, v; // CIE 1976 u' v'
+	double cct; // correlated colour temperature in K, NAN off the Planckian locus
+	double duv; // distance from the locus in CIE 1960 uv, positive above it
+	double ra; // the general colour rendering index, NAN without test colour samples
+	std::vector<double> special; // the special index of each test colour sample
+};
+
+// The colorimetry of spectra on a given wavelength axis. The observer, the CIE 13.3 test
+// colour samples and the daylight components are held on a 1nm grid from 360 to 830nm.
+// Weigh resamples them onto the bins once for each wavelength fit, after which Measure
+// needs only a dot product of the spectrum with each row of weights, and a little
+// arithmetic on the results.
+//
+// The colour rendering index compares the samples under the light with the same under a
+// reference illuminant of its CCT, a blackbody below 5000K and CIE daylight above. The
+// reference is worked out in 5nm steps as CIE 13.3 does, which doesn't depend on the bins,
+// for every mired along the locus when the tables are loaded.
+class Colorimeter
+{
+public:
+	// The observer from the multi-lobe fit of Wyman, Sloan & Shirley (2013), which is within
+	// the spread of the CIE's own measurements, and no test colour samples.
+	Colorimeter();
+	// Lines of a wavelength in nm followed by x, y and z, in increasing wavelength. Throws if
+	// the file can't be read.
+	void LoadObserver(std::string const &filename);
+	// Lines of a wavelength in nm followed by the reflectance of each sample, TCS01 to TCS08
+	// at least (as CIE 13.3 gives them). Throws if the file can't be read.
+	void LoadSamples(std::string const &filename);
+	// Lines of a wavelength in nm followed by S0, S1 and S2. Without them the reference is
+	// always a blackbody. Throws if the file can't be read.
+	void LoadDaylight(std::string const &filename);
+	unsigned int Samples() const { return samples_; }
+
+	// Rows of width weights, bin x being at (x - c) / b nm: x, y and z, and then x, y and z
+	// times the reflectance of each sample.
+	void Weigh(double b, double c, unsigned int width, std::vector<float> &weights) const;
+	unsigned int Rows() const { return 3 * (samples_ + 1); }
+	// The colour of a spectrum, with weights from Weigh.
+	void Measure(float const *spectrum, unsigned int width, float const *weights, LightColour &colour) const;
+
+private:
+	void makeLocus();
+	void referenceSums(double cct, double *sums) const;
+	void makeReferences();
+	void cct(LightColour &colour) const;
+	void renderIndex(double const *sums, LightColour &colour) const;
+
+	std::vector<double> observer_[3];
+	unsigned int samples_;
+	std::vector<double> reflectances_; // each sample's in turn
+	std::vector<double> daylight_[3]; // empty without
+	// The Planckian locus in CIE 1960 uv, a point to every mired.
+	struct LocusPoint
+	{
+		double mired;
+		double u, v;
+	};
+	std::vector<LocusPoint> locus_;
+	// At each point of the locus, what Measure sums for the reference illuminant, with a Y of 1.
+	std::vector<double> references_;
+};
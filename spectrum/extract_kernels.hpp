@@ -0,0 +1,358 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * extract_kernels.hpp - collapse a frame into a spectrum, one instantiation per pixel format.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+
+#include "core/stream_info.hpp"
+
+// Only spectrum_engine.cpp should need these. Each kernel is instantiated for a pixel
+// format, an orientation of the band and an accumulator type, so that the inner loop
+// has nothing left to decide. Every kernel keeps the three channels of the format apart,
+// Y, U and V or R, G and B, for the engine to weight afterwards.
+
+// Pixel rows (or columns) across the band that are skipped between samples.
+#define ACROSS_STEP 4
+
+namespace spectrum_kernels
+{
+
+// Where the planes of a frame are.
+struct Planes
+{
+	uint8_t const *p[3];
+	unsigned int stride[3];
+};
+
+// The three channels of one sample.
+template <typename T>
+struct Channels
+{
+	T c[3];
+};
+
+// A format says how many pixels make one bin in each direction, and reads the channels of
+// the bin at (x, y), counting the pixels it finds at full scale. Integer formats can be
+// accumulated exactly in integers. Chroma is centred on zero.
+struct Yuv420
+{
+	static constexpr unsigned int BIN = 1;
+	static constexpr bool INTEGER = false;
+	static constexpr bool YUV = true;
+	static Planes Prepare(uint8_t const *data, StreamInfo const &info)
+	{
+		const unsigned int uv_stride = info.stride / 2;
+		uint8_t const *u = data + info.stride * info.height;
+		return { { data, u, u + uv_stride * (info.height / 2) }, { info.stride, uv_stride, uv_stride } };
+	}
+	static Channels<float> Sample(Planes const &f, unsigned int x, unsigned int y, unsigned int &saturated)
+	{
+		const uint8_t Y = f.p[0][y * f.stride[0] + x];
+		const unsigned int c = (y / 2) * f.stride[1] + x / 2;
+		saturated += Y == 255;
+		return { { (float)Y, f.p[1][c] - 128.0f, f.p[2][c] - 128.0f } };
+	}
+};
+
+struct Yuyv
+{
+	static constexpr unsigned int BIN = 1;
+	static constexpr bool INTEGER = false;
+	static constexpr bool YUV = true;
+	static Planes Prepare(uint8_t const *data, StreamInfo const &info)
+	{
+		return { { data, data, data }, { info.stride, info.stride, info.stride } };
+	}
+	static Channels<float> Sample(Planes const &f, unsigned int x, unsigned int y, unsigned int &saturated)
+	{
+		uint8_t const *row = f.p[0] + y * f.stride[0];
+		const uint8_t Y = row[2 * x];
+		uint8_t const *uv = row + 4 * (x / 2);
+		saturated += Y == 255;
+		return { { (float)Y, uv[1] - 128.0f, uv[3] - 128.0f } };
+	}
+};
+
+// libcamera's RGB888 is stored B, G, R.
+struct Rgb888
+{
+	static constexpr unsigned int BIN = 1;
+	static constexpr bool INTEGER = false;
+	static constexpr bool YUV = false;
+	static Planes Prepare(uint8_t const *data, StreamInfo const &info)
+	{
+		return { { data, data, data }, { info.stride, info.stride, info.stride } };
+	}
+	static Channels<float> Sample(Planes const &f, unsigned int x, unsigned int y, unsigned int &saturated)
+	{
+		uint8_t const *p = f.p[0] + y * f.stride[0] + 3 * x;
+		saturated += (p[0] == 255) + (p[1] == 255) + (p[2] == 255);
+		return { { (float)p[2], (float)p[1], (float)p[0] } };
+	}
+};
+
+// Bayer formats are read a whole 2x2 quad at a time, which gives each bin one blue, two
+// green and one red pixel.
+template <typename Unpack>
+struct Bayer
+{
+	static constexpr unsigned int BIN = 2;
+	static constexpr bool INTEGER = true;
+	static constexpr bool YUV = false;
+	static Planes Prepare(uint8_t const *data, StreamInfo const &info)
+	{
+		return { { data, data, data }, { info.stride, info.stride, info.stride } };
+	}
+	static Channels<uint32_t> Sample(Planes const &f, unsigned int x, unsigned int y, unsigned int &saturated)
+	{
+		uint8_t const *row0 = f.p[0] + 2 * y * f.stride[0];
+		uint8_t const *row1 = row0 + f.stride[0];
+		const unsigned int p0 = Unpack::Get(row0, 2 * x), p1 = Unpack::Get(row0, 2 * x + 1);
+		const unsigned int p2 = Unpack::Get(row1, 2 * x), p3 = Unpack::Get(row1, 2 * x + 1);
+		saturated += (p0 == Unpack::MAX) + (p1 == Unpack::MAX) + (p2 == Unpack::MAX) + (p3 == Unpack::MAX);
+		// BGGR: blue top left, red bottom right.
+		return { { p3, p1 + p2, p0 } };
+	}
+};
+
+struct Unpack10P
+{
+	static constexpr unsigned int MAX = 1023;
+	static unsigned int Get(uint8_t const *row, unsigned int x)
+	{
+		uint8_t const *group = row + (x / 4) * 5;
+		return (group[x & 3] << 2) | ((group[4] >> (2 * (x & 3))) & 3);
+	}
+};
+
+struct Unpack12P
+{
+	static constexpr unsigned int MAX = 4095;
+	static unsigned int Get(uint8_t const *row, unsigned int x)
+	{
+		uint8_t const *group = row + (x / 2) * 3;
+		return (group[x & 1] << 4) | ((group[2] >> (4 * (x & 1))) & 0xf);
+	}
+};
+
+struct Unpack16
+{
+	static constexpr unsigned int MAX = 65535;
+	static unsigned int Get(uint8_t const *row, unsigned int x) { return row[2 * x] | (row[2 * x + 1] << 8); }
+};
+
+// An orientation turns positions along and across the band into bin coordinates.
+struct Horizontal
+{
+	static unsigned int Along(StreamInfo const &info) { return info.width; }
+	static unsigned int Across(StreamInfo const &info) { return info.height; }
+	template <typename Format>
+	static auto Sample(Planes const &f, unsigned int along, unsigned int across, unsigned int &saturated)
+	{
+		return Format::Sample(f, along, across, saturated);
+	}
+};
+
+struct Vertical
+{
+	static unsigned int Along(StreamInfo const &info) { return info.height; }
+	static unsigned int Across(StreamInfo const &info) { return info.width; }
+	template <typename Format>
+	static auto Sample(Planes const &f, unsigned int along, unsigned int across, unsigned int &saturated)
+	{
+		return Format::Sample(f, across, along, saturated);
+	}
+};
+
+// One band of the frame, as one thread sees it.
+struct TrackJob
+{
+	unsigned int j0, j1; // the positions across the frame it covers
+	float slope;
+	// For optimal extraction, the positions to read and their weights. Otherwise rows is
+	// nullptr and every ACROSS_STEP pixels from j0 count the same.
+	uint32_t const *rows;
+	float const *weights;
+	unsigned int num_rows;
+	float *const *output; // three channels
+	uint32_t *const *integer_output; // three channels, or nullptr to accumulate in floats
+	float carry[3]; // returned: what belongs to bin i0 - 1
+};
+
+// One thread's share of an extraction: bins i0 to i1 of every track.
+struct Job
+{
+	uint8_t const *data;
+	StreamInfo const *info;
+	unsigned int i0, i1;
+	TrackJob *tracks;
+	unsigned int num_tracks;
+	// Per-pixel dark and flat correction, or nullptr. For each position across the frame
+	// (every ACROSS_STEP pixels) and then each pixel along it, the three channels' darks
+	// followed by their gains.
+	float const *correction;
+	unsigned int saturated; // returned
+};
+
+// Add bin i of a track to its three channel outputs. With a float accumulator, bin i
+// reads the pixel at floor(i + slope * j) at position j across the frame, which holds the
+// spectrum from i - rem, rem being the fractional part. Its value is shared between bin i
+// and bin i - 1 in proportion; the share that belongs before i0 is another thread's and
+// goes in carry instead. An integer accumulator is only used when the slope is zero, when every
+// sample lands in a whole bin, and never with weights or a correction, which is applied
+// to each sample as it is read.
+template <typename Format, typename Orientation, typename Acc, bool WEIGHTED, bool CORRECTED>
+inline void extract_bin(Planes const &f, TrackJob &track, float const *correction, unsigned int i, unsigned int i0,
+						unsigned int bins, unsigned int &count)
+{
+	constexpr unsigned int step = std::max(ACROSS_STEP / Format::BIN, 1u);
+	const unsigned int n = WEIGHTED ? track.num_rows : (track.j1 - track.j0 + step - 1) / step;
+	if constexpr (std::is_integral_v<Acc>)
+	{
+		static_assert(!WEIGHTED && !CORRECTED, "weighted or corrected extraction needs a float accumulator");
+		Acc sum[3] = {};
+		for (unsigned int k = 0; k < n; k++)
+		{
+			auto v = Orientation::template Sample<Format>(f, i, track.j0 + k * step, count);
+			for (unsigned int c = 0; c < 3; c++)
+				sum[c] += v.c[c];
+		}
+		for (unsigned int c = 0; c < 3; c++)
+			track.integer_output[c][i] += sum[c];
+	}
+	else
+	{
+		const float slope = track.slope;
+		float here[3] = {}, previous[3] = {};
+		for (unsigned int k = 0; k < n; k++)
+		{
+			const unsigned int j = WEIGHTED ? track.rows[k] : track.j0 + k * step;
+			const float w = WEIGHTED ? track.weights[k] : 1.0f;
+			// floor(pos), which only a negative slope can take below zero.
+			const float pos = slope * j + i;
+			const int below = (int)pos - (pos < (int)pos);
+			const int p = std::clamp(below, 0, (int)bins - 1);
+			const float rem = pos - below;
+			auto v = Orientation::template Sample<Format>(f, p, j, count);
+			float value[3] = { (float)v.c[0], (float)v.c[1], (float)v.c[2] };
+			if constexpr (CORRECTED)
+			{
+				float const *pixel = correction + ((size_t)(j / step) * bins + p) * 6;
+				for (unsigned int c = 0; c < 3; c++)
+					value[c] = (value[c] - pixel[c]) * pixel[3 + c];
+			}
+			for (unsigned int c = 0; c < 3; c++)
+			{
+				here[c] += (1.0f - rem) * w * value[c];
+				previous[c] += rem * w * value[c];
+			}
+		}
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			track.output[c][i] += here[c];
+			if (i > i0)
+				track.output[c][i - 1] += previous[c];
+			else if (i > 0)
+				track.carry[c] += previous[c];
+		}
+	}
+}
+
+template <typename Format, typename Orientation, bool CORRECTED>
+inline void extract_tracks(Job &job, Planes const &f, unsigned int bins, unsigned int &count)
+{
+	for (unsigned int i = job.i0; i < job.i1; i++)
+	{
+		for (unsigned int t = 0; t < job.num_tracks; t++)
+		{
+			TrackJob &track = job.tracks[t];
+			if (track.rows)
+				extract_bin<Format, Orientation, float, true, CORRECTED>(f, track, job.correction, i, job.i0, bins,
+																		 count);
+			else if constexpr (Format::INTEGER && !CORRECTED)
+			{
+				if (track.integer_output)
+					extract_bin<Format, Orientation, uint32_t, false, false>(f, track, nullptr, i, job.i0, bins, count);
+				else
+					extract_bin<Format, Orientation, float, false, false>(f, track, nullptr, i, job.i0, bins, count);
+			}
+			else
+				extract_bin<Format, Orientation, float, false, CORRECTED>(f, track, job.correction, i, job.i0, bins,
+																		  count);
+		}
+	}
+}
+
+// What the engine calls for each job. Every track is summed bin by bin in the same pass,
+// so however many there are, the frame is only read once.
+template <typename Format, typename Orientation>
+void extract(Job &job)
+{
+	StreamInfo const &info = *job.info;
+	const Planes f = Format::Prepare(job.data, info);
+	const unsigned int bins = Orientation::Along(info) / Format::BIN;
+	unsigned int count = 0;
+	for (unsigned int t = 0; t < job.num_tracks; t++)
+		std::fill(job.tracks[t].carry, job.tracks[t].carry + 3, 0.0f);
+	if (job.correction)
+		extract_tracks<Format, Orientation, true>(job, f, bins, count);
+	else
+		extract_tracks<Format, Orientation, false>(job, f, bins, count);
+	job.saturated = count;
+}
+
+// The mean brightness at each position across the band that extraction reads, averaged
+// over every bin_step-th bin. For YUV formats this is the luma.
+template <typename Format, typename Orientation>
+void profile(uint8_t const *data, StreamInfo const &info, unsigned int bin_step, float *rows)
+{
+	constexpr unsigned int step = std::max(ACROSS_STEP / Format::BIN, 1u);
+	const Planes f = Format::Prepare(data, info);
+	const unsigned int bins = Orientation::Along(info) / Format::BIN;
+	const unsigned int across = Orientation::Across(info) / Format::BIN;
+	unsigned int saturated = 0;
+	for (unsigned int j = 0, k = 0; j < across; j += step, k++)
+	{
+		float sum = 0;
+		unsigned int n = 0;
+		for (unsigned int i = 0; i < bins; i += bin_step, n++)
+		{
+			auto v = Orientation::template Sample<Format>(f, i, j, saturated);
+			sum += Format::YUV ? (float)v.c[0] : (float)v.c[0] + v.c[1] + v.c[2];
+		}
+		rows[k] = n ? sum / n : 0;
+	}
+}
+
+// Fold a frame into a master dark or flat, the running mean of every sample extraction
+// can read, laid out as for a correction but with only the three channels. n is the
+// frame's number in the run, counting from 1.
+template <typename Format, typename Orientation>
+void accumulate(uint8_t const *data, StreamInfo const &info, unsigned int n, float *master)
+{
+	constexpr unsigned int step = std::max(ACROSS_STEP / Format::BIN, 1u);
+	const Planes f = Format::Prepare(data, info);
+	const unsigned int bins = Orientation::Along(info) / Format::BIN;
+	const unsigned int across = Orientation::Across(info) / Format::BIN;
+	const float w = 1.0f / n;
+	unsigned int saturated = 0;
+	for (unsigned int j = 0; j < across; j += step)
+	{
+		float *m = master + (size_t)(j / step) * bins * 3;
+		for (unsigned int i = 0; i < bins; i++, m += 3)
+		{
+			auto v = Orientation::template Sample<Format>(f, i, j, saturated);
+			for (unsigned int c = 0; c < 3; c++)
+				m[c] += w * (v.c[c] - m[c]);
+		}
+	}
+}
+
+} // namespace spectrum_kernels
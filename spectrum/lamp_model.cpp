@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * lamp_model.cpp - what a calibration lamp gives out, wavelength by wavelength.
+ */
+
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+
+#include "spectrum/lamp_model.hpp"
+
+// hc/k, in nm K, for Planck's law.
+#define SECOND_RADIATION_CONSTANT 1.4387769e7
+
+LampModel::LampModel() : temperature_(3000)
+{
+}
+
+void LampModel::SetTemperature(double kelvin)
+{
+	if (kelvin <= 0)
+		throw std::runtime_error("lamp temperature must be positive");
+	temperature_ = kelvin;
+	table_wavelengths_.clear();
+	table_values_.clear();
+}
+
+void LampModel::LoadTable(std::string const &filename)
+{
+	std::ifstream file(filename);
+	if (!file)
+		throw std::runtime_error("failed to open lamp spectrum " + filename);
+	std::vector<double> wavelengths, values;
+	double wavelength, value;
+	while (file >> wavelength >> value)
+	{
+		if (!wavelengths.empty() && wavelength <= wavelengths.back())
+			throw std::runtime_error("lamp spectrum " + filename + " isn't in increasing wavelength");
+		wavelengths.push_back(wavelength);
+		values.push_back(value);
+	}
+	if (wavelengths.size() < 2)
+		throw std::runtime_error("lamp spectrum " + filename + " has too few points");
+	table_wavelengths_ = std::move(wavelengths);
+	table_values_ = std::move(values);
+}
+
+// Only relative radiance matters, so Planck's law drops its constant factor: 1 / (wl^5
+// (exp(hc / wl k T) - 1)), scaled to stay well inside a float.
+void LampModel::Sample(double b, double c, unsigned int width, float *out) const
+{
+	if (table_wavelengths_.empty())
+	{
+		const double a = SECOND_RADIATION_CONSTANT / temperature_;
+		for (unsigned int x = 0; x < width; x++)
+		{
+			const double wl = (x - c) / b;
+			out[x] = wl > 0 ? 1e15 / (pow(wl, 5) * expm1(a / wl)) : 0;
+		}
+		return;
+	}
+
+	// Walk the table alongside the bins, whichever way the wavelengths run.
+	const size_t n = table_wavelengths_.size();
+	size_t i = 0;
+	for (unsigned int k = 0; k < width; k++)
+	{
+		const unsigned int x = b > 0 ? k : width - 1 - k;
+		const double wl = (x - c) / b;
+		while (i + 2 < n && table_wavelengths_[i + 1] < wl)
+			i++;
+		if (wl < table_wavelengths_[0] || wl > table_wavelengths_[n - 1])
+			out[x] = 0;
+		else
+		{
+			const double f = (wl - table_wavelengths_[i]) / (table_wavelengths_[i + 1] - table_wavelengths_[i]);
+			out[x] = table_values_[i] + f * (table_values_[i + 1] - table_values_[i]);
+		}
+	}
+}
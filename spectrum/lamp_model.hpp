@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * lamp_model.hpp - what a calibration lamp gives out, wavelength by wavelength.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// The relative spectral radiance of the continuum lamp used to find the spectroscope's
+// response: either a blackbody at the lamp's colour temperature, or a table such as a
+// lamp's calibration certificate gives.
+class LampModel
+{
+public:
+	// A 3000K blackbody.
+	LampModel();
+	void SetTemperature(double kelvin);
+	// Lines of a wavelength in nm and the radiance there, in increasing wavelength. Throws
+	// if the file can't be read or doesn't hold at least two points.
+	void LoadTable(std::string const &filename);
+	// The radiance at each of width bins, bin x being at (x - c) / b nm. Outside a table
+	// it is 0.
+	void Sample(double b, double c, unsigned int width, float *out) const;
+
+private:
+	double temperature_;
+	std::vector<double> table_wavelengths_; // empty for a blackbody
+	std::vector<double> table_values_;
+};
@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * line_database.cpp - emission lines of the elements, to identify peaks by.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+#include "spectrum/line_database.hpp"
+
+static const struct
+{
+	const char *species;
+	float wavelength;
+} BUILTIN_LINES[] = {
+	{ "H", 397.007 },	{ "H", 410.174 },	{ "H", 434.047 },	{ "H", 486.135 },	{ "H", 656.279 },
+	{ "He", 388.865 },	{ "He", 447.148 },	{ "He", 471.314 },	{ "He", 492.193 },	{ "He", 501.568 },
+	{ "He", 587.562 },	{ "He", 667.815 },	{ "He", 706.519 },	{ "He", 728.135 },	{ "Na", 588.995 },
+	{ "Na", 589.592 },	{ "Na", 818.326 },	{ "Na", 819.482 },	{ "Hg", 365.015 },	{ "Hg", 404.656 },
+	{ "Hg", 407.783 },	{ "Hg", 435.833 },	{ "Hg", 546.074 },	{ "Hg", 576.960 },	{ "Hg", 579.066 },
+	{ "Ne", 540.056 },	{ "Ne", 585.249 },	{ "Ne", 588.190 },	{ "Ne", 594.483 },	{ "Ne", 597.553 },
+	{ "Ne", 602.999 },	{ "Ne", 607.434 },	{ "Ne", 609.616 },	{ "Ne", 614.306 },	{ "Ne", 616.359 },
+	{ "Ne", 621.728 },	{ "Ne", 626.650 },	{ "Ne", 630.479 },	{ "Ne", 633.443 },	{ "Ne", 638.299 },
+	{ "Ne", 640.225 },	{ "Ne", 650.653 },	{ "Ne", 653.288 },	{ "Ne", 659.895 },	{ "Ne", 667.828 },
+	{ "Ne", 671.704 },	{ "Ne", 692.947 },	{ "Ne", 703.241 },	{ "Ne", 717.394 },	{ "Ne", 724.517 },
+	{ "Ne", 743.890 },	{ "Ar", 696.543 },	{ "Ar", 706.722 },	{ "Ar", 714.704 },	{ "Ar", 727.294 },
+	{ "Ar", 738.398 },	{ "Ar", 750.387 },	{ "Ar", 751.465 },	{ "Ar", 763.511 },	{ "Ar", 772.376 },
+	{ "Ar", 794.818 },	{ "Ar", 800.616 },	{ "Ar", 801.479 },	{ "Ar", 810.369 },	{ "Ar", 811.531 },
+	{ "Ar", 826.452 },	{ "Ar", 840.821 },	{ "Ar", 842.465 },	{ "Ar", 852.144 },	{ "Ar", 866.794 },
+	{ "Ar", 912.297 },	{ "Ar", 922.450 },	{ "Kr", 557.029 },	{ "Kr", 587.092 },	{ "Kr", 760.155 },
+	{ "Kr", 810.437 },	{ "Kr", 811.290 },	{ "Kr", 819.005 },	{ "Kr", 826.324 },	{ "Kr", 829.811 },
+	{ "Xe", 467.123 },	{ "Xe", 823.163 },	{ "Xe", 828.012 },	{ "Xe", 881.941 },
+	// Peaks of the phosphors, as a fluorescent lamp shows them, rather than single lines.
+	{ "Tb3+", 486.7 },	{ "Tb3+", 542.5 },	{ "Tb3+", 586.2 },	{ "Eu3+", 610.4 },
+};
+
+LineDatabase::LineDatabase()
+{
+	for (auto const &line : BUILTIN_LINES)
+		add(line.species, line.wavelength);
+	sort();
+}
+
+void LineDatabase::Load(std::string const &filename)
+{
+	std::ifstream file(filename);
+	if (!file)
+		throw std::runtime_error("failed to open line database " + filename);
+	std::vector<std::pair<std::string, float>> lines;
+	std::string text;
+	while (std::getline(file, text))
+	{
+		std::replace(text.begin(), text.end(), ',', ' ');
+		std::istringstream fields(text);
+		std::string species;
+		float wavelength;
+		if (!(fields >> species >> wavelength) || species[0] == '#')
+			continue;
+		if (wavelength <= 0)
+			throw std::runtime_error("line database " + filename + " has a bad wavelength: " + text);
+		lines.emplace_back(species, wavelength);
+	}
+	if (lines.empty())
+		throw std::runtime_error("line database " + filename + " has no lines");
+	wavelengths_.clear();
+	species_.clear();
+	names_.clear();
+	for (auto const &[species, wavelength] : lines)
+		add(species, wavelength);
+	sort();
+}
+
+int LineDatabase::Nearest(float wavelength, float tolerance) const
+{
+	const int above = std::lower_bound(wavelengths_.begin(), wavelengths_.end(), wavelength) - wavelengths_.begin();
+	int nearest = above;
+	if (above == (int)wavelengths_.size() ||
+		(above > 0 && wavelength - wavelengths_[above - 1] < wavelengths_[above] - wavelength))
+		nearest = above - 1;
+	if (nearest < 0 || std::abs(wavelengths_[nearest] - wavelength) > tolerance)
+		return -1;
+	return nearest;
+}
+
+std::vector<float> LineDatabase::Select(std::vector<std::string> const &species) const
+{
+	std::vector<float> wavelengths;
+	for (unsigned int i = 0; i < wavelengths_.size(); i++)
+		if (std::find(species.begin(), species.end(), names_[species_[i]]) != species.end())
+			wavelengths.push_back(wavelengths_[i]);
+	return wavelengths;
+}
+
+void LineDatabase::add(std::string const &species, float wavelength)
+{
+	auto name = std::find(names_.begin(), names_.end(), species);
+	if (name == names_.end())
+	{
+		if (names_.size() > UINT16_MAX)
+			throw std::runtime_error("line database has too many species");
+		name = names_.insert(name, species);
+	}
+	wavelengths_.push_back(wavelength);
+	species_.push_back(name - names_.begin());
+}
+
+void LineDatabase::sort()
+{
+	std::vector<unsigned int> order(wavelengths_.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(),
+					 [this](unsigned int a, unsigned int b) { return wavelengths_[a] < wavelengths_[b]; });
+	std::vector<float> wavelengths(order.size());
+	std::vector<uint16_t> species(order.size());
+	for (unsigned int i = 0; i < order.size(); i++)
+	{
+		wavelengths[i] = wavelengths_[order[i]];
+		species[i] = species_[order[i]];
+	}
+	wavelengths_ = std::move(wavelengths);
+	species_ = std::move(species);
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * line_database.hpp - emission lines of the elements, to identify peaks by.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Emission lines, indexed by wavelength. The wavelengths are kept in order in an array of
+// their own, so that a binary search for the nearest line touches nothing else; the
+// species of each is a small index into the names.
+class LineDatabase
+{
+public:
+	// Strong lines of the usual lamps (H, He, Ne, Na, Ar, Kr, Xe and Hg), and the bands of
+	// the terbium and europium phosphors of a fluorescent lamp. Wavelengths are in air.
+	LineDatabase();
+	// Lines of a species, such as "Hg" or "FeII", and a wavelength in nm, in any order and
+	// with anything after them ignored, replacing the lines there were. Lines starting with #
+	// are skipped. Throws if the file can't be read or has no lines.
+	void Load(std::string const &filename);
+
+	unsigned int Size() const { return wavelengths_.size(); }
+	float Wavelength(unsigned int line) const { return wavelengths_[line]; }
+	std::string const &Species(unsigned int line) const { return names_[species_[line]]; }
+	// The line nearest a wavelength, if it is within tolerance nm, or else -1.
+	int Nearest(float wavelength, float tolerance) const;
+	// The wavelengths of every line of these species, in order.
+	std::vector<float> Select(std::vector<std::string> const &species) const;
+
+private:
+	void add(std::string const &species, float wavelength);
+	void sort();
+
+	std::vector<float> wavelengths_;
+	std::vector<uint16_t> species_;
+	std::vector<std::string> names_;
+};
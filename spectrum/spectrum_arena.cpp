@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spectrum_arena.cpp - one block of memory for all of a configuration's spectral buffers.
+ */
+
+#include <sys/mman.h>
+
+#include <stdexcept>
+#include <string>
+
+#include "core/logging.hpp"
+#include "spectrum/spectrum_arena.hpp"
+
+// Arenas at least this big are worth putting in huge pages.
+#define HUGE_PAGE_SIZE (2u << 20)
+
+SpectrumArena::SpectrumArena() : base_(nullptr), capacity_(0), used_(0), huge_(false)
+{
+}
+
+SpectrumArena::~SpectrumArena()
+{
+	release();
+}
+
+void SpectrumArena::release()
+{
+	if (base_)
+		munmap(base_, capacity_);
+	base_ = nullptr;
+	capacity_ = 0;
+}
+
+bool SpectrumArena::Reserve(size_t bytes)
+{
+	used_ = 0;
+	if (bytes <= capacity_)
+		return false;
+
+	release();
+	size_t size = bytes >= HUGE_PAGE_SIZE ? (bytes + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1) : bytes;
+	void *mem = MAP_FAILED;
+	huge_ = false;
+	if (size >= HUGE_PAGE_SIZE)
+	{
+		// Explicit huge pages only exist if someone has reserved them, so fall back to
+		// asking for transparent ones.
+		mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		huge_ = mem != MAP_FAILED;
+	}
+	if (mem == MAP_FAILED)
+	{
+		mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			throw std::runtime_error("failed to map " + std::to_string(size) + " bytes for the spectrum");
+		if (size >= HUGE_PAGE_SIZE)
+			huge_ = madvise(mem, size, MADV_HUGEPAGE) == 0;
+	}
+	base_ = static_cast<uint8_t *>(mem);
+	capacity_ = size;
+	LOG(2, "Spectrum arena of " << size << " bytes" << (huge_ ? " in huge pages" : ""));
+	return true;
+}
+
+void *SpectrumArena::take(size_t bytes)
+{
+	bytes = Aligned(bytes);
+	if (used_ + bytes > capacity_)
+		throw std::runtime_error("spectrum arena exhausted");
+	void *p = base_ + used_;
+	used_ += bytes;
+	return p;
+}
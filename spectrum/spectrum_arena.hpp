@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spectrum_arena.hpp - one block of memory for all of a configuration's spectral buffers.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The spectral buffers for a stream configuration are carved out of a single mapping,
+// each starting on its own cache line so that threads writing neighbouring buffers don't
+// share lines. Big arenas are backed by huge pages where the kernel allows it. The
+// mapping only ever grows, so a camera that restarts with the same configuration, or a
+// smaller one, gets the same memory back.
+class SpectrumArena
+{
+public:
+	static constexpr size_t CACHE_LINE = 64;
+
+	SpectrumArena();
+	~SpectrumArena();
+	SpectrumArena(SpectrumArena const &) = delete;
+	SpectrumArena &operator=(SpectrumArena const &) = delete;
+
+	// Make sure there are at least this many bytes and start handing them out again from
+	// the beginning. Returns true if the memory moved, when everything Take gave out
+	// before is gone.
+	bool Reserve(size_t bytes);
+	// The next count Ts, zeroed when the arena was mapped. Throws if there isn't room.
+	template <typename T>
+	T *Take(size_t count)
+	{
+		return static_cast<T *>(take(count * sizeof(T)));
+	}
+
+	// What to Reserve for buffers of the given sizes, each rounded up to a cache line.
+	static size_t Aligned(size_t bytes) { return (bytes + CACHE_LINE - 1) & ~(CACHE_LINE - 1); }
+	size_t Capacity() const { return capacity_; }
+	bool HugePages() const { return huge_; }
+
+private:
+	void *take(size_t bytes);
+	void release();
+
+	uint8_t *base_;
+	size_t capacity_;
+	size_t used_;
+	bool huge_;
+};
@@ -0,0 +1,1473 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spectrum_engine.cpp - turn spectroscope frames into calibrated spectra.
+ */
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gsl/gsl_fit.h>
+
+#include <libcamera/formats.h>
+
+#include "core/logging.hpp"
+#include "spectrum/extract_kernels.hpp"
+#include "spectrum/spectrum_engine.hpp"
+
+// Y, U and V for each unit of R, G and B, which is how much of each YUV channel to take
+// for given proportions of red, green and blue.
+#define RY 1.0
+#define RU 0.0
+#define RV 1.4075
+
+#define GY 1.0
+#define GU -0.3455
+#define GV -0.7169
+
+#define BY 1.0
+#define BU 1.779
+#define BV 0.0
+
+// FindSlope's search.
+#define SLOPE_STEP 0.01
+#define SLOPE_MIN_STEP 0.0001
+#define SLOPE_MAX_ITERATIONS 20
+// Savitzky-Golay windows (of order 2) for the derivative FindSlope climbs, and for smoothing
+// spectra before looking for peaks in them.
+#define SLOPE_DERIVATIVE_WINDOW 5
+#define PEAK_SMOOTHING_WINDOW 7
+// A peak must stand PEAK_PROMINENCE of the largest value of the smoothed spectrum, less its
+// baseline, above the higher of the lowest points within PEAK_WINDOW bins either side of it,
+// and PEAK_NOISE standard deviations of the noise in a bin. Once the continuum is off, the
+// largest value can be little more than the noise.
+#define PEAK_PROMINENCE 0.02f
+#define PEAK_NOISE 5.0f
+#define PEAK_WINDOW 16
+// ParsePeaks lines up every pair of the FIT_PEAKS highest peaks with every pair of
+// calibration lines, for fits of FIT_MIN_DISPERSION to FIT_MAX_DISPERSION bins per nm, and
+// keeps the fit that puts the most peaks within FIT_TOLERANCE nm of a line. It needs
+// FIT_MIN_LINES of them.
+#define FIT_PEAKS 8
+#define FIT_MIN_DISPERSION 0.2
+#define FIT_MAX_DISPERSION 50.0
+#define FIT_TOLERANCE 2.0
+#define FIT_MIN_LINES 3
+
+// The lamp calibration smooths the lamp with a Savitzky-Golay filter of this window before
+// dividing by it. The division is regularised by LAMP_EPSILON of the lamp's peak, and bins
+// where the lamp has less than LAMP_MIN of it aren't calibrated at all. The largest
+// correction is scaled to LAMP_SCALE.
+#define LAMP_SMOOTHING_WINDOW 9
+#define LAMP_EPSILON 0.01f
+#define LAMP_MIN 0.02f
+#define LAMP_SCALE 500.0f
+
+// Transmittance is only worked out where the reference has more than REFERENCE_MIN of its
+// peak, and absorbance goes no higher than -log10(TRANSMITTANCE_MIN).
+#define REFERENCE_MIN 0.02f
+#define TRANSMITTANCE_MIN 1e-4f
+
+// Optimal extraction's profile: sampled from every PROFILE_BIN_STEP-th bin, averaged with
+// this weight for the newest frame, and turned into row weights every PROFILE_FRAMES frames.
+// Positions with less than PROFILE_MIN of the peak brightness aren't read at all.
+#define PROFILE_BIN_STEP 16
+#define PROFILE_ALPHA (1.0f / 16)
+#define PROFILE_FRAMES 32
+#define PROFILE_MIN 0.01f
+
+// The master darks and flats are blended again when the exposure or gain moves by more
+// than this fraction. A flat's gains come from comparing each pixel with the mean of those
+// FLAT_SMOOTH either side along the spectrum; pixels with less than FLAT_MIN of the
+// brightest aren't corrected.
+#define CORRECTION_TOLERANCE 0.02f
+#define FLAT_SMOOTH 8
+#define FLAT_MIN 0.05f
+// A pixel is hot if it is further above the median of a master dark than HOT_SIGMA
+// standard deviations and HOT_MIN levels. The deviation is judged from the 84th
+// percentile, which holds up where many pixels read zero and the rest only go upwards.
+#define HOT_SIGMA 8.0f
+#define HOT_MIN 8.0f
+
+static char const slopeFileName[] = "calSlope.txt";
+static char const incandescentFileName[] = "calIncandescent.txt";
+// The averaged lamp, less its dark, that the incandescent calibration came from.
+static char const lampFileName[] = "calLamp.txt";
+static char const darkFileName[] = "calDark.txt";
+static char const wavelengthFileName[] = "calWavelength.txt";
+// Per-bin channel weights, three to a line.
+static char const channelsFileName[] = "calChannels.txt";
+// The profile across the band for optimal extraction, with its variance, two to a line.
+static char const profileFileName[] = "calProfile.txt";
+// The reference for transmittance and the dark it was taken with, two to a line.
+static char const blankFileName[] = "calBlank.txt";
+// The master darks and flats: their sizes and then a line for each, "dark" or "flat" with
+// its exposure, gain and number of frames. The data is in binary files of its own.
+static char const mastersFileName[] = "calMasters.txt";
+// The hot pixels: the size of the masters, then the position across the frame and the bin
+// of each.
+static char const hotPixelsFileName[] = "calHotPixels.txt";
+
+using namespace spectrum_kernels;
+
+// log10 of a positive, normal x, to about 1e-7, in a form the compiler can vectorise. x is
+// m * 2^e with m between sqrt(1/2) and sqrt(2), and ln m = 2 atanh((m - 1) / (m + 1)), whose
+// series converges quickly that close to 1.
+static inline float fast_log10(float x)
+{
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	const int32_t e = (int32_t)(bits - 0x3f3504f3) >> 23; // 0x3f3504f3 is sqrt(1/2)
+	bits -= (uint32_t)e << 23;
+	float m;
+	memcpy(&m, &bits, sizeof(m));
+	const float t = (m - 1) / (m + 1), t2 = t * t;
+	const float ln = 2 * t * (1 + t2 * (1 / 3.0f + t2 * (1 / 5.0f + t2 * (1 / 7.0f)))) + e * 0.69314718f;
+	return ln * 0.43429448f;
+}
+namespace formats = libcamera::formats;
+
+// Track 0's calibrations keep the names they always had; the others add their number.
+static std::string cal_file_name(char const *name, unsigned int track)
+{
+	std::string file = name;
+	if (track)
+		file.insert(file.rfind('.'), std::to_string(track));
+	return file;
+}
+
+struct KernelChoice
+{
+	SpectrumEngine::Kernel kernel;
+	SpectrumEngine::ProfileKernel profile;
+	SpectrumEngine::AccumulateKernel accumulate;
+	unsigned int bin; // pixels per bin
+	unsigned int step; // pixels between positions read across the band
+	bool integer; // can accumulate in integers
+	bool yuv; // channels are Y, U and V
+};
+
+template <typename Format, typename Orientation>
+static KernelChoice choose()
+{
+	return { &extract<Format, Orientation>, &profile<Format, Orientation>, &accumulate<Format, Orientation>,
+			 Format::BIN, std::max(ACROSS_STEP / Format::BIN, 1u), Format::INTEGER, Format::YUV };
+}
+
+template <typename Orientation>
+static KernelChoice kernel_for(libcamera::PixelFormat const &format)
+{
+	if (format == formats::YUV420)
+		return choose<Yuv420, Orientation>();
+	else if (format == formats::YUYV)
+		return choose<Yuyv, Orientation>();
+	else if (format == formats::RGB888)
+		return choose<Rgb888, Orientation>();
+	else if (format == formats::SBGGR10_CSI2P)
+		return choose<Bayer<Unpack10P>, Orientation>();
+	else if (format == formats::SBGGR12_CSI2P)
+		return choose<Bayer<Unpack12P>, Orientation>();
+	else if (format == formats::SBGGR16)
+		return choose<Bayer<Unpack16>, Orientation>();
+	return { nullptr, nullptr, nullptr, 1, 1, false, false };
+}
+
+SpectrumEngine::SpectrumEngine()
+	: orientation_(Orientation::Horizontal), kernel_(nullptr), profile_kernel_(nullptr), accumulate_kernel_(nullptr),
+	  integer_(false), yuv_(false), width_(0), positions_(0), step_(1), threads_(4), pin_(false), saturated_(0),
+	  weights_ { 1, 1, 1 }, extraction_(Extraction::Box), profile_(nullptr), profile_variance_(nullptr),
+	  row_means_(nullptr), profile_frames_(0), capture_into_(nullptr), capture_left_(0), exposure_(0), gain_(1),
+	  correction_exposure_(0), correction_gain_(1), correction_stale_(true), spike_window_(0), spike_sigma_(5),
+	  spikes_(0), derivative_(SpectrumFilter::SavitzkyGolay(SLOPE_DERIVATIVE_WINDOW, 2, 1)),
+	  peak_smoothing_(SpectrumFilter::SavitzkyGolay(PEAK_SMOOTHING_WINDOW, 2)), identify_lines_(false),
+	  line_tolerance_(1), calibration_species_ { "Hg", "Tb3+", "Eu3+" }, lamp_frames_(0), lamp_left_(0),
+	  response_stale_(false), lamp_smoothing_(SpectrumFilter::SavitzkyGolay(LAMP_SMOOTHING_WINDOW, 2)),
+	  measurement_(Measurement::Intensity), blank_frames_(0), blank_left_(0), colorimetry_(false)
+{
+	calibration_lines_ = lines_.Select(calibration_species_);
+}
+
+void SpectrumEngine::SetOrientation(Orientation orientation)
+{
+	if (orientation != orientation_)
+		kernel_ = nullptr;
+	orientation_ = orientation;
+}
+
+void SpectrumEngine::SetTracks(std::vector<Band> const &bands)
+{
+	bands_ = bands;
+	kernel_ = nullptr;
+}
+
+bool SpectrumEngine::Configure(StreamInfo const &info)
+{
+	if (kernel_ && info.width == info_.width && info.height == info_.height && info.pixel_format == info_.pixel_format)
+		return false;
+
+	const bool horizontal = orientation_ == Orientation::Horizontal;
+	KernelChoice choice =
+		horizontal ? kernel_for<Horizontal>(info.pixel_format) : kernel_for<Vertical>(info.pixel_format);
+	if (!choice.kernel)
+		throw std::runtime_error("SpectrumEngine: can't read pixel format " + info.pixel_format.toString());
+	const unsigned int across = (horizontal ? info.height : info.width) / choice.bin;
+	std::vector<Band> bands = bands_;
+	if (bands.empty())
+		bands.push_back({ 0, across * choice.bin });
+	for (Band const &band : bands)
+	{
+		if (band.begin >= band.end || band.end > across * choice.bin)
+			throw std::runtime_error("SpectrumEngine: track " + std::to_string(band.begin) + "-" +
+									 std::to_string(band.end) + " isn't inside the frame");
+	}
+	kernel_ = choice.kernel;
+	profile_kernel_ = choice.profile;
+	accumulate_kernel_ = choice.accumulate;
+	integer_ = choice.integer;
+	yuv_ = choice.yuv;
+	info_ = info;
+	width_ = (horizontal ? info.width : info.height) / choice.bin;
+	step_ = choice.step;
+	positions_ = (across + step_ - 1) / step_;
+	LOG(2, "SpectrumEngine: " << bands.size() << " tracks of " << width_ << " bins from " << info.width << "x"
+							  << info.height << " " << info.pixel_format.toString() << (horizontal ? "" : " vertical"));
+
+	const size_t bytes = SpectrumArena::Aligned(width_ * sizeof(float));
+	const size_t position_bytes = SpectrumArena::Aligned(positions_ * sizeof(float));
+	arena_.Reserve(bands.size() * (18 * bytes + 2 * position_bytes) + 3 * position_bytes);
+	tracks_.assign(bands.size(), Track());
+	for (unsigned int t = 0; t < tracks_.size(); t++)
+	{
+		Track &track = tracks_[t];
+		// Positions are read every step_ from the top of the frame, whichever track they are in.
+		track.end = std::max(bands[t].end / choice.bin, bands[t].begin / choice.bin + 1);
+		track.begin = std::min((bands[t].begin / choice.bin + step_ - 1) / step_, (track.end - 1) / step_) * step_;
+		track.slope = 0;
+		track.label_b = 1;
+		track.label_c = 0;
+		track.spectrum = arena_.Take<float>(width_);
+		track.subtracted = arena_.Take<float>(width_);
+		track.dark = arena_.Take<float>(width_);
+		track.incandescent = arena_.Take<float>(width_);
+		track.lamp = arena_.Take<float>(width_);
+		track.lamp_reference = arena_.Take<float>(width_);
+		track.have_lamp = false;
+		track.reference_b = NAN;
+		track.reference_c = NAN;
+		track.blank = arena_.Take<float>(width_);
+		track.blank_dark = arena_.Take<float>(width_);
+		track.blank_inverse = arena_.Take<float>(width_);
+		track.have_blank = false;
+		track.colour_b = NAN;
+		track.colour.valid = false;
+		track.peaks.clear();
+		track.peaks.reserve(width_ / 2);
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			track.channels[c] = arena_.Take<float>(width_);
+			track.integer_channels[c] = arena_.Take<uint32_t>(width_);
+			track.bin_weights[c] = arena_.Take<float>(width_);
+			std::fill(track.channels[c], track.channels[c] + width_, 0.0f);
+			std::fill(track.bin_weights[c], track.bin_weights[c] + width_, 1.0f);
+		}
+		std::fill(track.spectrum, track.spectrum + width_, 0.0f);
+		std::fill(track.subtracted, track.subtracted + width_, 0.0f);
+		std::fill(track.dark, track.dark + width_, 0.0f);
+		std::fill(track.incandescent, track.incandescent + width_, 1.0f);
+		track.rows = arena_.Take<uint32_t>(positions_);
+		track.row_weights = arena_.Take<float>(positions_);
+		track.num_rows = 0;
+	}
+	profile_ = arena_.Take<float>(positions_);
+	profile_variance_ = arena_.Take<float>(positions_);
+	row_means_ = arena_.Take<float>(positions_);
+	profile_frames_ = 0;
+	darks_.clear();
+	flats_.clear();
+	capture_left_ = 0;
+	lamp_left_ = 0;
+	response_stale_ = false;
+	blank_left_ = 0;
+	correction_.clear();
+	correction_stale_ = true;
+	hot_pixels_.clear();
+	spike_filters_.resize(tracks_.size());
+	for (SpikeFilter &filter : spike_filters_)
+		filter.Reset(width_, spike_window_);
+	spikes_ = 0;
+	baselines_.resize(tracks_.size());
+	for (BaselineEstimator &baseline : baselines_)
+		baseline.Reset(width_, baseline_config_);
+	return true;
+}
+
+void SpectrumEngine::SetExposure(float exposure, float gain)
+{
+	exposure_ = exposure;
+	gain_ = gain > 0 ? gain : 1;
+}
+
+void SpectrumEngine::SetSpikeRejection(unsigned int window, float sigma)
+{
+	spike_window_ = window;
+	spike_sigma_ = sigma;
+	for (SpikeFilter &filter : spike_filters_)
+		filter.Reset(width_, spike_window_);
+}
+
+void SpectrumEngine::SetBaseline(BaselineEstimator::Config const &config)
+{
+	baseline_config_ = config;
+	for (BaselineEstimator &baseline : baselines_)
+		baseline.Reset(width_, baseline_config_);
+}
+
+void SpectrumEngine::CaptureDarkFrames(unsigned int frames)
+{
+	capture_ = { exposure_, gain_, 0, std::vector<float>((size_t)positions_ * width_ * 3, 0.0f) };
+	capture_into_ = &darks_;
+	capture_left_ = frames;
+}
+
+void SpectrumEngine::CaptureFlatFrames(unsigned int frames)
+{
+	capture_ = { exposure_, gain_, 0, std::vector<float>((size_t)positions_ * width_ * 3, 0.0f) };
+	capture_into_ = &flats_;
+	capture_left_ = frames;
+}
+
+void SpectrumEngine::capture(uint8_t const *pixels, StreamInfo const &info)
+{
+	accumulate_kernel_(pixels, info, ++capture_.frames, capture_.data.data());
+	if (--capture_left_)
+		return;
+
+	const bool flat = capture_into_ == &flats_;
+	std::vector<float> dark;
+	if (flat && blend(darks_, dark))
+	{
+		for (size_t s = 0; s < dark.size(); s++)
+			capture_.data[s] -= dark[s];
+	}
+	// It replaces any master there was for the same exposure and gain.
+	auto same = [this](Master const &master) {
+		return fabsf(master.exposure - capture_.exposure) <= CORRECTION_TOLERANCE * capture_.exposure &&
+			   fabsf(master.gain - capture_.gain) <= CORRECTION_TOLERANCE * capture_.gain;
+	};
+	capture_into_->erase(std::remove_if(capture_into_->begin(), capture_into_->end(), same), capture_into_->end());
+	capture_into_->push_back(std::move(capture_));
+	if (!flat)
+		learnHotPixels(capture_into_->back());
+	correction_stale_ = true;
+	LOG(1, "Master " << (flat ? "flat" : "dark") << " of " << capture_into_->back().frames << " frames at "
+					 << capture_into_->back().exposure << "us gain " << capture_into_->back().gain);
+}
+
+// Of the masters at the gain nearest ours, interpolate between those with the exposures
+// either side of ours, or take the nearest if they are all on one side.
+bool SpectrumEngine::blend(std::vector<Master> const &masters, std::vector<float> &out) const
+{
+	if (masters.empty())
+		return false;
+	float nearest = INFINITY;
+	for (Master const &master : masters)
+		nearest = std::min(nearest, fabsf(logf(master.gain / gain_)));
+	Master const *below = nullptr, *above = nullptr;
+	for (Master const &master : masters)
+	{
+		if (fabsf(logf(master.gain / gain_)) > nearest + CORRECTION_TOLERANCE)
+			continue;
+		if (master.exposure <= exposure_ && (!below || master.exposure > below->exposure))
+			below = &master;
+		if (master.exposure >= exposure_ && (!above || master.exposure < above->exposure))
+			above = &master;
+	}
+	if (!below)
+		below = above;
+	if (!above)
+		above = below;
+	const float t =
+		above->exposure > below->exposure ? (exposure_ - below->exposure) / (above->exposure - below->exposure) : 0;
+	out.resize(below->data.size());
+	for (size_t s = 0; s < out.size(); s++)
+		out[s] = below->data[s] + t * (above->data[s] - below->data[s]);
+	return true;
+}
+
+// Hot pixels are added to those found before; only clearing the calibrations forgets them.
+void SpectrumEngine::learnHotPixels(Master const &dark)
+{
+	const size_t samples = (size_t)positions_ * width_;
+	std::vector<float> level(samples);
+	for (size_t s = 0; s < samples; s++)
+	{
+		float const *d = &dark.data[s * 3];
+		level[s] = yuv_ ? d[0] : d[0] + d[1] + d[2];
+	}
+	std::vector<float> sorted = level;
+	const size_t percentile = std::min((size_t)(samples * 0.8413), samples - 1);
+	auto median = sorted.begin() + samples / 2, sigma = sorted.begin() + percentile;
+	std::nth_element(sorted.begin(), median, sorted.end());
+	std::nth_element(median, sigma, sorted.end());
+	const float threshold = *median + std::max(HOT_SIGMA * (*sigma - *median), HOT_MIN);
+
+	for (size_t s = 0; s < samples; s++)
+	{
+		if (level[s] > threshold)
+			hot_pixels_.push_back(s);
+	}
+	std::sort(hot_pixels_.begin(), hot_pixels_.end());
+	hot_pixels_.erase(std::unique(hot_pixels_.begin(), hot_pixels_.end()), hot_pixels_.end());
+	LOG(1, hot_pixels_.size() << " hot pixels");
+}
+
+void SpectrumEngine::updateCorrection()
+{
+	if (!correction_stale_ && fabsf(exposure_ - correction_exposure_) <= CORRECTION_TOLERANCE * correction_exposure_ &&
+		fabsf(gain_ - correction_gain_) <= CORRECTION_TOLERANCE * correction_gain_)
+		return;
+	correction_stale_ = false;
+	correction_exposure_ = exposure_;
+	correction_gain_ = gain_;
+
+	std::vector<float> dark, flat;
+	const bool have_dark = blend(darks_, dark), have_flat = blend(flats_, flat);
+	if (!have_dark && !have_flat && hot_pixels_.empty())
+	{
+		correction_.clear();
+		return;
+	}
+	const size_t samples = (size_t)positions_ * width_;
+	correction_.resize(samples * 6);
+	for (size_t s = 0; s < samples; s++)
+	{
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			correction_[s * 6 + c] = have_dark ? dark[s * 3 + c] : 0;
+			correction_[s * 6 + 3 + c] = 1;
+		}
+	}
+	// The chroma of a YUV frame is too faint to make a flat of.
+	const unsigned int channels = have_flat ? (yuv_ ? 1 : 3) : 0;
+	std::vector<double> sums(width_ + 1);
+	for (unsigned int c = 0; c < channels; c++)
+	{
+		float max = 0;
+		for (size_t s = 0; s < samples; s++)
+			max = std::max(max, flat[s * 3 + c]);
+		for (unsigned int k = 0; k < positions_; k++)
+		{
+			float const *row = &flat[(size_t)k * width_ * 3];
+			for (unsigned int p = 0; p < width_; p++)
+				sums[p + 1] = sums[p] + row[p * 3 + c];
+			for (unsigned int p = 0; p < width_; p++)
+			{
+				if (row[p * 3 + c] <= FLAT_MIN * max)
+					continue;
+				unsigned int lo = p > FLAT_SMOOTH ? p - FLAT_SMOOTH : 0, hi = std::min(p + FLAT_SMOOTH + 1, width_);
+				float mean = (sums[hi] - sums[lo]) / (hi - lo);
+				correction_[((size_t)k * width_ + p) * 6 + 3 + c] = mean / row[p * 3 + c];
+			}
+		}
+	}
+	// The nearest position across the same track that the track reads, and that isn't hot
+	// too, stands in for each hot pixel, with its gain scaled as the row weights differ.
+	// Without one there is no other light in the track's bin to make up the hot pixel's
+	// share from, and it is simply left out.
+	std::vector<unsigned int> reads;
+	std::vector<float> read_weights;
+	for (uint32_t s : hot_pixels_)
+	{
+		const unsigned int k = s / width_, p = s % width_;
+		size_t neighbour = s;
+		float scale = 0;
+		for (Track const &track : tracks_)
+		{
+			if (k * step_ < track.begin || k * step_ >= track.end)
+				continue;
+			readPositions(track, reads, read_weights);
+			const unsigned int self = std::find(reads.begin(), reads.end(), k) - reads.begin();
+			if (self == reads.size())
+				break;
+			for (unsigned int r = 0; r < reads.size(); r++)
+			{
+				const size_t other = (size_t)reads[r] * width_ + p;
+				if (r == self || std::binary_search(hot_pixels_.begin(), hot_pixels_.end(), other))
+					continue;
+				if (neighbour == s || std::abs((int)reads[r] - (int)k) < std::abs((int)(neighbour / width_) - (int)k))
+				{
+					neighbour = other;
+					scale = read_weights[self] / read_weights[r];
+				}
+			}
+			break;
+		}
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			if (neighbour != s)
+				correction_[neighbour * 6 + 3 + c] += scale * correction_[s * 6 + 3 + c];
+			correction_[s * 6 + 3 + c] = 0;
+		}
+	}
+	LOG(2, "Pixel correction for " << exposure_ << "us gain " << gain_ << (have_dark ? ", dark" : "")
+								   << (have_flat ? ", flat" : "") << ", " << hot_pixels_.size() << " hot pixels");
+}
+
+// The positions across the frame that extraction reads for a track, and their weights.
+void SpectrumEngine::readPositions(Track const &track, std::vector<unsigned int> &positions,
+								   std::vector<float> &weights) const
+{
+	positions.clear();
+	weights.clear();
+	if (extraction_ == Extraction::Optimal && track.num_rows)
+	{
+		for (unsigned int k = 0; k < track.num_rows; k++)
+		{
+			positions.push_back(track.rows[k] / step_);
+			weights.push_back(track.row_weights[k]);
+		}
+		return;
+	}
+	for (unsigned int j = track.begin; j < track.end; j += step_)
+	{
+		positions.push_back(j / step_);
+		weights.push_back(1);
+	}
+}
+
+void SpectrumEngine::SetExtraction(Extraction extraction)
+{
+	extraction_ = extraction;
+	correction_stale_ = true;
+}
+
+void SpectrumEngine::SetChannelWeights(float r, float g, float b)
+{
+	weights_[0] = r;
+	weights_[1] = g;
+	weights_[2] = b;
+}
+
+void SpectrumEngine::SetBinWeights(unsigned int channel, float const *weights, unsigned int track)
+{
+	float *bin_weights = tracks_[track].bin_weights[channel];
+	if (weights)
+		std::copy(weights, weights + width_, bin_weights);
+	else
+		std::fill(bin_weights, bin_weights + width_, 1.0f);
+}
+
+float SpectrumEngine::Combine()
+{
+	float w[3] = { weights_[0], weights_[1], weights_[2] };
+	if (yuv_)
+	{
+		w[0] = RY * weights_[0] + GY * weights_[1] + BY * weights_[2];
+		w[1] = RU * weights_[0] + GU * weights_[1] + BU * weights_[2];
+		w[2] = RV * weights_[0] + GV * weights_[1] + BV * weights_[2];
+	}
+	float max = 0;
+	for (Track &track : tracks_)
+	{
+		float const *c0 = track.channels[0], *c1 = track.channels[1], *c2 = track.channels[2];
+		float const *b0 = track.bin_weights[0], *b1 = track.bin_weights[1], *b2 = track.bin_weights[2];
+		float *spectrum = track.spectrum;
+		for (unsigned int x = 0; x < width_; x++)
+		{
+			spectrum[x] = w[0] * b0[x] * c0[x] + w[1] * b1[x] * c1[x] + w[2] * b2[x] * c2[x];
+			max = std::max(max, spectrum[x]);
+		}
+	}
+	return max;
+}
+
+void SpectrumEngine::SetThreads(unsigned int threads, bool pin)
+{
+	threads_ = std::max(threads, 1u);
+	pin_ = pin;
+}
+
+float SpectrumEngine::Extract(uint8_t const *pixels, StreamInfo const &info)
+{
+	if (extraction_ == Extraction::Optimal)
+		updateProfile(pixels, info);
+	if (capture_left_)
+		capture(pixels, info);
+	float max = extract(pixels, info);
+
+	spikes_ = 0;
+	if (spike_window_)
+	{
+		max = 0;
+		for (unsigned int t = 0; t < tracks_.size(); t++)
+		{
+			float *spectrum = tracks_[t].spectrum;
+			spikes_ += spike_filters_[t].Filter(spectrum, spike_sigma_);
+			max = std::max(max, *std::max_element(spectrum, spectrum + width_));
+		}
+	}
+	return max;
+}
+
+// What Extract does to the pixels, without learning anything from the frame, so that the
+// slope search can read the same frame many times.
+float SpectrumEngine::extract(uint8_t const *pixels, StreamInfo const &info)
+{
+	const unsigned int width = width_;
+	const unsigned int num_tracks = tracks_.size();
+	updateCorrection();
+	float const *correction = correction_.empty() ? nullptr : correction_.data();
+
+	// Each thread gets its own copy of every track, for its carries.
+	std::vector<TrackJob> track_jobs(threads_ * num_tracks);
+	for (unsigned int t = 0; t < num_tracks; t++)
+	{
+		Track &track = tracks_[t];
+		const bool weighted = extraction_ == Extraction::Optimal && track.num_rows;
+		// Whole bins can be summed exactly, and faster, in integers.
+		const bool integer = integer_ && track.slope == 0 && !weighted && !correction;
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			std::fill(track.channels[c], track.channels[c] + width, 0.0f);
+			if (integer)
+				std::fill(track.integer_channels[c], track.integer_channels[c] + width, 0);
+		}
+		TrackJob &track_job = track_jobs[t];
+		track_job.j0 = track.begin;
+		track_job.j1 = track.end;
+		track_job.slope = track.slope;
+		track_job.rows = weighted ? track.rows : nullptr;
+		track_job.weights = track.row_weights;
+		track_job.num_rows = track.num_rows;
+		track_job.output = track.channels;
+		track_job.integer_output = integer ? track.integer_channels : nullptr;
+		for (unsigned int i = 1; i < threads_; i++)
+			track_jobs[i * num_tracks + t] = track_job;
+	}
+
+	std::vector<Job> jobs(threads_);
+	std::vector<std::thread> threads;
+	const unsigned int cpus = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned int i = 0; i < threads_; i++)
+	{
+		Job &job = jobs[i];
+		job.data = pixels;
+		job.info = &info;
+		job.i0 = i * width / threads_;
+		job.i1 = (i + 1) * width / threads_;
+		job.tracks = &track_jobs[i * num_tracks];
+		job.num_tracks = num_tracks;
+		job.correction = correction;
+		threads.emplace_back([this, &job]() { kernel_(job); });
+		if (pin_)
+		{
+			cpu_set_t cpuset;
+			CPU_ZERO(&cpuset);
+			CPU_SET(i % cpus, &cpuset);
+			pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpuset), &cpuset);
+		}
+	}
+	for (auto &t : threads)
+		t.join();
+
+	saturated_ = 0;
+	for (unsigned int i = 0; i < threads_; i++)
+	{
+		saturated_ += jobs[i].saturated;
+		unsigned int x0 = jobs[i].i0;
+		for (unsigned int t = 0; t < num_tracks && x0 > 0; t++)
+		{
+			for (unsigned int c = 0; c < 3; c++)
+				tracks_[t].channels[c][x0 - 1] += jobs[i].tracks[t].carry[c];
+		}
+	}
+	for (unsigned int t = 0; t < num_tracks; t++)
+	{
+		if (!track_jobs[t].integer_output)
+			continue;
+		for (unsigned int c = 0; c < 3; c++)
+			std::copy(tracks_[t].integer_channels[c], tracks_[t].integer_channels[c] + width, tracks_[t].channels[c]);
+	}
+	return Combine();
+}
+
+void SpectrumEngine::updateProfile(uint8_t const *pixels, StreamInfo const &info)
+{
+	profile_kernel_(pixels, info, PROFILE_BIN_STEP, row_means_);
+	if (!profile_frames_)
+	{
+		std::copy(row_means_, row_means_ + positions_, profile_);
+		std::fill(profile_variance_, profile_variance_ + positions_, 0.0f);
+	}
+	else
+	{
+		for (unsigned int j = 0; j < positions_; j++)
+		{
+			const float d = row_means_[j] - profile_[j];
+			profile_[j] += PROFILE_ALPHA * d;
+			profile_variance_[j] = (1.0f - PROFILE_ALPHA) * (profile_variance_[j] + PROFILE_ALPHA * d * d);
+		}
+	}
+	if (profile_frames_++ % PROFILE_FRAMES == 0)
+	{
+		for (Track &track : tracks_)
+			computeRowWeights(track);
+	}
+}
+
+// With P the share of the track's light at each position and V its variance, the flux
+// is estimated as sum(P D / V) / sum(P^2 / V) over what each position reads, D. The
+// darkest position in the track is taken for the background. The variance of a
+// position's mean over the bins is in proportion to that of each pixel it reads, which
+// is all the weights need as its scale cancels; while there is none yet, all positions
+// get the same. The denominator is folded into the weights.
+void SpectrumEngine::computeRowWeights(Track &track)
+{
+	track.num_rows = 0;
+	// The hot pixels' stand-ins depend on the weights.
+	if (!hot_pixels_.empty())
+		correction_stale_ = true;
+	const unsigned int k0 = track.begin / step_, k1 = std::min((track.end + step_ - 1) / step_, positions_);
+	float const *profile = profile_ + k0, *variance = profile_variance_ + k0;
+	const unsigned int n = k1 - k0;
+	const float background = *std::min_element(profile, profile + n);
+	const float peak = *std::max_element(profile, profile + n) - background;
+	if (peak <= 0)
+		return;
+	double total = 0;
+	for (unsigned int k = 0; k < n; k++)
+		total += profile[k] - background;
+	// Keep V above zero without changing it where it was measured.
+	const float floor = std::max(*std::max_element(variance, variance + n) * 1e-3f, 1e-6f);
+	double norm = 0;
+	for (unsigned int k = 0; k < n; k++)
+	{
+		const float signal = profile[k] - background;
+		if (signal < PROFILE_MIN * peak)
+			continue;
+		const float p = signal / total;
+		const float v = variance[k] + floor;
+		track.rows[track.num_rows] = (k0 + k) * step_;
+		track.row_weights[track.num_rows++] = p / v;
+		norm += p * p / v;
+	}
+	for (unsigned int k = 0; k < track.num_rows; k++)
+		track.row_weights[k] /= norm;
+	LOG(2, "Optimal extraction reads " << track.num_rows << " of " << n << " positions across the track");
+}
+
+float SpectrumEngine::Differentiate(float const *data, unsigned int width)
+{
+	derivative_out_.resize(width);
+	derivative_.Apply(data, derivative_out_.data(), width);
+	float d = 0;
+	for (float v : derivative_out_)
+		d += v * v;
+	return d;
+}
+
+// Every track climbs at once, as each extraction gives a spectrum for all of them. The
+// spectra it scores aren't spike filtered, as the filter would pull the lines of a better
+// slope back towards those of the old one; its history is of the old slope, so it starts
+// again for any track whose slope changes.
+void SpectrumEngine::FindSlope(uint8_t const *pixels, StreamInfo const &info)
+{
+	struct Climb
+	{
+		float old_slope;
+		float last_d;
+		int direction;
+		float step;
+		bool done;
+	};
+	std::vector<Climb> climbs;
+	extract(pixels, info);
+	for (Track const &track : tracks_)
+		climbs.push_back({ track.slope, Differentiate(track.spectrum, width_), 1, SLOPE_STEP, false });
+	int count = 0;
+	while (count < SLOPE_MAX_ITERATIONS &&
+		   std::any_of(climbs.begin(), climbs.end(), [](Climb const &climb) { return !climb.done; }))
+	{
+		extract(pixels, info);
+		for (unsigned int t = 0; t < tracks_.size(); t++)
+		{
+			Climb &climb = climbs[t];
+			if (climb.done)
+				continue;
+			float d = Differentiate(tracks_[t].spectrum, width_);
+			// Getting less spiky, so turn round and take smaller steps.
+			if (d < climb.last_d)
+			{
+				climb.direction = -climb.direction;
+				climb.step *= 0.5;
+			}
+			climb.last_d = d;
+			if (climb.step < SLOPE_MIN_STEP)
+				climb.done = true;
+			else
+				tracks_[t].slope += climb.step * climb.direction;
+		}
+		count++;
+	}
+	// A climb that didn't finish has moved on from the slope of the last extraction.
+	bool restored = false;
+	for (unsigned int t = 0; t < tracks_.size(); t++)
+	{
+		if (!climbs[t].done)
+		{
+			tracks_[t].slope = climbs[t].old_slope;
+			restored = true;
+		}
+		if (tracks_[t].slope != climbs[t].old_slope)
+			spike_filters_[t].Reset(width_, spike_window_);
+		LOG(1, "slope=" << tracks_[t].slope << (tracks_.size() > 1 ? " track " + std::to_string(t) : ""));
+	}
+	if (restored)
+		extract(pixels, info);
+}
+
+float SpectrumEngine::Calibrate()
+{
+	if (lamp_left_)
+	{
+		// A running mean of each track's lamp, less its dark.
+		const float n = lamp_frames_ - lamp_left_ + 1;
+		for (Track &track : tracks_)
+		{
+			for (unsigned int i = 0; i < width_; i++)
+				track.lamp[i] += (track.spectrum[i] - track.dark[i] - track.lamp[i]) / n;
+		}
+		if (--lamp_left_ == 0)
+		{
+			for (Track &track : tracks_)
+				track.have_lamp = true;
+			response_stale_ = true;
+			LOG(1, "Lamp averaged over " << lamp_frames_ << " frames");
+		}
+	}
+
+	if (blank_left_)
+	{
+		// A running mean of each track's reference, and the dark it was taken with.
+		const float n = blank_frames_ - blank_left_ + 1;
+		for (Track &track : tracks_)
+		{
+			for (unsigned int i = 0; i < width_; i++)
+				track.blank[i] += (track.spectrum[i] - track.blank[i]) / n;
+			std::copy(track.dark, track.dark + width_, track.blank_dark);
+		}
+		if (--blank_left_ == 0)
+		{
+			for (Track &track : tracks_)
+				invertBlank(track);
+			LOG(1, "Reference averaged over " << blank_frames_ << " frames");
+		}
+	}
+
+	float max = 0;
+	for (Track &track : tracks_)
+	{
+		if (track.have_lamp &&
+			(response_stale_ || track.reference_b != track.label_b || track.reference_c != track.label_c))
+			updateResponse(track);
+		float *spectrum = track.spectrum;
+		float const *dark = track.dark;
+		float const *inverse = track.blank_inverse;
+		const bool intensity = measurement_ == Measurement::Intensity || !track.have_blank || blank_left_;
+		// The response is the same in the spectrum and the reference, so transmittance
+		// doesn't need it.
+		if (intensity)
+		{
+			float const *incandescent = track.incandescent;
+			for (unsigned int i = 0; i < width_; i++)
+				spectrum[i] = std::max(spectrum[i] - dark[i], 0.0f) * incandescent[i];
+		}
+		else if (measurement_ == Measurement::Transmittance)
+		{
+			for (unsigned int i = 0; i < width_; i++)
+				spectrum[i] = std::max(spectrum[i] - dark[i], 0.0f) * inverse[i];
+		}
+		else
+		{
+			// Masked bins are given a transmittance of 1. The logarithm has a loop of its own,
+			// or the compiler branches around it and doesn't vectorise.
+			for (unsigned int i = 0; i < width_; i++)
+			{
+				const float transmittance = std::max((spectrum[i] - dark[i]) * inverse[i], TRANSMITTANCE_MIN);
+				spectrum[i] = inverse[i] > 0 ? transmittance : 1.0f;
+			}
+			for (unsigned int i = 0; i < width_; i++)
+				spectrum[i] = -fast_log10(spectrum[i]);
+		}
+		for (unsigned int i = 0; i < width_; i++)
+			max = std::max(max, spectrum[i]);
+
+		track.colour.valid = false;
+		if (colorimetry_ && intensity)
+		{
+			if (track.colour_b != track.label_b || track.colour_c != track.label_c)
+			{
+				colorimeter_.Weigh(track.label_b, track.label_c, width_, track.colour_weights);
+				track.colour_b = track.label_b;
+				track.colour_c = track.label_c;
+			}
+			colorimeter_.Measure(spectrum, width_, track.colour_weights.data(), track.colour);
+		}
+	}
+	for (unsigned int t = 0; t < tracks_.size(); t++)
+	{
+		if (baseline_config_.method != BaselineEstimator::Method::Off)
+		{
+			baselines_[t].Update(tracks_[t].spectrum);
+			float const *baseline = baselines_[t].Get();
+			for (unsigned int i = 0; i < width_; i++)
+				tracks_[t].subtracted[i] = tracks_[t].spectrum[i] - baseline[i];
+		}
+		if (identify_lines_)
+		{
+			findPeaks(tracks_[t], tracks_[t].peaks);
+			for (Peak &peak : tracks_[t].peaks)
+				peak.line = lines_.Nearest(peak.wavelength, line_tolerance_);
+		}
+	}
+	response_stale_ = false;
+	return max;
+}
+
+void SpectrumEngine::DarkCal()
+{
+	for (Track &track : tracks_)
+		std::copy(track.spectrum, track.spectrum + width_, track.dark);
+}
+
+void SpectrumEngine::SetLampTemperature(double kelvin)
+{
+	lamp_model_.SetTemperature(kelvin);
+	for (Track &track : tracks_)
+		track.reference_b = NAN;
+	response_stale_ = true;
+}
+
+void SpectrumEngine::LoadLampSpectrum(std::string const &filename)
+{
+	lamp_model_.LoadTable(filename);
+	for (Track &track : tracks_)
+		track.reference_b = NAN;
+	response_stale_ = true;
+}
+
+void SpectrumEngine::LoadObserver(std::string const &filename)
+{
+	colorimeter_.LoadObserver(filename);
+	for (Track &track : tracks_)
+		track.colour_b = NAN;
+}
+
+void SpectrumEngine::LoadColourSamples(std::string const &filename)
+{
+	colorimeter_.LoadSamples(filename);
+	for (Track &track : tracks_)
+		track.colour_b = NAN;
+}
+
+void SpectrumEngine::LoadDaylight(std::string const &filename)
+{
+	colorimeter_.LoadDaylight(filename);
+}
+
+void SpectrumEngine::IncandescentCal(unsigned int frames)
+{
+	lamp_frames_ = std::max(frames, 1u);
+	lamp_left_ = lamp_frames_;
+}
+
+void SpectrumEngine::ReferenceCal(unsigned int frames)
+{
+	blank_frames_ = std::max(frames, 1u);
+	blank_left_ = blank_frames_;
+	for (Track &track : tracks_)
+		std::fill(track.blank, track.blank + width_, 0.0f);
+}
+
+// Bins with too little of the reference would only give noise, so they are masked by a
+// reciprocal of 0.
+void SpectrumEngine::invertBlank(Track &track)
+{
+	float peak = 0;
+	for (unsigned int i = 0; i < width_; i++)
+		peak = std::max(peak, track.blank[i] - track.blank_dark[i]);
+	const float floor = std::max(REFERENCE_MIN * peak, 1e-6f);
+	unsigned int masked = 0;
+	for (unsigned int i = 0; i < width_; i++)
+	{
+		const float r = track.blank[i] - track.blank_dark[i];
+		track.blank_inverse[i] = r > floor ? 1.0f / r : 0.0f;
+		masked += r <= floor;
+	}
+	track.have_blank = true;
+	LOG(2, "Reference has " << masked << " bins too faint to use");
+}
+
+// The response is what the lamp gives out over what was seen of it. The lamp is smoothed
+// first, and the division regularised, so that noise in the faint ends of the lamp isn't
+// blown up into the correction.
+void SpectrumEngine::updateResponse(Track &track)
+{
+	if (track.reference_b != track.label_b || track.reference_c != track.label_c)
+	{
+		lamp_model_.Sample(track.label_b, track.label_c, width_, track.lamp_reference);
+		track.reference_b = track.label_b;
+		track.reference_c = track.label_c;
+	}
+	lamp_smoothed_.resize(width_);
+	lamp_smoothing_.Apply(track.lamp, lamp_smoothed_.data(), width_);
+	float const *lamp = lamp_smoothed_.data();
+	float const *reference = track.lamp_reference;
+	float *incandescent = track.incandescent;
+
+	const float peak = *std::max_element(lamp, lamp + width_);
+	const float floor = LAMP_MIN * peak, epsilon2 = LAMP_EPSILON * LAMP_EPSILON * peak * peak;
+	float max = 0;
+	for (unsigned int x = 0; x < width_; x++)
+	{
+		const float m = lamp[x];
+		incandescent[x] = m > floor ? reference[x] * m / (m * m + epsilon2) : 0.0f;
+		max = std::max(max, incandescent[x]);
+	}
+	if (max <= 0)
+	{
+		LOG(1, "No lamp light to calibrate against");
+		std::fill(incandescent, incandescent + width_, 1.0f);
+		return;
+	}
+	const float scale = LAMP_SCALE / max;
+	for (unsigned int x = 0; x < width_; x++)
+		incandescent[x] *= scale;
+	LOG(2, "Incandescent calibration scaled by " << scale);
+}
+
+void SpectrumEngine::SetLineIdentification(bool identify, float tolerance)
+{
+	identify_lines_ = identify;
+	line_tolerance_ = tolerance;
+	for (Track &track : tracks_)
+		track.peaks.clear();
+}
+
+void SpectrumEngine::LoadLines(std::string const &filename)
+{
+	lines_.Load(filename);
+	calibration_lines_ = lines_.Select(calibration_species_);
+}
+
+void SpectrumEngine::SetCalibrationSpecies(std::vector<std::string> const &species)
+{
+	calibration_species_ = species;
+	calibration_lines_ = lines_.Select(calibration_species_);
+}
+
+// Local maxima of the smoothed spectrum, less its baseline if there is one, smoothed so that
+// noise doesn't split a line into peaks of its own, placed between bins by a parabola through
+// the top three. There is room for all of them, so this doesn't allocate.
+//
+// Noise leaves many small maxima to be tested, so the lowest points either side come from
+// running minima over blocks of PEAK_WINDOW bins, forwards and backwards (van Herk, Gil and
+// Werman), of which any PEAK_WINDOW bins in a row need only one of each.
+void SpectrumEngine::findPeaks(Track const &track, std::vector<Peak> &peaks)
+{
+	peaks.clear();
+	if (width_ < 3)
+		return;
+	peak_smoothed_.resize(4 * width_);
+	float *s = peak_smoothed_.data(), *forward = s + width_, *backward = s + 2 * width_;
+	float *differences = s + 3 * width_;
+	float const *spectrum = subtracted(track);
+	peak_smoothing_.Apply(spectrum, s, width_);
+	// Each block is a chain of its own, and the blocks can overlap.
+	float max = 0;
+	for (unsigned int begin = 0; begin < width_; begin += PEAK_WINDOW)
+	{
+		const unsigned int end = std::min(begin + PEAK_WINDOW, width_);
+		float low = s[begin], high = s[begin];
+		forward[begin] = low;
+		for (unsigned int x = begin + 1; x < end; x++)
+		{
+			forward[x] = low = std::min(low, s[x]);
+			high = std::max(high, s[x]);
+		}
+		backward[end - 1] = low = s[end - 1];
+		for (unsigned int x = end - 1; x-- > begin;)
+			backward[x] = low = std::min(low, s[x]);
+		max = std::max(max, high);
+	}
+	// The noise, from the median difference between neighbouring bins, which few lines move.
+	for (unsigned int x = 0; x + 1 < width_; x++)
+		differences[x] = std::abs(spectrum[x + 1] - spectrum[x]);
+	const unsigned int median = (width_ - 1) / 2;
+	std::nth_element(differences, differences + median, differences + width_ - 1);
+	const float noise = differences[median] * (1.4826f / std::sqrt(2.0f));
+	const float prominence = std::max(PEAK_PROMINENCE * max, PEAK_NOISE * noise);
+	if (prominence <= 0)
+		return;
+
+	for (unsigned int x = 1; x + 1 < width_; x++)
+	{
+		if (!(s[x] > s[x - 1] && s[x] >= s[x + 1]) || s[x] < prominence)
+			continue;
+		const float left = x >= PEAK_WINDOW ? std::min(backward[x - PEAK_WINDOW], forward[x - 1]) : forward[x - 1];
+		const float right = x + PEAK_WINDOW < width_ ? std::min(backward[x + 1], forward[x + PEAK_WINDOW])
+													 : *std::min_element(s + x + 1, s + width_);
+		if (s[x] - std::max(left, right) < prominence)
+			continue;
+		const float curvature = s[x - 1] - 2 * s[x] + s[x + 1];
+		const float column = x + (curvature < 0 ? 0.5f * (s[x - 1] - s[x + 1]) / curvature : 0.0f);
+		peaks.push_back({ column, (float)((column - track.label_c) / track.label_b), s[x], -1 });
+	}
+}
+
+// The index of the nearest of some wavelengths, in order, to nm.
+static unsigned int nearest_line(std::vector<float> const &lines, double nm)
+{
+	const unsigned int above = std::lower_bound(lines.begin(), lines.end(), nm) - lines.begin();
+	if (above == lines.size() || (above > 0 && nm - lines[above - 1] < lines[above] - nm))
+		return above - 1;
+	return above;
+}
+
+bool SpectrumEngine::ParsePeaks()
+{
+	bool fitted = true;
+	for (Track &track : tracks_)
+		fitted = parsePeaks(track) && fitted;
+	return fitted;
+}
+
+bool SpectrumEngine::parsePeaks(Track &track)
+{
+	std::vector<float> const &lines = calibration_lines_;
+	findPeaks(track, fit_peaks_);
+	std::sort(fit_peaks_.begin(), fit_peaks_.end(), [](Peak const &a, Peak const &b) { return a.height > b.height; });
+	const unsigned int n = std::min<unsigned int>(fit_peaks_.size(), FIT_PEAKS);
+	if (n < FIT_MIN_LINES || lines.size() < FIT_MIN_LINES)
+		return false;
+
+	// Each pairing gives a fit through two peaks, which is scored by the peaks it puts on a line.
+	unsigned int best_matches = 0;
+	double best_residual = 0, best_b = 1, best_c = 0;
+	for (unsigned int i = 0; i < n; i++)
+		for (unsigned int j = i + 1; j < n; j++)
+			for (unsigned int k = 0; k < lines.size(); k++)
+				for (unsigned int l = 0; l < lines.size(); l++)
+				{
+					if (k == l)
+						continue;
+					const double b = (fit_peaks_[i].column - fit_peaks_[j].column) / (lines[k] - lines[l]);
+					if (!(std::abs(b) >= FIT_MIN_DISPERSION && std::abs(b) <= FIT_MAX_DISPERSION))
+						continue;
+					const double c = fit_peaks_[i].column - b * lines[k];
+					unsigned int matches = 0;
+					double residual = 0;
+					for (unsigned int p = 0; p < n; p++)
+					{
+						const double nm = (fit_peaks_[p].column - c) / b;
+						const double d = lines[nearest_line(lines, nm)] - nm;
+						if (std::abs(d) < FIT_TOLERANCE)
+						{
+							matches++;
+							residual += d * d;
+						}
+					}
+					if (matches > best_matches || (matches == best_matches && residual < best_residual))
+					{
+						best_matches = matches;
+						best_residual = residual;
+						best_b = b;
+						best_c = c;
+					}
+				}
+	if (best_matches < FIT_MIN_LINES)
+	{
+		LOG(1, "Only " << best_matches << " peaks on calibration lines");
+		return false;
+	}
+
+	double wavelengths[FIT_PEAKS], columns[FIT_PEAKS];
+	unsigned int m = 0;
+	for (unsigned int p = 0; p < n; p++)
+	{
+		const double nm = (fit_peaks_[p].column - best_c) / best_b;
+		const float line = lines[nearest_line(lines, nm)];
+		if (std::abs(line - nm) >= FIT_TOLERANCE)
+			continue;
+		wavelengths[m] = line;
+		columns[m++] = fit_peaks_[p].column;
+		LOG(2, "Peak at " << fit_peaks_[p].column << " -> " << line);
+	}
+	double cov00, cov01, cov11, sumsq;
+	gsl_fit_linear(wavelengths, 1, columns, 1, m, &track.label_c, &track.label_b, &cov00, &cov01, &cov11, &sumsq);
+	LOG(1, "Fit b=" << track.label_b << "x + c=" << track.label_c);
+	return true;
+}
+
+void SpectrumEngine::ReadCal()
+{
+	std::string line;
+	unsigned int w;
+	std::ifstream calfile;
+	for (unsigned int t = 0; t < tracks_.size(); t++)
+	{
+		Track &track = tracks_[t];
+		calfile.open(cal_file_name(slopeFileName, t));
+		if (calfile)
+		{
+			std::getline(calfile, line);
+			track.slope = std::stod(line);
+			calfile.close();
+			LOG(1, "Loaded Slope = " << track.slope);
+		}
+
+		calfile.open(cal_file_name(darkFileName, t));
+		if (calfile)
+		{
+			std::getline(calfile, line);
+			w = std::stoi(line);
+			for (unsigned int i = 0; i < std::min(w, width_); i++)
+			{
+				std::getline(calfile, line);
+				track.dark[i] = std::stod(line);
+			}
+			calfile.close();
+			LOG(1, "Loaded Dark");
+		}
+
+		calfile.open(cal_file_name(incandescentFileName, t));
+		if (calfile)
+		{
+			std::getline(calfile, line);
+			w = std::stoi(line);
+			for (unsigned int i = 0; i < std::min(w, width_); i++)
+			{
+				std::getline(calfile, line);
+				track.incandescent[i] = std::stod(line);
+			}
+			calfile.close();
+			LOG(1, "Loaded Incandescent");
+		}
+
+		calfile.open(cal_file_name(lampFileName, t));
+		if (calfile)
+		{
+			std::getline(calfile, line);
+			w = std::stoi(line);
+			std::fill(track.lamp, track.lamp + width_, 0.0f);
+			for (unsigned int i = 0; i < std::min(w, width_); i++)
+			{
+				std::getline(calfile, line);
+				track.lamp[i] = std::stod(line);
+			}
+			calfile.close();
+			track.have_lamp = true;
+			response_stale_ = true;
+			LOG(1, "Loaded Lamp");
+		}
+
+		calfile.open(cal_file_name(blankFileName, t));
+		if (calfile)
+		{
+			std::getline(calfile, line);
+			w = std::stoi(line);
+			std::fill(track.blank, track.blank + width_, 0.0f);
+			std::fill(track.blank_dark, track.blank_dark + width_, 0.0f);
+			for (unsigned int i = 0; i < std::min(w, width_); i++)
+				calfile >> track.blank[i] >> track.blank_dark[i];
+			calfile.close();
+			invertBlank(track);
+			LOG(1, "Loaded Reference");
+		}
+
+		calfile.open(cal_file_name(wavelengthFileName, t));
+		if (calfile)
+		{
+			std::getline(calfile, line);
+			track.label_b = std::stod(line);
+			std::getline(calfile, line);
+			track.label_c = std::stod(line);
+			calfile.close();
+			LOG(1, "Loaded Wavelength fit b=" << track.label_b << " c=" << track.label_c);
+		}
+
+		calfile.open(cal_file_name(channelsFileName, t));
+		if (calfile)
+		{
+			std::getline(calfile, line);
+			w = std::stoi(line);
+			for (unsigned int i = 0; i < std::min(w, width_); i++)
+				calfile >> track.bin_weights[0][i] >> track.bin_weights[1][i] >> track.bin_weights[2][i];
+			calfile.close();
+			LOG(1, "Loaded Channel weights");
+		}
+	}
+
+	calfile.open(profileFileName);
+	if (calfile)
+	{
+		std::getline(calfile, line);
+		w = std::stoi(line);
+		// Only any use for the same frames.
+		if (w == positions_)
+		{
+			for (unsigned int j = 0; j < w; j++)
+				calfile >> profile_[j] >> profile_variance_[j];
+			profile_frames_ = 1;
+			for (Track &track : tracks_)
+				computeRowWeights(track);
+			LOG(1, "Loaded Profile");
+		}
+		calfile.close();
+	}
+
+	calfile.open(mastersFileName);
+	if (calfile)
+	{
+		unsigned int width, positions;
+		calfile >> width >> positions;
+		// Only any use for the same frames.
+		if (width == width_ && positions == positions_)
+		{
+			darks_.clear();
+			flats_.clear();
+			std::string kind;
+			Master master;
+			unsigned int i = 0;
+			while (calfile >> kind >> master.exposure >> master.gain >> master.frames)
+			{
+				master.data.resize((size_t)positions_ * width_ * 3);
+				std::ifstream data(cal_file_name("calMaster.raw", ++i), std::ios::binary);
+				if (data.read((char *)master.data.data(), master.data.size() * sizeof(float)))
+					(kind == "flat" ? flats_ : darks_).push_back(master);
+			}
+		}
+		calfile.close();
+		correction_stale_ = true;
+		LOG(1, "Loaded " << darks_.size() << " master darks and " << flats_.size() << " master flats");
+	}
+
+	calfile.open(hotPixelsFileName);
+	if (calfile)
+	{
+		unsigned int width, positions, k, p;
+		calfile >> width >> positions;
+		if (width == width_ && positions == positions_)
+		{
+			hot_pixels_.clear();
+			while (calfile >> k >> p)
+			{
+				if (k < positions_ && p < width_)
+					hot_pixels_.push_back(k * width_ + p);
+			}
+			std::sort(hot_pixels_.begin(), hot_pixels_.end());
+			correction_stale_ = true;
+			LOG(1, "Loaded " << hot_pixels_.size() << " hot pixels");
+		}
+		calfile.close();
+	}
+}
+
+void SpectrumEngine::SaveCal() const
+{
+	std::ofstream calfile;
+	for (unsigned int t = 0; t < tracks_.size(); t++)
+	{
+		Track const &track = tracks_[t];
+		calfile.open(cal_file_name(slopeFileName, t));
+		calfile << track.slope << "\n";
+		calfile.close();
+		// save dark cal
+		calfile.open(cal_file_name(darkFileName, t));
+		calfile << width_ << "\n";
+		for (unsigned int i = 0; i < width_; i++)
+			calfile << track.dark[i] << "\n";
+		calfile.close();
+		// save amplitude cal
+		calfile.open(cal_file_name(incandescentFileName, t));
+		calfile << width_ << "\n";
+		for (unsigned int i = 0; i < width_; i++)
+			calfile << track.incandescent[i] << "\n";
+		calfile.close();
+		// save the lamp it came from
+		if (track.have_lamp)
+		{
+			calfile.open(cal_file_name(lampFileName, t));
+			calfile << width_ << "\n";
+			for (unsigned int i = 0; i < width_; i++)
+				calfile << track.lamp[i] << "\n";
+			calfile.close();
+		}
+		// save the reference for transmittance, with its dark
+		if (track.have_blank)
+		{
+			calfile.open(cal_file_name(blankFileName, t));
+			calfile << width_ << "\n";
+			for (unsigned int i = 0; i < width_; i++)
+				calfile << track.blank[i] << " " << track.blank_dark[i] << "\n";
+			calfile.close();
+		}
+		// save coefficients for wavelength fit
+		calfile.open(cal_file_name(wavelengthFileName, t));
+		calfile << track.label_b << "\n";
+		calfile << track.label_c << "\n";
+		calfile.close();
+		// save per-bin channel weights
+		calfile.open(cal_file_name(channelsFileName, t));
+		calfile << width_ << "\n";
+		for (unsigned int i = 0; i < width_; i++)
+			calfile << track.bin_weights[0][i] << " " << track.bin_weights[1][i] << " " << track.bin_weights[2][i]
+					<< "\n";
+		calfile.close();
+	}
+	// save the profile across the frame, if there is one
+	if (profile_frames_)
+	{
+		calfile.open(profileFileName);
+		calfile << positions_ << "\n";
+		for (unsigned int j = 0; j < positions_; j++)
+			calfile << profile_[j] << " " << profile_variance_[j] << "\n";
+		calfile.close();
+	}
+	// save master darks and flats
+	if (!darks_.empty() || !flats_.empty())
+	{
+		calfile.open(mastersFileName);
+		calfile << width_ << " " << positions_ << "\n";
+		unsigned int i = 0;
+		for (auto const *masters : { &darks_, &flats_ })
+		{
+			for (Master const &master : *masters)
+			{
+				calfile << (masters == &flats_ ? "flat " : "dark ") << master.exposure << " " << master.gain << " "
+						<< master.frames << "\n";
+				std::ofstream data(cal_file_name("calMaster.raw", ++i), std::ios::binary);
+				data.write((char const *)master.data.data(), master.data.size() * sizeof(float));
+			}
+		}
+		calfile.close();
+	}
+	// save the hot pixels
+	if (!hot_pixels_.empty())
+	{
+		calfile.open(hotPixelsFileName);
+		calfile << width_ << " " << positions_ << "\n";
+		for (uint32_t s : hot_pixels_)
+			calfile << s / width_ << " " << s % width_ << "\n";
+		calfile.close();
+	}
+}
@@ -0,0 +1,405 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spectrum_engine.hpp - turn spectroscope frames into calibrated spectra.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "core/stream_info.hpp"
+#include "spectrum/baseline.hpp"
+#include "spectrum/colorimeter.hpp"
+#include "spectrum/lamp_model.hpp"
+#include "spectrum/line_database.hpp"
+#include "spectrum/spectrum_arena.hpp"
+#include "spectrum/spectrum_filter.hpp"
+#include "spectrum/spike_filter.hpp"
+
+namespace spectrum_kernels
+{
+struct Job;
+}
+
+// Everything between a camera frame and the trace on the screen: collapsing the band
+// of the spectrum down to one value per column, finding the tilt of the band, the
+// wavelength fit against the fluorescent lamp lines, and the dark and lamp
+// calibrations. It knows nothing about GL so that it can be measured on its own.
+//
+// Column x of the spectrum is read from x + slope * y in row y. The wavelength fit is
+// column = c + b * nm. With a vertical band the same goes for rows and columns the other
+// way round. Bayer frames are read in 2x2 quads, so their spectra have one column per
+// pair of pixels.
+//
+// The three colour channels of a frame are extracted side by side and only then combined
+// into one spectrum, so the weighting can change without going back to the pixels.
+//
+// Optimal extraction (Horne 1986) weights each position across the band by P / V, its
+// share P of the light in the band over the variance V of what it reads, so the faint
+// edges of the band add less noise than they do light. Both come from rolling averages,
+// of the brightness at each position and of how much that varies from frame to frame, and
+// the weights are worked out from them every so often rather than per frame, leaving the
+// kernels a weighted sum.
+//
+// A frame can hold several bands, or tracks, say from a sample fibre and a reference
+// fibre on the same slit. Each is a spectrum of its own, with its own tilt and its own
+// calibrations, but they are all extracted in the same pass over the frame. Track 0 keeps
+// the calibration files it always had; the others add their number to the name.
+//
+// Hot pixels and fixed-pattern noise are taken out pixel by pixel, before anything is
+// summed, with master darks and flats averaged from runs of frames. There can be one of
+// each for every exposure and gain; those nearest the frames being extracted are blended
+// into one correction whenever the exposure moves, and the kernels subtract the dark and
+// multiply by the flat's gain as they read each pixel.
+//
+// Pixels that stand out in a master dark are marked hot, and left out by giving them no
+// gain and their neighbour across the band twice as much. Spikes that last a frame are
+// caught afterwards, bin by bin, against a sliding median of the last few spectra.
+//
+// The lamp calibration divides what the spectroscope makes of a continuum lamp into what
+// the lamp gives out, as a blackbody or from a table, sampled on the wavelength axis once
+// for each wavelength fit. The lamp is kept, averaged over a few frames, so that the
+// response can be worked out again whenever the fit changes.
+//
+// In place of the spectrum itself, Calibrate can give each track's transmittance against a
+// reference spectrum of the blank, (S - D) / (R - D_R), or its absorbance -log10 of that.
+// The reference is averaged and stored with the dark it was taken with, and its
+// reciprocal worked out then, so that each frame costs a multiply (and a logarithm) per
+// bin. Bins where the reference has too little light to divide by read 0.
+//
+// With colorimetry on, Calibrate also works out the colour of each track's intensity as
+// a light source, from weights resampled onto the track's bins whenever its wavelength fit
+// changes.
+//
+// Once calibrated, each track's continuum can be estimated and taken off, leaving the
+// lines on their own in Subtracted() while Spectrum() keeps the whole of it. Peaks are
+// found, and their heights measured, above the continuum.
+//
+// With line identification on, Calibrate also finds the peaks of every track and looks
+// each up in a database of emission lines, sorted by wavelength so that the nearest line
+// is a binary search away. ParsePeaks fits the wavelengths to the lines of a few species
+// in the same database, trying every pairing of the brightest peaks with those lines and
+// keeping the one that puts most peaks on a line, so the peaks can come in any order.
+class SpectrumEngine
+{
+public:
+	enum class Orientation
+	{
+		Horizontal, // the spectrum runs along the rows
+		Vertical // the spectrum runs down the columns
+	};
+
+	enum class Extraction
+	{
+		Box, // every position across the band counts the same
+		Optimal // weighted by the profile of the band
+	};
+
+	enum class Measurement
+	{
+		Intensity, // the calibrated spectrum
+		Transmittance, // against the reference
+		Absorbance // -log10 of the transmittance
+	};
+
+	// Where a track lies across the frame, in pixels from the top (or from the left, for a
+	// vertical band), from begin up to but not including end.
+	struct Band
+	{
+		unsigned int begin;
+		unsigned int end;
+	};
+
+	// A peak of a spectrum: where it is in bins and in nm, its height once smoothed, and the
+	// line of the database it was identified as, or -1.
+	struct Peak
+	{
+		float column;
+		float wavelength;
+		float height;
+		int line;
+	};
+
+	SpectrumEngine();
+
+	// Which way the band runs, taking effect at the next Configure.
+	void SetOrientation(Orientation orientation);
+	// The tracks to extract, taking effect at the next Configure. With none, the whole
+	// frame is one track.
+	void SetTracks(std::vector<Band> const &bands);
+	unsigned int Tracks() const { return tracks_.size(); }
+	// Size the spectra for frames like these, choosing the kernel for their pixel format.
+	// If anything has changed the calibrations are reset and true is returned; otherwise
+	// everything is kept as it was. Throws if the format can't be read, or a track lies
+	// outside the frame.
+	bool Configure(StreamInfo const &info);
+	// Length of every spectrum.
+	unsigned int Width() const { return width_; }
+	// Columns are shared out between this many threads, pinned to a core each if asked.
+	void SetThreads(unsigned int threads, bool pin = false);
+	unsigned int Threads() const { return threads_; }
+	// Until there is a profile to weight by, optimal extraction is the same as box.
+	void SetExtraction(Extraction extraction);
+	Extraction GetExtraction() const { return extraction_; }
+	// The brightness profile across the frame, one value per position that extraction
+	// reads, or nullptr if there isn't one yet.
+	float const *Profile() const { return profile_frames_ ? profile_ : nullptr; }
+	unsigned int ProfileLength() const { return positions_; }
+
+	// The exposure time (in us) and analogue gain of the frames being extracted, which pick
+	// the master darks and flats.
+	void SetExposure(float exposure, float gain);
+	// Average the next frames into the master dark, or flat, for the current exposure and
+	// gain, replacing any there was. A flat should be of an even continuum lamp; it is
+	// stored with the dark taken off, and only its variations from pixel to pixel along
+	// the spectrum are corrected.
+	void CaptureDarkFrames(unsigned int frames);
+	void CaptureFlatFrames(unsigned int frames);
+	bool Capturing() const { return capture_left_ > 0; }
+	bool Corrected() const { return !correction_.empty(); }
+	// How many pixels read by extraction have been marked hot.
+	unsigned int HotPixels() const { return hot_pixels_.size(); }
+
+	// Replace values more than sigma times the noise from the median of their bin over the
+	// last window frames. A window of 0 turns this off.
+	void SetSpikeRejection(unsigned int window, float sigma);
+	// How many bins the last Extract replaced.
+	unsigned int Spikes() const { return spikes_; }
+
+	// How Calibrate estimates the baseline of each track, starting afresh.
+	void SetBaseline(BaselineEstimator::Config const &config);
+	BaselineEstimator::Method BaselineMethod() const { return baseline_config_.method; }
+	// The baseline under the last calibrated spectrum, and the spectrum with it taken off,
+	// which is the spectrum itself with no baseline. Peaks are looked for in the latter.
+	float const *Baseline(unsigned int track = 0) const { return baselines_[track].Get(); }
+	float const *Subtracted(unsigned int track = 0) const { return subtracted(tracks_[track]); }
+
+	// Collapse a frame like the one last configured into every track's Spectrum(),
+	// returning the largest value of any of them.
+	float Extract(uint8_t const *pixels, StreamInfo const &info);
+	// How many of the pixels the last Extract read were at full scale.
+	unsigned int Saturated() const { return saturated_; }
+
+	// How much red, green and blue go into the spectra. For YUV formats these become the
+	// matching weights of Y, U and V.
+	void SetChannelWeights(float r, float g, float b);
+	// A further weight per bin for one channel of a track, as from a calibration: Width()
+	// of them, or nullptr for all 1.
+	void SetBinWeights(unsigned int channel, float const *weights, unsigned int track = 0);
+	// The channels of the last frame: Y, U and V (centred on zero) for YUV formats,
+	// otherwise R, G and B.
+	float const *Channel(unsigned int channel, unsigned int track = 0) const
+	{
+		return tracks_[track].channels[channel];
+	}
+	bool Yuv() const { return yuv_; }
+	// Weight the channels of the last frame into every Spectrum() again, returning the
+	// largest value. Extract has already done this with the weights it had at the time.
+	float Combine();
+	// Hill-climb the slope of each track that makes its spectrum from this frame spikiest,
+	// leaving Spectrum() extracted at the slope found, without spike rejection.
+	void FindSlope(uint8_t const *pixels, StreamInfo const &info);
+	// Apply each track's dark and lamp calibrations to its Spectrum() in place, or turn it
+	// into transmittance or absorbance, returning the largest value, and then take off its
+	// baseline into Subtracted().
+	float Calibrate();
+
+	// Take every track's current (uncalibrated) spectrum as its dark frame.
+	void DarkCal();
+	// The lamp that IncandescentCal takes the response against: a blackbody at this
+	// temperature, or a table of its radiance (see LampModel), which throws if it can't be read.
+	void SetLampTemperature(double kelvin);
+	void LoadLampSpectrum(std::string const &filename);
+	// Average this and the next frames of every track, less its dark, as the lamp, and take
+	// the response from them once they are in.
+	void IncandescentCal(unsigned int frames = 1);
+	// Until this is 0 Calibrate is still averaging the lamp.
+	unsigned int LampFramesLeft() const { return lamp_left_; }
+	// What Calibrate gives once there is a reference. Until then, and while one is being
+	// taken, it gives the intensity.
+	void SetMeasurement(Measurement measurement) { measurement_ = measurement; }
+	Measurement GetMeasurement() const { return measurement_; }
+	// Average this and the next frames of every track as the reference for transmittance
+	// and absorbance, keeping the dark each was taken with.
+	void ReferenceCal(unsigned int frames = 1);
+	unsigned int ReferenceFramesLeft() const { return blank_left_; }
+	bool HaveReference() const { return !tracks_.empty() && tracks_[0].have_blank; }
+	// Work out the colour of every track in Calibrate, or not. The observer, test colour
+	// samples and daylight components are loaded as Colorimeter does, throwing if they can't be.
+	void SetColorimetry(bool colorimetry) { colorimetry_ = colorimetry; }
+	bool GetColorimetry() const { return colorimetry_; }
+	void LoadObserver(std::string const &filename);
+	void LoadColourSamples(std::string const &filename);
+	void LoadDaylight(std::string const &filename);
+	// The colour of the last calibrated spectrum, not valid if it wasn't an intensity.
+	LightColour const &Colour(unsigned int track = 0) const { return tracks_[track].colour; }
+	// Find the peaks of every track in Calibrate, identifying each as the line of the database
+	// within tolerance nm of it, if there is one.
+	void SetLineIdentification(bool identify, float tolerance = 1.0f);
+	bool GetLineIdentification() const { return identify_lines_; }
+	// Lines as LineDatabase loads them, in place of those built in. Throws if they can't be read.
+	void LoadLines(std::string const &filename);
+	LineDatabase const &Lines() const { return lines_; }
+	// The species whose lines ParsePeaks fits to, by default the mercury and phosphors of a
+	// fluorescent lamp.
+	void SetCalibrationSpecies(std::vector<std::string> const &species);
+	// The peaks of the last calibrated spectrum in order along it, with line identification on.
+	std::vector<Peak> const &Peaks(unsigned int track = 0) const { return tracks_[track].peaks; }
+	// Fit each track's wavelengths to the calibration lines, whichever of its brightest peaks
+	// they turn out to be. Returns false if any track hasn't enough of them, leaving its fit alone.
+	bool ParsePeaks();
+
+	float Column(float wavelength, unsigned int track = 0) const
+	{
+		return tracks_[track].label_c + tracks_[track].label_b * wavelength;
+	}
+	float Wavelength(float column, unsigned int track = 0) const
+	{
+		return (column - tracks_[track].label_c) / tracks_[track].label_b;
+	}
+	float Slope(unsigned int track = 0) const { return tracks_[track].slope; }
+
+	float *Spectrum(unsigned int track = 0) { return tracks_[track].spectrum; }
+	float const *Spectrum(unsigned int track = 0) const { return tracks_[track].spectrum; }
+
+	// How spiky a spectrum is, which is what FindSlope maximises: the sum of the squares of
+	// its Savitzky-Golay first derivative.
+	float Differentiate(float const *data, unsigned int width);
+
+	void ReadCal();
+	void SaveCal() const;
+
+	// An extraction kernel, for one pixel format and orientation, doing one thread's job.
+	typedef void (*Kernel)(spectrum_kernels::Job &job);
+	// The mean brightness at each position across the band, from every bin_step-th bin.
+	typedef void (*ProfileKernel)(uint8_t const *data, StreamInfo const &info, unsigned int bin_step, float *rows);
+	// Fold the n-th frame of a run into a master.
+	typedef void (*AccumulateKernel)(uint8_t const *data, StreamInfo const &info, unsigned int n, float *master);
+
+private:
+	struct Track
+	{
+		unsigned int begin; // positions across the frame, in binned pixels
+		unsigned int end;
+		float slope;
+		double label_b;
+		double label_c;
+		float *spectrum;
+		float *subtracted; // the spectrum less its baseline
+		float *dark;
+		float *incandescent; // the response correction
+		float *lamp; // averaged, less the dark...
+		float *lamp_reference; // ...and what the lamp gives out in each bin
+		bool have_lamp;
+		double reference_b; // the wavelength fit lamp_reference was sampled for
+		double reference_c;
+		float *blank; // the reference for transmittance, averaged...
+		float *blank_dark; // ...the dark it was taken with...
+		float *blank_inverse; // ...and 1 / (blank - blank_dark), or 0 where that is too small
+		bool have_blank;
+		std::vector<float> colour_weights; // from Colorimeter::Weigh...
+		double colour_b; // ...for this wavelength fit
+		double colour_c;
+		LightColour colour;
+		std::vector<Peak> peaks; // with room for as many as there can be
+		float *channels[3];
+		uint32_t *integer_channels[3];
+		float *bin_weights[3];
+		uint32_t *rows; // the positions optimal extraction reads...
+		float *row_weights; // ...and their weights
+		unsigned int num_rows;
+	};
+
+	// A master dark or flat, the mean of a run of frames at one exposure and gain.
+	struct Master
+	{
+		float exposure;
+		float gain;
+		unsigned int frames;
+		std::vector<float> data; // three channels for every sample extraction can read
+	};
+
+	float extract(uint8_t const *pixels, StreamInfo const &info);
+	void updateProfile(uint8_t const *pixels, StreamInfo const &info);
+	void capture(uint8_t const *pixels, StreamInfo const &info);
+	bool blend(std::vector<Master> const &masters, std::vector<float> &out) const;
+	void updateCorrection();
+	void learnHotPixels(Master const &dark);
+	void readPositions(Track const &track, std::vector<unsigned int> &positions, std::vector<float> &weights) const;
+	void computeRowWeights(Track &track);
+	void updateResponse(Track &track);
+	void invertBlank(Track &track);
+	float const *subtracted(Track const &track) const
+	{
+		return baseline_config_.method == BaselineEstimator::Method::Off ? track.spectrum : track.subtracted;
+	}
+	void findPeaks(Track const &track, std::vector<Peak> &peaks);
+	bool parsePeaks(Track &track);
+
+	Orientation orientation_;
+	std::vector<Band> bands_;
+	StreamInfo info_;
+	Kernel kernel_;
+	ProfileKernel profile_kernel_;
+	AccumulateKernel accumulate_kernel_;
+	bool integer_; // the kernel can accumulate in integers
+	bool yuv_; // the kernel's channels are Y, U and V
+	unsigned int width_;
+	unsigned int positions_; // across the frame, read by extraction
+	unsigned int step_; // pixels between them
+	unsigned int threads_;
+	bool pin_;
+	unsigned int saturated_;
+	SpectrumArena arena_;
+	std::vector<Track> tracks_;
+	float weights_[3]; // red, green, blue
+	Extraction extraction_;
+	float *profile_; // positions_ of them
+	float *profile_variance_; // from frame to frame
+	float *row_means_; // scratch for the profile kernel
+	unsigned int profile_frames_;
+	std::vector<Master> darks_;
+	std::vector<Master> flats_;
+	Master capture_; // the master being averaged...
+	std::vector<Master> *capture_into_; // ...for darks_ or flats_
+	unsigned int capture_left_;
+	float exposure_;
+	float gain_;
+	// For the exposure and gain it was made for, as laid out for the kernels.
+	std::vector<float> correction_;
+	float correction_exposure_;
+	float correction_gain_;
+	bool correction_stale_;
+	std::vector<uint32_t> hot_pixels_; // samples, as indices into a master
+	unsigned int spike_window_;
+	float spike_sigma_;
+	unsigned int spikes_;
+	std::vector<SpikeFilter> spike_filters_; // one for each track
+	SpectrumFilter derivative_; // for Differentiate...
+	std::vector<float> derivative_out_; // ...into here
+	SpectrumFilter peak_smoothing_; // before looking for peaks...
+	std::vector<float> peak_smoothed_; // ...into here, with room for findPeaks' scratch
+	std::vector<Peak> fit_peaks_; // scratch for ParsePeaks
+	bool identify_lines_;
+	float line_tolerance_;
+	LineDatabase lines_;
+	std::vector<std::string> calibration_species_;
+	std::vector<float> calibration_lines_; // their wavelengths, in order
+	LampModel lamp_model_;
+	unsigned int lamp_frames_; // being averaged...
+	unsigned int lamp_left_; // ...and still to come
+	bool response_stale_; // the lamp, or what it gives out, has changed
+	SpectrumFilter lamp_smoothing_; // before dividing by the lamp
+	std::vector<float> lamp_smoothed_;
+	Measurement measurement_;
+	unsigned int blank_frames_; // being averaged...
+	unsigned int blank_left_; // ...and still to come
+	bool colorimetry_;
+	Colorimeter colorimeter_;
+	BaselineEstimator::Config baseline_config_;
+	std::vector<BaselineEstimator> baselines_; // one for each track
+};
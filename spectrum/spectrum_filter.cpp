@@ -0,0 +1,188 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spectrum_filter.cpp - smoothing and derivative filters along a spectrum.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include "spectrum/spectrum_filter.hpp"
+
+SpectrumFilter::SpectrumFilter() : SpectrumFilter({ 1.0f }, false)
+{
+}
+
+SpectrumFilter::SpectrumFilter(std::vector<float> const &taps, bool derivative)
+	: half_(taps.size() / 2), derivative_(derivative), taps_(taps)
+{
+}
+
+// Fill in the taps of the outputs near the ends. weights_at(t, weights) gives the weights
+// over a window of 2 * half_ + 1 bins for the output t bins from its middle.
+template <typename WeightsAt>
+void SpectrumFilter::setEdges(WeightsAt weights_at)
+{
+	const unsigned int w = 2 * half_ + 1;
+	std::vector<float> weights(w);
+	left_.resize(half_ * w);
+	right_.resize(half_ * w);
+	for (unsigned int i = 0; i < half_; i++)
+	{
+		weights_at((int)i - (int)half_, weights);
+		std::copy(weights.begin(), weights.end(), left_.begin() + i * w);
+		weights_at(i + 1, weights);
+		std::copy(weights.begin(), weights.end(), right_.begin() + i * w);
+	}
+}
+
+// Near the ends a smoothing kernel keeps the part of itself that lies on the spectrum,
+// scaled back up to a sum of 1.
+void SpectrumFilter::setKernelEdges()
+{
+	setEdges([this](int t, std::vector<float> &weights) {
+		const int h = half_;
+		float sum = 0;
+		for (int m = 0; m <= 2 * h; m++)
+		{
+			const int k = m - t;
+			weights[m] = k >= 0 && k <= 2 * h ? taps_[k] : 0;
+			sum += weights[m];
+		}
+		for (float &weight : weights)
+			weight /= sum;
+	});
+}
+
+SpectrumFilter SpectrumFilter::Boxcar(unsigned int width)
+{
+	const unsigned int w = std::max(width, 1u) | 1;
+	SpectrumFilter filter(std::vector<float>(w, 1.0f / w), false);
+	filter.setKernelEdges();
+	return filter;
+}
+
+SpectrumFilter SpectrumFilter::Gaussian(float fwhm)
+{
+	const float sigma = std::max(fwhm, 1e-3f) / 2.3548f;
+	const int h = ceilf(3 * sigma);
+	std::vector<float> taps(2 * h + 1);
+	float sum = 0;
+	for (int k = -h; k <= h; k++)
+		sum += taps[k + h] = expf(-0.5f * k * k / (sigma * sigma));
+	for (float &tap : taps)
+		tap /= sum;
+	SpectrumFilter filter(taps, false);
+	filter.setKernelEdges();
+	return filter;
+}
+
+// The polynomial is fitted to x = (m - h) / h for bins m of the window, which keeps the
+// normal equations well conditioned, and its derivative then scaled back to per bin. The
+// fit is linear in the data, so the weights for any output come from the rows of the
+// pseudo-inverse, combined as the derivative of the polynomial asks.
+SpectrumFilter SpectrumFilter::SavitzkyGolay(unsigned int window, unsigned int order, unsigned int derivative)
+{
+	const int h = std::max(window, 1u) / 2, w = 2 * h + 1;
+	const int p = std::min<int>(order, w - 1) + 1;
+	const double scale = h ? 1.0 / h : 1.0;
+	auto x_of = [&](int m) { return (m - h) * scale; };
+
+	// pinv = (A'A)^-1 A', by Gauss-Jordan on [A'A | A'].
+	std::vector<double> a(p * (p + w), 0.0);
+	for (int j = 0; j < p; j++)
+	{
+		for (int m = 0; m < w; m++)
+		{
+			const double xj = pow(x_of(m), j);
+			for (int k = 0; k < p; k++)
+				a[j * (p + w) + k] += xj * pow(x_of(m), k);
+			a[j * (p + w) + p + m] = xj;
+		}
+	}
+	for (int c = 0; c < p; c++)
+	{
+		int pivot = c;
+		for (int r = c + 1; r < p; r++)
+		{
+			if (fabs(a[r * (p + w) + c]) > fabs(a[pivot * (p + w) + c]))
+				pivot = r;
+		}
+		for (int k = 0; k < p + w; k++)
+			std::swap(a[c * (p + w) + k], a[pivot * (p + w) + k]);
+		const double d = a[c * (p + w) + c];
+		for (int k = 0; k < p + w; k++)
+			a[c * (p + w) + k] /= d;
+		for (int r = 0; r < p; r++)
+		{
+			const double f = a[r * (p + w) + c];
+			for (int k = 0; r != c && k < p + w; k++)
+				a[r * (p + w) + k] -= f * a[c * (p + w) + k];
+		}
+	}
+
+	auto weights_at = [&](int t, std::vector<float> &weights) {
+		const double x = t * scale;
+		for (int m = 0; m < w; m++)
+		{
+			double sum = 0;
+			for (int k = (int)derivative; k < p; k++)
+			{
+				double g = pow(x, k - derivative);
+				for (unsigned int i = 0; i < derivative; i++)
+					g *= k - i;
+				sum += g * a[k * (p + w) + p + m];
+			}
+			weights[m] = sum * pow(scale, derivative);
+		}
+	};
+	std::vector<float> taps(w);
+	weights_at(0, taps);
+	SpectrumFilter filter(taps, derivative > 0);
+	filter.setEdges(weights_at);
+	return filter;
+}
+
+void SpectrumFilter::Apply(float const *in, float *out, unsigned int n, unsigned int begin, unsigned int end) const
+{
+	const unsigned int h = half_, w = 2 * h + 1;
+	if (n < w)
+	{
+		for (unsigned int i = begin; i < end; i++)
+			out[i] = derivative_ ? 0 : in[i];
+		return;
+	}
+
+	for (unsigned int i = begin; i < std::min(end, h); i++)
+		out[i] = std::inner_product(in, in + w, &left_[i * w], 0.0f);
+	for (unsigned int i = std::max(begin, n - h); i < end; i++)
+		out[i] = std::inner_product(in + n - w, in + n, &right_[(i - (n - h)) * w], 0.0f);
+
+	// A tap at a time over the whole of the middle.
+	const unsigned int lo = std::max(begin, h), hi = std::min(end, n - h);
+	if (lo >= hi)
+		return;
+	const unsigned int count = hi - lo;
+	float *o = out + lo;
+	float const *x = in + lo - h;
+	const float t0 = taps_[0];
+	for (unsigned int c = 0; c < count; c++)
+		o[c] = t0 * x[c];
+	for (unsigned int k = 1; k < w; k++)
+	{
+		const float t = taps_[k];
+		float const *xk = x + k;
+		for (unsigned int c = 0; c < count; c++)
+			o[c] += t * xk[c];
+	}
+}
+
+void SpectrumFilter::Apply(float *data, unsigned int n)
+{
+	if (scratch_.size() < n)
+		scratch_.resize(n);
+	Apply(data, scratch_.data(), n);
+	std::copy(scratch_.data(), scratch_.data() + n, data);
+}
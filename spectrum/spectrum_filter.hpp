@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spectrum_filter.hpp - smoothing and derivative filters along a spectrum.
+ */
+
+#pragma once
+
+#include <vector>
+
+// A filter along the bins of a spectrum, as a convolution with taps worked out once when
+// it is made. Near the ends, where the window would run off the spectrum, each output has
+// taps of its own: a Savitzky-Golay filter fits its polynomial to the window at the end
+// instead, and the others leave out what isn't there and scale up what is.
+//
+// The middle of the spectrum is done a tap at a time across all the bins, so that the
+// compiler can vectorise it.
+class SpectrumFilter
+{
+public:
+	// The identity, one tap of 1.
+	SpectrumFilter();
+	// The mean of width bins, made odd.
+	static SpectrumFilter Boxcar(unsigned int width);
+	// A Gaussian of this full width at half maximum, in bins, out to three sigma.
+	static SpectrumFilter Gaussian(float fwhm);
+	// The least-squares polynomial of this order over window bins (made odd), or its first
+	// or second derivative per bin.
+	static SpectrumFilter SavitzkyGolay(unsigned int window, unsigned int order, unsigned int derivative = 0);
+
+	// How many bins either side of each output it reads.
+	unsigned int HalfWidth() const { return half_; }
+	// The taps, HalfWidth() * 2 + 1 of them, applied to in[i - HalfWidth()] to
+	// in[i + HalfWidth()] for out[i].
+	float const *Taps() const { return taps_.data(); }
+
+	// Filter n bins of in into out, which mustn't overlap. A spectrum shorter than the
+	// window is copied, or zeroed for a derivative.
+	void Apply(float const *in, float *out, unsigned int n) const { Apply(in, out, n, 0, n); }
+	// The same, for outputs begin to end only, so that a spectrum arriving in pieces can be
+	// filtered as it comes: they need in[begin - HalfWidth()] to in[end + HalfWidth()].
+	void Apply(float const *in, float *out, unsigned int n, unsigned int begin, unsigned int end) const;
+	// Filter in place, through the filter's own scratch buffer.
+	void Apply(float *data, unsigned int n);
+
+private:
+	SpectrumFilter(std::vector<float> const &taps, bool derivative);
+	template <typename WeightsAt>
+	void setEdges(WeightsAt weights_at);
+	void setKernelEdges();
+
+	unsigned int half_;
+	bool derivative_; // which says what a spectrum too short for the window becomes
+	std::vector<float> taps_;
+	// For the first and last half_ outputs, 2 * half_ + 1 taps each, over the first and last
+	// 2 * half_ + 1 bins.
+	std::vector<float> left_;
+	std::vector<float> right_;
+	std::vector<float> scratch_;
+};
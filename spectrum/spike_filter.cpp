@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spike_filter.cpp - reject single-frame spikes against the recent history of each bin.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "spectrum/spike_filter.hpp"
+
+// How quickly each bin's noise follows the values that are kept.
+#define DEVIATION_ALPHA (1.0f / 16)
+// The standard deviation of normal noise for each unit of mean absolute deviation.
+#define DEVIATION_TO_SIGMA 1.2533f
+
+SlidingMedian::SlidingMedian(float *data, int *pos, int *heap, int window)
+	: data_(data), pos_(pos), heap_(heap + window / 2), window_(window), next_(0), min_count_(0), max_count_(0)
+{
+	// Fill the heap alternately either side of the median, so that each new value starts
+	// off where the heaps need one.
+	for (int i = window - 1; i >= 0; i--)
+	{
+		data_[i] = 0;
+		pos_[i] = ((i + 1) / 2) * ((i & 1) ? -1 : 1);
+		heap_[pos_[i]] = i;
+	}
+}
+
+bool SlidingMedian::exchange(int i, int j)
+{
+	int t = heap_[i];
+	heap_[i] = heap_[j];
+	heap_[j] = t;
+	pos_[heap_[i]] = i;
+	pos_[heap_[j]] = j;
+	return true;
+}
+
+// Restore the min-heap below i.
+void SlidingMedian::minSortDown(int i)
+{
+	for (i *= 2; i <= min_count_; i *= 2)
+	{
+		if (i < min_count_ && less(i + 1, i))
+			i++;
+		if (!compareExchange(i, i / 2))
+			break;
+	}
+}
+
+// Restore the max-heap below i (indices being negative).
+void SlidingMedian::maxSortDown(int i)
+{
+	for (i *= 2; i >= -max_count_; i *= 2)
+	{
+		if (i > -max_count_ && less(i, i - 1))
+			i--;
+		if (!compareExchange(i / 2, i))
+			break;
+	}
+}
+
+// Restore the min-heap above i, up to the median, returning true if it reached it.
+bool SlidingMedian::minSortUp(int i)
+{
+	while (i > 0 && compareExchange(i, i / 2))
+		i /= 2;
+	return i == 0;
+}
+
+bool SlidingMedian::maxSortUp(int i)
+{
+	while (i < 0 && compareExchange(i / 2, i))
+		i /= 2;
+	return i == 0;
+}
+
+void SlidingMedian::Insert(float value)
+{
+	const int p = pos_[next_];
+	const float old = data_[next_];
+	data_[next_] = value;
+	next_ = (next_ + 1) % window_;
+	if (p > 0)
+	{
+		// The new value replaces one in the min-heap.
+		if (min_count_ < (window_ - 1) / 2)
+			min_count_++;
+		else if (value > old)
+		{
+			minSortDown(p);
+			return;
+		}
+		if (minSortUp(p) && compareExchange(0, -1))
+			maxSortDown(-1);
+	}
+	else if (p < 0)
+	{
+		// Or in the max-heap.
+		if (max_count_ < window_ / 2)
+			max_count_++;
+		else if (value < old)
+		{
+			maxSortDown(p);
+			return;
+		}
+		if (maxSortUp(p) && min_count_ && compareExchange(1, 0))
+			minSortDown(1);
+	}
+	else
+	{
+		// Or the median itself.
+		if (max_count_ && maxSortUp(-1))
+			maxSortDown(-1);
+		if (min_count_ && minSortUp(1))
+			minSortDown(1);
+	}
+}
+
+float SlidingMedian::Median() const
+{
+	float median = data_[heap_[0]];
+	if (min_count_ < max_count_)
+		median = (median + data_[heap_[-1]]) / 2;
+	return median;
+}
+
+SpikeFilter::SpikeFilter() : bins_(0), window_(0), frames_(0)
+{
+}
+
+void SpikeFilter::Reset(unsigned int bins, unsigned int window)
+{
+	bins_ = bins;
+	window_ = window ? window | 1 : 0;
+	frames_ = 0;
+	const size_t size = (size_t)bins_ * window_;
+	data_.resize(size);
+	pos_.resize(size);
+	heap_.resize(size);
+	medians_.clear();
+	medians_.reserve(window_ ? bins_ : 0);
+	for (unsigned int b = 0; window_ && b < bins_; b++)
+	{
+		const size_t offset = (size_t)b * window_;
+		medians_.emplace_back(&data_[offset], &pos_[offset], &heap_[offset], window_);
+	}
+	deviation_.assign(bins_, 0.0f);
+}
+
+unsigned int SpikeFilter::Filter(float *spectrum, float sigma)
+{
+	if (!window_)
+		return 0;
+	// Until the window is full there isn't the history to judge by.
+	const bool judge = ++frames_ > window_;
+	// Start with a plain mean of the noise, to get a sensible figure for it straight away.
+	const float alpha = frames_ > 1 ? std::max(DEVIATION_ALPHA, 1.0f / (frames_ - 1)) : 0;
+	unsigned int spikes = 0;
+	for (unsigned int b = 0; b < bins_; b++)
+	{
+		// Each value is judged against the history before it.
+		SlidingMedian &median = medians_[b];
+		const float m = median.Median();
+		const float value = spectrum[b];
+		median.Insert(value);
+		const float distance = fabsf(value - m);
+		if (judge && distance > sigma * DEVIATION_TO_SIGMA * deviation_[b])
+		{
+			spectrum[b] = m;
+			spikes++;
+		}
+		else if (frames_ > 1)
+			deviation_[b] += alpha * (distance - deviation_[b]);
+	}
+	return spikes;
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spike_filter.hpp - reject single-frame spikes against the recent history of each bin.
+ */
+
+#pragma once
+
+#include <vector>
+
+// The running median of the last few values of one series, kept as a max-heap of the
+// lower half and a min-heap of the upper half meeting at the median, so each new value
+// costs O(log window). The window's storage belongs to whoever made it.
+class SlidingMedian
+{
+public:
+	// data, pos and heap each have room for window values.
+	SlidingMedian(float *data, int *pos, int *heap, int window);
+	void Insert(float value);
+	float Median() const;
+
+private:
+	bool less(int i, int j) const { return data_[heap_[i]] < data_[heap_[j]]; }
+	bool exchange(int i, int j);
+	bool compareExchange(int i, int j) { return less(i, j) && exchange(i, j); }
+	void minSortDown(int i);
+	void maxSortDown(int i);
+	bool minSortUp(int i);
+	bool maxSortUp(int i);
+
+	float *data_; // in order of arrival, round and round
+	int *pos_; // where each value is in the heap
+	int *heap_; // the median at 0, the max-heap at negative indices and the min-heap at positive
+	int window_;
+	int next_; // the oldest value, to be replaced next
+	int min_count_;
+	int max_count_;
+};
+
+// Single-frame spikes, from particle hits, flicker or a pixel misbehaving, stand out
+// from what the same bin has been doing lately. A value more than sigma times the bin's
+// noise from the median of its recent history is replaced by that median. The noise is
+// a rolling mean of the distance from the median of the values that were kept. A real
+// step in the spectrum is held back for half a window until the median follows it.
+class SpikeFilter
+{
+public:
+	SpikeFilter();
+	// The medians point into the filter's own storage.
+	SpikeFilter(SpikeFilter const &) = delete;
+	SpikeFilter &operator=(SpikeFilter const &) = delete;
+	SpikeFilter(SpikeFilter &&) = default;
+	SpikeFilter &operator=(SpikeFilter &&) = default;
+	// Follow this many bins over a window of this many frames (made odd), forgetting any
+	// history. A window of 0 turns the filter off.
+	void Reset(unsigned int bins, unsigned int window);
+	unsigned int Window() const { return window_; }
+	// Add a spectrum to the history, replacing its spikes in place. Returns how many there were.
+	unsigned int Filter(float *spectrum, float sigma);
+
+private:
+	unsigned int bins_;
+	unsigned int window_;
+	unsigned int frames_; // since the Reset
+	std::vector<float> data_;
+	std::vector<int> pos_;
+	std::vector<int> heap_;
+	std::vector<SlidingMedian> medians_;
+	std::vector<float> deviation_;
+};
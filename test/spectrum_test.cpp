@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * spectrum_test.cpp - check the spectrum engine against the ground truth of synthetic frames.
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <libcamera/formats.h>
+
+#include "core/spectrum_generator.hpp"
+#include "spectrum/spectrum_engine.hpp"
+
+// How far the fitted wavelengths may be from the generator's, in nm, and the colour
+// temperatures from the blackbodies', as a fraction of them.
+#define WAVELENGTH_TOLERANCE 0.1
+#define CCT_TOLERANCE 0.01
+
+static const float CHECK_WAVELENGTHS[] = { 400, 450, 500, 550, 600, 650, 700, 750 };
+
+static StreamInfo stream_info()
+{
+	StreamInfo info;
+	info.width = 1280;
+	info.height = 256;
+	info.stride = 1280;
+	info.pixel_format = libcamera::formats::YUV420;
+	return info;
+}
+
+static void extract(SpectrumEngine &engine, SpectrumGenerator &generator, StreamInfo const &info,
+					std::vector<uint8_t> &frame)
+{
+	generator.Read(frame.data(), info);
+	engine.Extract(frame.data(), info);
+	engine.Calibrate();
+}
+
+// Fit the wavelengths to a fluorescent lamp's lines, running either way along the frame.
+static bool test_wavelengths(float wavelength_min, float wavelength_max)
+{
+	StreamInfo info = stream_info();
+	std::vector<uint8_t> frame(info.stride * info.height * 3 / 2);
+	SpectrumGenerator::Config config;
+	config.wavelength_min = wavelength_min;
+	config.wavelength_max = wavelength_max;
+	config.full_well = 4000;
+	config.read_noise = 8;
+	SpectrumGenerator lamp(config);
+	SpectrumEngine engine;
+	engine.Configure(info);
+	engine.SetLineIdentification(true);
+	extract(engine, lamp, info, frame);
+	if (!engine.ParsePeaks())
+	{
+		std::cerr << "wavelengths " << wavelength_min << "-" << wavelength_max << " nm: no fit" << std::endl;
+		return false;
+	}
+
+	bool ok = true;
+	for (float nm : CHECK_WAVELENGTHS)
+	{
+		const double error = engine.Wavelength(lamp.Column(nm)) - nm;
+		if (std::abs(error) > WAVELENGTH_TOLERANCE)
+		{
+			std::cerr << "wavelengths " << wavelength_min << "-" << wavelength_max << " nm: " << nm
+					  << " nm is fitted " << error << " nm out" << std::endl;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// Take the response against a lamp of known temperature, and then the colour of blackbodies.
+static bool test_colour()
+{
+	StreamInfo info = stream_info();
+	std::vector<uint8_t> frame(info.stride * info.height * 3 / 2);
+	SpectrumGenerator::Config config;
+	config.lines = 0;
+	config.continuum = 0.6;
+	config.band_width = 0.25;
+	config.full_well = 5000;
+	config.read_noise = 3;
+	SpectrumGenerator::Config dark_config = config;
+	dark_config.temperature = 0;
+	SpectrumGenerator dark(dark_config);
+	SpectrumGenerator::Config fluorescent_config;
+	SpectrumGenerator fluorescent(fluorescent_config);
+
+	SpectrumEngine engine;
+	engine.Configure(info);
+	engine.SetLineIdentification(true);
+	extract(engine, fluorescent, info, frame);
+	if (!engine.ParsePeaks())
+	{
+		std::cerr << "colour: no wavelength fit" << std::endl;
+		return false;
+	}
+	engine.SetLineIdentification(false);
+	dark.Read(frame.data(), info);
+	engine.Extract(frame.data(), info);
+	engine.DarkCal();
+	config.temperature = 2800;
+	SpectrumGenerator lamp(config);
+	engine.SetLampTemperature(config.temperature);
+	engine.IncandescentCal(8);
+	do
+		extract(engine, lamp, info, frame);
+	while (engine.LampFramesLeft());
+
+	engine.SetColorimetry(true);
+	bool ok = true;
+	for (float temperature : { 2800, 4500, 6500 })
+	{
+		config.temperature = temperature;
+		config.seed = temperature;
+		SpectrumGenerator source(config);
+		extract(engine, source, info, frame);
+		LightColour const &colour = engine.Colour();
+		if (!colour.valid || std::abs(colour.cct - temperature) > CCT_TOLERANCE * temperature)
+		{
+			std::cerr << "colour: " << temperature << " K blackbody measured as " << colour.cct << " K"
+					  << (colour.valid ? "" : " (not valid)") << std::endl;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+int main()
+{
+	bool ok = test_wavelengths(380, 780);
+	ok = test_wavelengths(780, 380) && ok;
+	ok = test_colour() && ok;
+	std::cerr << (ok ? "passed" : "FAILED") << std::endl;
+	return ok ? 0 : 1;
+}